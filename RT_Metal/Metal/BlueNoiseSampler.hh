@@ -0,0 +1,218 @@
+#ifndef BlueNoiseSampler_h
+#define BlueNoiseSampler_h
+
+#include "Common.hh"
+
+#define BLUE_NOISE_TILE 128
+#define BLUE_NOISE_DIMENSIONS 8
+#define BLUE_NOISE_SAMPLES 256
+#define BLUE_NOISE_SEED 0x9e3779b9u // fixed, so the tiles built once can be cached
+
+#ifdef __METAL_VERSION__
+
+#include "SobolSampler.hh"
+
+// Heitz et al. 2019, "A Low-Discrepancy Sampler that Distributes Monte Carlo Errors as a Blue Noise in Screen Space".
+// Each pixel walks the first 256 Sobol points in its own order (ranking tile) and xors the
+// 8-bit result (scrambling tile), so neighbouring pixels get decorrelated, blue-noise distributed error.
+// Past the tile dimensions or sample budget it continues as a plain scrambled Sobol sampler.
+struct BlueNoiseSampler {
+    pbrt::SobolSampler sobol;
+
+    constant uchar2* tiles;
+    uint32_t tileOffset;
+    uint32_t sampleIndex;
+
+    BlueNoiseSampler(thread pcg32_t* rng, constant uchar2* tiles, const thread uint2& pixel, uint32_t sampleIndex):
+        sobol(rng, pixel, sampleIndex), tiles(tiles), sampleIndex(sampleIndex)
+    {
+        auto pm = pixel % BLUE_NOISE_TILE;
+        tileOffset = (pm.x + pm.y * BLUE_NOISE_TILE) * BLUE_NOISE_DIMENSIONS;
+    }
+
+    float random() {
+        return sobol.random();
+    }
+
+    inline float sample1D() {
+        auto dim = sobol.dimension;
+        if (sampleIndex >= BLUE_NOISE_SAMPLES || dim >= BLUE_NOISE_DIMENSIONS) {
+            return sobol.sample1D();
+        }
+        sobol.dimension++;
+
+        auto tile = tiles[tileOffset + dim];
+        uint32_t rankedIndex = (sampleIndex ^ tile.x) & (BLUE_NOISE_SAMPLES - 1);
+        uint32_t value = (pbrt::SobolSampleBits(rankedIndex, dim) >> 24) ^ tile.y;
+
+        return (0.5 + value) / BLUE_NOISE_SAMPLES;
+    }
+
+    float2 sample2D() {
+        auto a = sample1D();
+        auto b = sample1D();
+
+        return float2(a, b);
+    }
+
+    float3 sample3D() {
+        auto a = sample1D();
+        auto b = sample1D();
+        auto c = sample1D();
+
+        return float3(a, b, c);
+    }
+
+    float3 sampleUnit() {
+        return UniformSampleSphere(sample2D());
+    }
+
+    float2 sampleUnitInDisk() {
+        return ConcentricSampleDisk(sample2D());
+    }
+
+    float3 sampleUnitInSphere() {
+        return UniformSampleSphere(sample2D());
+    }
+
+    float3 randomUnitInHemisphere(const thread float3& normal) {
+        float3 direction = sampleUnit();
+        if (dot(normal, direction) > 0) {
+            return direction;
+        } else {
+            return -direction;
+        }
+    }
+};
+
+#else
+
+#include <cmath>
+#include <cfloat>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+// Void-and-cluster (Ulichney 1993) on a toroidal n*n tile, returns the rank of every pixel
+inline std::vector<uint16_t> VoidAndCluster(uint32_t n, uint32_t seed, float sigma = 1.5) {
+
+    const uint32_t count = n * n;
+
+    std::vector<float> kernel(count);
+    for (uint32_t y = 0; y < n; ++y) {
+        for (uint32_t x = 0; x < n; ++x) {
+            float dx = std::min(x, n - x), dy = std::min(y, n - y);
+            kernel[x + y * n] = std::exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+        }
+    }
+
+    std::vector<uint8_t> pattern(count, 0);
+    std::vector<float> energy(count, 0);
+
+    // The gaussian is negligible past 4 sigma, so only the surrounding window is updated
+    const int32_t radius = std::min(int32_t(std::ceil(4 * sigma)), int32_t(n / 2) - 1);
+
+    auto splat = [&](uint32_t p, float sign) {
+        int32_t px = p % n, py = p / n;
+        for (int32_t dy = -radius; dy <= radius; ++dy) {
+            uint32_t y = (py + dy + n) % n, ky = ((dy + n) % n) * n;
+            for (int32_t dx = -radius; dx <= radius; ++dx) {
+                uint32_t x = (px + dx + n) % n;
+                energy[x + y * n] += sign * kernel[(dx + n) % n + ky];
+            }
+        }
+    };
+
+    // Tightest cluster among the set pixels, or largest void among the empty ones
+    auto extreme = [&](uint8_t value) {
+        uint32_t best = 0; float bestEnergy = value ? -FLT_MAX : FLT_MAX;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (pattern[i] != value) { continue; }
+            if (value ? energy[i] > bestEnergy : energy[i] < bestEnergy) {
+                best = i; bestEnergy = energy[i];
+            }
+        }
+        return best;
+    };
+
+    std::mt19937 rng(seed);
+    uint32_t ones = count / 10;
+    for (uint32_t placed = 0; placed < ones; ) {
+        uint32_t p = rng() % count;
+        if (pattern[p]) { continue; }
+        pattern[p] = 1; splat(p, 1); ++placed;
+    }
+
+    // Relax the initial pattern until moving the tightest cluster fills the largest void in place
+    for (uint32_t iteration = 0; iteration < count; ++iteration) {
+        uint32_t cluster = extreme(1);
+        pattern[cluster] = 0; splat(cluster, -1);
+
+        uint32_t hole = extreme(0);
+        pattern[hole] = 1; splat(hole, 1);
+
+        if (hole == cluster) { break; }
+    }
+
+    std::vector<uint16_t> rank(count);
+
+    auto initialPattern = pattern;
+    auto initialEnergy = energy;
+
+    for (uint32_t r = ones; r > 0; --r) {
+        uint32_t cluster = extreme(1);
+        pattern[cluster] = 0; splat(cluster, -1);
+        rank[cluster] = r - 1;
+    }
+
+    pattern = initialPattern;
+    energy = initialEnergy;
+
+    for (uint32_t r = ones; r < count; ++r) {
+        uint32_t hole = extreme(0);
+        pattern[hole] = 1; splat(hole, 1);
+        rank[hole] = r;
+    }
+
+    return rank;
+}
+
+// Interleaved (ranking, scrambling) bytes per pixel and dimension. Every dimension reads the
+// same blue-noise mask under a different toroidal shift, stepped along the R2 sequence.
+inline std::vector<uint8_t> BuildBlueNoiseTiles(uint32_t seed) {
+
+    const uint32_t n = BLUE_NOISE_TILE;
+    const uint32_t shift = 6; // 128*128 ranks down to 256 levels
+
+    auto mask = VoidAndCluster(n, seed);
+    std::vector<uint8_t> tiles(n * n * BLUE_NOISE_DIMENSIONS * 2);
+
+    auto offset = [n](uint32_t k) {
+        const double a1 = 0.7548776662466927, a2 = 0.5698402909980532;
+        auto ox = uint32_t(std::fmod(0.5 + a1 * k, 1.0) * n);
+        auto oy = uint32_t(std::fmod(0.5 + a2 * k, 1.0) * n);
+        return std::make_pair(ox, oy);
+    };
+
+    for (uint32_t d = 0; d < BLUE_NOISE_DIMENSIONS; ++d) {
+        auto rankShift = offset(2 * d + 1);
+        auto scrambleShift = offset(2 * d + 2);
+
+        for (uint32_t y = 0; y < n; ++y) {
+            for (uint32_t x = 0; x < n; ++x) {
+                auto rx = (x + rankShift.first) % n, ry = (y + rankShift.second) % n;
+                auto sx = (x + scrambleShift.first) % n, sy = (y + scrambleShift.second) % n;
+
+                auto i = ((x + y * n) * BLUE_NOISE_DIMENSIONS + d) * 2;
+                tiles[i + 0] = mask[rx + ry * n] >> shift;
+                tiles[i + 1] = mask[sx + sy * n] >> shift;
+            }
+        }
+    }
+
+    return tiles;
+}
+
+#endif
+
+#endif /* BlueNoiseSampler_h */
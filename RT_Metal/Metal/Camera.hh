@@ -20,6 +20,14 @@ struct Camera {
     float3 cornerLowLeft;
 };
 
+enum struct SamplerType { Sobol, Halton, BlueNoise, Random };
+
+// Photon lookup of the SPPM gather
+enum struct PhotonGather { HashGrid, KDTree };
+
+// Picked by the Integrator user default, SPPM unless another is asked for. BDPT is VCM without merging
+enum struct Integrator { VCM, BDPT, SPPM, PathTracing, PathGuiding, ReSTIR };
+
 struct Transform {
     float4x4 m, w;
 };
@@ -30,6 +38,9 @@ struct Complex {
     float running_time;
     uint32_t frame_count=0;
     
+    enum SamplerType sampler;
+    enum Integrator integrator;
+    
     AABB   photonBox;
     float3 photonBoxSize;
     
@@ -37,8 +48,20 @@ struct Complex {
     
     float photonHashScale;
     
+    enum PhotonGather photonGather;
+    uint32_t photonTreeCount;
+    
+    // Share of uniform photon paths seen by the camera, scales the chain photons to flux
+    float photonVisibleFraction = 1;
+    
     float totalPhotonSum = 0;
     
+    // Guided camera paths leave training records while the SD-trees are learned
+    uint32_t guideTraining = 0;
+    
+    // History a reprojected reservoir may bring, in multiples of the candidates of one frame
+    uint32_t restirTemporalCap = 20;
+    
 #ifdef __METAL_VERSION__
     volatile atomic_uint framePhotonSum {0};
 #else
@@ -68,6 +91,33 @@ Ray castRay(constant Camera* camera, float s, float t, thread XSampler* xsampler
     return Ray(origin, sample - origin);
 }
 
+// Where p lands on the image of the pinhole, in [0, 1)^2 when it is in view
+inline float2 CameraProject(constant Camera* camera, float3 p)
+{
+    auto n = cross(camera->horizontal, camera->vertical);
+    auto d = p - camera->lookFrom;
+    
+    auto denom = dot(d, n);
+    if (denom == 0) { return float2(-1); }
+    
+    auto t = dot(camera->cornerLowLeft - camera->lookFrom, n) / denom;
+    if (t <= 0) { return float2(-1); }
+    
+    auto q = camera->lookFrom + t * d - camera->cornerLowLeft;
+    return float2(dot(q, camera->horizontal) / length_squared(camera->horizontal),
+                  dot(q, camera->vertical) / length_squared(camera->vertical));
+}
+
+// Screen space motion of a point since the previous view, in pixels, current minus previous.
+// A point behind the previous view moves out of the image, so its history is dropped.
+inline float2 CameraMotion(constant Camera* camera, constant Camera* previous, float3 p, float2 size)
+{
+    auto now = CameraProject(camera, p);
+    auto before = CameraProject(previous, p);
+    if (all(before == -1)) { return size * 2; }
+    return (now - before) * size;
+}
+
 #endif
 
 #endif /* Camera_h */
@@ -36,6 +36,7 @@ struct Cube {
         range_t.y = _record.t;
         
         _record.material = material;
+        _record.light = UINT_MAX;
         _record.modelMatrix = model_matrix;
         
         auto normal = float4(_record.gn, 0.0);
@@ -0,0 +1,121 @@
+#ifndef Distribution_h
+#define Distribution_h
+
+#include "Common.hh"
+
+#ifndef __METAL_VERSION__
+    #include <cmath>
+    #include <vector>
+    #include <algorithm>
+#endif
+
+// Piecewise-constant 2D distribution (pbrt-v3 Distribution2D) flattened into one float array:
+// conditional func [nv*nu], conditional cdf [nv*(nu+1)], marginal func [nv], marginal cdf [nv+1].
+// The marginal func is the integral of each conditional row.
+struct Distribution2D {
+    uint32_t nu, nv;
+    float integral;
+
+#ifdef __METAL_VERSION__
+
+    inline uint32_t conditionalFunc(uint32_t v) constant { return v * nu; }
+    inline uint32_t conditionalCDF(uint32_t v) constant { return nv * nu + v * (nu + 1); }
+    inline uint32_t marginalFunc() constant { return nv * nu + nv * (nu + 1); }
+    inline uint32_t marginalCDF() constant { return marginalFunc() + nv; }
+
+    static float sample1D(constant float* func, constant float* cdf, uint32_t n, float funcInt,
+                          float u, thread float& pdf, thread uint32_t& offset) {
+
+        // Largest index with cdf[index] <= u
+        int first = 0, len = n + 1;
+        while (len > 0) {
+            int half = len >> 1, middle = first + half;
+            if (cdf[middle] <= u) {
+                first = middle + 1;
+                len -= half + 1;
+            } else {
+                len = half;
+            }
+        }
+        offset = clamp(first - 1, 0, int(n) - 1);
+
+        float du = u - cdf[offset];
+        if (cdf[offset + 1] - cdf[offset] > 0) {
+            du /= cdf[offset + 1] - cdf[offset];
+        }
+
+        pdf = funcInt > 0 ? func[offset] / funcInt : 0;
+        return (offset + du) / n;
+    }
+
+    float2 sample(constant float* data, float2 u, thread float& pdf) constant {
+
+        float pdfs[2]; uint32_t v, iu;
+
+        auto mf = marginalFunc();
+        float d1 = sample1D(data + mf, data + marginalCDF(), nv, integral, u[1], pdfs[1], v);
+        float d0 = sample1D(data + conditionalFunc(v), data + conditionalCDF(v), nu, data[mf + v], u[0], pdfs[0], iu);
+
+        pdf = pdfs[0] * pdfs[1];
+        return float2(d0, d1);
+    }
+
+    float PDF(constant float* data, float2 p) constant {
+
+        uint32_t iu = clamp(uint32_t(p[0] * nu), 0u, nu - 1);
+        uint32_t iv = clamp(uint32_t(p[1] * nv), 0u, nv - 1);
+
+        if (integral <= 0) { return 0; }
+        return data[conditionalFunc(iv) + iu] / integral;
+    }
+
+#else
+
+    inline uint32_t conditionalFunc(uint32_t v) const { return v * nu; }
+    inline uint32_t conditionalCDF(uint32_t v) const { return nv * nu + v * (nu + 1); }
+    inline uint32_t marginalFunc() const { return nv * nu + nv * (nu + 1); }
+    inline uint32_t marginalCDF() const { return marginalFunc() + nv; }
+    inline uint32_t size() const { return marginalCDF() + nv + 1; }
+
+    // Builds the distribution of func, given row by row, into data
+    static Distribution2D make(const std::vector<float>& func, uint32_t nu, uint32_t nv, std::vector<float>& data) {
+
+        Distribution2D r { nu, nv, 0 };
+        data.assign(r.size(), 0);
+
+        auto build1D = [](const float* f, uint32_t n, float* func, float* cdf) {
+
+            std::copy(f, f + n, func);
+
+            cdf[0] = 0;
+            for (uint32_t i = 1; i < n + 1; ++i) {
+                cdf[i] = cdf[i - 1] + std::abs(func[i - 1]) / n;
+            }
+
+            float funcInt = cdf[n];
+            if (funcInt == 0) {
+                for (uint32_t i = 1; i < n + 1; ++i) { cdf[i] = float(i) / n; }
+            } else {
+                for (uint32_t i = 1; i < n + 1; ++i) { cdf[i] /= funcInt; }
+            }
+            return funcInt;
+        };
+
+        std::vector<float> rowIntegral(nv);
+
+        for (uint32_t v = 0; v < nv; ++v) {
+            rowIntegral[v] = build1D(func.data() + v * nu, nu,
+                                     data.data() + r.conditionalFunc(v),
+                                     data.data() + r.conditionalCDF(v));
+        }
+
+        r.integral = build1D(rowIntegral.data(), nv,
+                             data.data() + r.marginalFunc(),
+                             data.data() + r.marginalCDF());
+        return r;
+    }
+
+#endif
+};
+
+#endif /* Distribution_h */
@@ -0,0 +1,190 @@
+#ifndef HaltonSampler_h
+#define HaltonSampler_h
+
+#include "Common.hh"
+
+#define HALTON_DIMENSIONS 128
+
+// Prime bases, and where each base's digit permutation starts in the packed table
+struct PrimeTable {
+    uint16_t prime[HALTON_DIMENSIONS];
+    uint32_t offset[HALTON_DIMENSIONS];
+    uint32_t total;
+
+    constexpr PrimeTable(): prime(), offset(), total(0) {
+        uint32_t count = 0;
+        for (uint16_t n = 2; count < HALTON_DIMENSIONS; ++n) {
+            bool isPrime = true;
+            for (uint32_t j = 0; j < count && prime[j] * prime[j] <= n; ++j) {
+                if (n % prime[j] == 0) { isPrime = false; break; }
+            }
+            if (!isPrime) { continue; }
+
+            prime[count] = n;
+            offset[count] = total;
+            total += n;
+            ++count;
+        }
+    }
+};
+
+#ifdef __METAL_VERSION__
+
+#include "Random.hh"
+#include "Sampling.hh"
+
+constant constexpr PrimeTable HaltonPrimes {};
+
+// Pixels are mapped into a 128x128 tile through the first two radical inverses,
+// 2^7 and 3^5 being the smallest powers of the bases covering the tile (pbrt-v3).
+constant constexpr uint32_t HaltonScale0 = 128, HaltonExponent0 = 7;
+constant constexpr uint32_t HaltonScale1 = 243, HaltonExponent1 = 5;
+constant constexpr uint64_t HaltonSampleStride = HaltonScale0 * HaltonScale1;
+// Multiplicative inverses of 243 mod 128 and 128 mod 243
+constant constexpr uint64_t HaltonMultInverse0 = 59, HaltonMultInverse1 = 131;
+
+static constant float HaltonOneMinusEpsilon = 0x1.fffffep-1;
+
+template <uint32_t base>
+inline uint64_t InverseRadicalInverse(uint64_t inverse, uint32_t nDigits) {
+    uint64_t index = 0;
+    for (uint32_t i = 0; i < nDigits; ++i) {
+        uint64_t digit = inverse % base;
+        inverse /= base;
+        index = index * base + digit;
+    }
+    return index;
+}
+
+inline float RadicalInverse(uint32_t base, uint64_t a) {
+    if (base == 2) {
+        return min(reverse_bits(uint32_t(a)) * 0x1p-32f, HaltonOneMinusEpsilon);
+    }
+
+    float invBase = 1.0 / base, invBaseN = 1;
+    uint64_t reversedDigits = 0;
+    while (a) {
+        uint64_t next = a / base;
+        uint64_t digit = a - next * base;
+        reversedDigits = reversedDigits * base + digit;
+        invBaseN *= invBase;
+        a = next;
+    }
+    return min(reversedDigits * invBaseN, HaltonOneMinusEpsilon);
+}
+
+inline float ScrambledRadicalInverse(uint32_t base, uint64_t a, constant uint16_t* perm) {
+    float invBase = 1.0 / base, invBaseN = 1;
+    uint64_t reversedDigits = 0;
+    while (a) {
+        uint64_t next = a / base;
+        uint64_t digit = a - next * base;
+        reversedDigits = reversedDigits * base + perm[digit];
+        invBaseN *= invBase;
+        a = next;
+    }
+    // Account for the infinite tail of permuted zero digits
+    float tail = invBase * perm[0] / (1 - invBase);
+    return min(invBaseN * (reversedDigits + tail), HaltonOneMinusEpsilon);
+}
+
+struct HaltonSampler {
+    thread pcg32_t* rng;
+    constant uint16_t* permutations;
+
+    uint64_t index;
+    uint dimension;
+
+    HaltonSampler(thread pcg32_t* rng, constant uint16_t* permutations, const thread uint2& pixel, uint32_t sampleIndex):
+        rng(rng), permutations(permutations), dimension(0)
+    {
+        uint64_t pixelOffset = 0;
+
+        auto pm = pixel % 128;
+        pixelOffset += InverseRadicalInverse<2>(pm.x, HaltonExponent0) * (HaltonSampleStride / HaltonScale0) * HaltonMultInverse0;
+        pixelOffset += InverseRadicalInverse<3>(pm.y, HaltonExponent1) * (HaltonSampleStride / HaltonScale1) * HaltonMultInverse1;
+        pixelOffset %= HaltonSampleStride;
+
+        index = pixelOffset + sampleIndex * HaltonSampleStride;
+    }
+
+    float random() {
+        return randomF(rng);
+    }
+
+    inline float sample1D() {
+        if (dimension >= HALTON_DIMENSIONS) { return randomF(rng); }
+
+        auto dim = dimension++;
+
+        if (dim == 0) {
+            return RadicalInverse(2, index >> HaltonExponent0);
+        } else if (dim == 1) {
+            return RadicalInverse(3, index / HaltonScale1);
+        }
+
+        return ScrambledRadicalInverse(HaltonPrimes.prime[dim], index, permutations + HaltonPrimes.offset[dim]);
+    }
+
+    float2 sample2D() {
+        auto a = sample1D();
+        auto b = sample1D();
+
+        return float2(a, b);
+    }
+
+    float3 sample3D() {
+        auto a = sample1D();
+        auto b = sample1D();
+        auto c = sample1D();
+
+        return float3(a, b, c);
+    }
+
+    float3 sampleUnit() {
+        return UniformSampleSphere(sample2D());
+    }
+
+    float2 sampleUnitInDisk() {
+        return ConcentricSampleDisk(sample2D());
+    }
+
+    float3 sampleUnitInSphere() {
+        return UniformSampleSphere(sample2D());
+    }
+
+    float3 randomUnitInHemisphere(const thread float3& normal) {
+        float3 direction = sampleUnit();
+        if (dot(normal, direction) > 0) {
+            return direction;
+        } else {
+            return -direction;
+        }
+    }
+};
+
+#else
+
+#include <vector>
+#include <random>
+#include <numeric>
+#include <algorithm>
+
+static constexpr PrimeTable HaltonPrimes {};
+
+// One random permutation of the digits [0, base) for every prime base
+inline std::vector<uint16_t> ComputeRadicalInversePermutations(uint32_t seed) {
+    std::vector<uint16_t> perms(HaltonPrimes.total);
+    std::mt19937 rng(seed);
+
+    for (uint32_t i = 0; i < HALTON_DIMENSIONS; ++i) {
+        auto p = perms.begin() + HaltonPrimes.offset[i];
+        std::iota(p, p + HaltonPrimes.prime[i], 0);
+        std::shuffle(p, p + HaltonPrimes.prime[i], rng);
+    }
+    return perms;
+}
+
+#endif
+
+#endif /* HaltonSampler_h */
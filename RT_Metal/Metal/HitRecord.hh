@@ -17,6 +17,7 @@ struct HitRecord {
    
     float2 uv;
     uint material;
+    uint light;
     
     float PDF;
     
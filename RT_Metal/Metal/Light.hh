@@ -2,10 +2,13 @@
 #define Light_h
 
 #include "Common.hh"
+#include "BVH.hh"
 
-#include "Ray.hh"
-#include "Spectrum.hh"
-#include "HitRecord.hh"
+#ifdef __METAL_VERSION__
+    #include "Ray.hh"
+    #include "Spectrum.hh"
+    #include "HitRecord.hh"
+#endif
 
 enum class LightFlags : int {
     DeltaPosition = 1,
@@ -21,22 +24,60 @@ inline bool IsDeltaLight(int flags) {
 
 // Light Declarations
 struct Light {
+    enum PrimitiveType pType;
+    uint32_t pIndex;
     
-public:
+    int flags;
+    float pmf; // probability of being picked from the alias table
+    uint64_t bitTrail; // path from the light BVH root, bit i set for the second child at depth i
+};
+
+// One bin of a Walker alias table: keep this bin with probability q, else take alias
+struct AliasBin {
+    float q;
+    uint32_t alias;
+};
+
+#ifndef __METAL_VERSION__
+
+#include <vector>
+
+// Vose's method, O(n) build for O(1) sampling proportional to the weights
+inline std::vector<AliasBin> BuildAliasTable(const std::vector<float>& weights, std::vector<float>& pmf) {
     
-    const PrimitiveType pType;
-    const uint32_t pIndex;
+    auto n = weights.size();
+    std::vector<AliasBin> bins(n);
     
-    const int flags;
+    double total = 0;
+    for (auto w : weights) { total += w; }
     
-    Light(PrimitiveType pt, uint32_t pi, int f):
-        pType(pt), pIndex(pi), flags(f) {}
-
-  protected:
-    // Light Protected Data
-    float4x4 LightToWorld, WorldToLight;
-};
+    pmf.resize(n);
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    
+    for (uint32_t i = 0; i < n; ++i) {
+        pmf[i] = total > 0 ? weights[i] / total : 1.0 / n;
+        scaled[i] = pmf[i] * n;
+        (scaled[i] < 1.0 ? small : large).push_back(i);
+    }
+    
+    while (!small.empty() && !large.empty()) {
+        auto s = small.back(); small.pop_back();
+        auto l = large.back(); large.pop_back();
+        
+        bins[s] = { float(scaled[s]), l };
+        scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+        
+        (scaled[l] < 1.0 ? small : large).push_back(l);
+    }
+    // Leftovers are 1 up to rounding
+    for (auto i : large) { bins[i] = { 1.0, i }; }
+    for (auto i : small) { bins[i] = { 1.0, i }; }
+    
+    return bins;
+}
 
+#endif
 
 #ifdef __METAL_VERSION__
 
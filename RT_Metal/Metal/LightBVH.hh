@@ -0,0 +1,320 @@
+#ifndef LightBVH_h
+#define LightBVH_h
+
+#include "Common.hh"
+#include "AABB.hh"
+#include "Light.hh"
+
+// Spatial and directional bounds of the emission below a light BVH node (pbrt-v4 LightBounds)
+struct LightBounds {
+    AABB bounds;
+    float3 w;
+    float phi = 0;
+    float cosTheta_o;
+    float cosTheta_e;
+    bool twoSided;
+};
+
+struct LightBVHNode {
+    LightBounds lightBounds;
+    // Second child for interior nodes (the first child directly follows), light index for leaves
+    uint32_t childOrLightIndex;
+    bool isLeaf;
+};
+
+#ifdef __METAL_VERSION__
+
+inline float CosSubClamped(float sinTheta_a, float cosTheta_a, float sinTheta_b, float cosTheta_b) {
+    if (cosTheta_a > cosTheta_b) { return 1; }
+    return cosTheta_a * cosTheta_b + sinTheta_a * sinTheta_b;
+}
+
+inline float SinSubClamped(float sinTheta_a, float cosTheta_a, float sinTheta_b, float cosTheta_b) {
+    if (cosTheta_a > cosTheta_b) { return 0; }
+    return sinTheta_a * cosTheta_b - cosTheta_a * sinTheta_b;
+}
+
+// Conservative estimate of the light a node can contribute at p, for a surface with normal n
+inline float LightImportance(constant LightBounds& lb, float3 p, float3 n) {
+
+    auto pc = (lb.bounds.mini + lb.bounds.maxi) / 2;
+    auto radius = length(lb.bounds.maxi - lb.bounds.mini) / 2;
+
+    // The clamp keeps the falloff finite near the node, the subtended cone takes the real distance
+    float dc2 = distance_squared(p, pc);
+    float d2 = max(dc2, radius);
+
+    float3 wi = normalize(p - pc);
+    float cosTheta_w = dot(lb.w, wi);
+    if (lb.twoSided) { cosTheta_w = abs(cosTheta_w); }
+    float sinTheta_w = sqrt(max(0.0, 1 - cosTheta_w * cosTheta_w));
+
+    // Cone of directions subtended by the bounding sphere
+    float cosTheta_b = -1;
+    if (dc2 > radius * radius) {
+        cosTheta_b = sqrt(max(0.0, 1 - radius * radius / dc2));
+    }
+    float sinTheta_b = sqrt(max(0.0, 1 - cosTheta_b * cosTheta_b));
+
+    float sinTheta_o = sqrt(max(0.0, 1 - lb.cosTheta_o * lb.cosTheta_o));
+    float cosTheta_x = CosSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, lb.cosTheta_o);
+    float sinTheta_x = SinSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, lb.cosTheta_o);
+    float cosTheta_p = CosSubClamped(sinTheta_x, cosTheta_x, sinTheta_b, cosTheta_b);
+
+    if (cosTheta_p <= lb.cosTheta_e) { return 0; }
+
+    float importance = lb.phi * cosTheta_p / d2;
+
+    if (any(n != 0)) {
+        float cosTheta_i = abs(dot(wi, n));
+        float sinTheta_i = sqrt(max(0.0, 1 - cosTheta_i * cosTheta_i));
+        importance *= CosSubClamped(sinTheta_i, cosTheta_i, sinTheta_b, cosTheta_b);
+    }
+
+    return max(importance, 0.0);
+}
+
+// Walks down the tree picking children by importance, returns UINT_MAX if nothing can contribute
+inline uint SampleLightTree(constant LightBVHNode* nodes, float3 p, float3 n, float u, thread float& pmf) {
+
+    uint nodeIndex = 0; pmf = 1;
+
+    while (true) {
+        constant auto& node = nodes[nodeIndex];
+
+        if (node.isLeaf) {
+            if (nodeIndex > 0 || LightImportance(node.lightBounds, p, n) > 0) {
+                return node.childOrLightIndex;
+            }
+            return UINT_MAX;
+        }
+
+        float ci0 = LightImportance(nodes[nodeIndex + 1].lightBounds, p, n);
+        float ci1 = LightImportance(nodes[node.childOrLightIndex].lightBounds, p, n);
+
+        if (ci0 == 0 && ci1 == 0) { return UINT_MAX; }
+
+        float p0 = ci0 / (ci0 + ci1);
+
+        if (u < p0) {
+            u = min(u / p0, 0x1.fffffep-1);
+            pmf *= p0;
+            nodeIndex = nodeIndex + 1;
+        } else {
+            u = min((u - p0) / (1 - p0), 0x1.fffffep-1);
+            pmf *= 1 - p0;
+            nodeIndex = node.childOrLightIndex;
+        }
+    }
+}
+
+// Probability that SampleLightTree picks the light with the given trail of left(0)/right(1) turns
+inline float LightTreePMF(constant LightBVHNode* nodes, uint64_t bitTrail, float3 p, float3 n) {
+
+    uint nodeIndex = 0; float pmf = 1;
+
+    while (!nodes[nodeIndex].isLeaf) {
+        constant auto& node = nodes[nodeIndex];
+
+        float ci0 = LightImportance(nodes[nodeIndex + 1].lightBounds, p, n);
+        float ci1 = LightImportance(nodes[node.childOrLightIndex].lightBounds, p, n);
+
+        if (ci0 == 0 && ci1 == 0) { return 0; }
+
+        if (bitTrail & 1) {
+            pmf *= ci1 / (ci0 + ci1);
+            nodeIndex = node.childOrLightIndex;
+        } else {
+            pmf *= ci0 / (ci0 + ci1);
+            nodeIndex = nodeIndex + 1;
+        }
+        bitTrail >>= 1;
+    }
+
+    return pmf;
+}
+
+#else
+
+#include <cmath>
+#include <cfloat>
+#include <vector>
+#include <cassert>
+#include <utility>
+#include <algorithm>
+
+struct DirectionCone {
+    float3 w;
+    float cosTheta;
+};
+
+inline DirectionCone Union(const DirectionCone& a, const DirectionCone& b) {
+
+    auto theta_a = std::acos(std::clamp(a.cosTheta, -1.0f, 1.0f));
+    auto theta_b = std::acos(std::clamp(b.cosTheta, -1.0f, 1.0f));
+    auto theta_d = std::acos(std::clamp(simd_dot(a.w, b.w), -1.0f, 1.0f));
+
+    if (std::min(theta_d + theta_b, float(M_PI)) <= theta_a) { return a; }
+    if (std::min(theta_d + theta_a, float(M_PI)) <= theta_b) { return b; }
+
+    auto theta_o = (theta_a + theta_d + theta_b) / 2;
+    if (theta_o >= M_PI) { return { a.w, -1 }; }
+
+    auto theta_r = theta_o - theta_a;
+    auto wr = simd_cross(a.w, b.w);
+    if (simd_length_squared(wr) == 0) { return { a.w, -1 }; }
+
+    // Rotate a.w by theta_r around wr
+    auto q = simd_quaternion(theta_r, simd_normalize(wr));
+    return { simd_act(q, a.w), std::cos(theta_o) };
+}
+
+inline LightBounds Union(const LightBounds& a, const LightBounds& b) {
+
+    if (a.phi == 0) { return b; }
+    if (b.phi == 0) { return a; }
+
+    auto cone = Union(DirectionCone { a.w, a.cosTheta_o }, DirectionCone { b.w, b.cosTheta_o });
+
+    auto box_a = a.bounds, box_b = b.bounds;
+
+    LightBounds r;
+    r.bounds = AABB::make(box_a, box_b);
+    r.w = cone.w;
+    r.phi = a.phi + b.phi;
+    r.cosTheta_o = cone.cosTheta;
+    r.cosTheta_e = std::min(a.cosTheta_e, b.cosTheta_e);
+    r.twoSided = a.twoSided || b.twoSided;
+    return r;
+}
+
+// Surface area orientation heuristic of a split candidate
+inline float EvaluateCost(const LightBounds& b, const AABB& bounds, int dim) {
+    
+    if (b.phi == 0) { return 0; }
+
+    float theta_o = std::acos(b.cosTheta_o), theta_e = std::acos(b.cosTheta_e);
+    float theta_w = std::min(theta_o + theta_e, float(M_PI));
+    float sinTheta_o = std::sqrt(std::max(0.0f, 1 - b.cosTheta_o * b.cosTheta_o));
+
+    float M_omega = 2 * M_PI * (1 - b.cosTheta_o) +
+                    M_PI / 2 * (2 * theta_w * sinTheta_o - std::cos(theta_o - 2 * theta_w) -
+                                2 * theta_o * sinTheta_o + b.cosTheta_o);
+
+    auto d = bounds.diagonal();
+    float Kr = std::max({d.x, d.y, d.z}) / std::max(d[dim], FLT_EPSILON);
+
+    return b.phi * M_omega * Kr * b.bounds.area();
+}
+
+struct LightBVH {
+
+    std::vector<LightBVHNode> nodes;
+
+    // Takes (light index, bounds) pairs, fills the node array and every light's bit trail
+    void build(std::vector<std::pair<uint32_t, LightBounds>>& items, std::vector<Light>& lights) {
+
+        nodes.clear();
+
+        items.erase(std::remove_if(items.begin(), items.end(), [](auto& item) {
+            return item.second.phi <= 0;
+        }), items.end());
+
+        if (items.empty()) { return; }
+
+        make(items, 0, (uint32_t)items.size(), 0, 0, lights);
+    }
+
+private:
+
+    std::pair<uint32_t, LightBounds> make(std::vector<std::pair<uint32_t, LightBounds>>& items,
+                                          uint32_t start, uint32_t end,
+                                          uint64_t bitTrail, uint32_t depth,
+                                          std::vector<Light>& lights)
+    {
+        if (end - start == 1) {
+
+            auto nodeIndex = (uint32_t)nodes.size();
+            auto& item = items[start];
+
+            nodes.push_back({ item.second, item.first, true });
+            lights[item.first].bitTrail = bitTrail;
+
+            return { nodeIndex, item.second };
+        }
+
+        AABB bounds, cbox;
+        for (uint32_t i = start; i < end; ++i) {
+            bounds = AABB::make(bounds, items[i].second.bounds);
+            cbox = AABB::make(cbox, items[i].second.bounds.centroid());
+        }
+
+        const uint32_t nBuckets = 12;
+
+        // A median split needs ceil(log2(count)) more levels, once those would run the trail
+        // past 64 bits the lights are split at the median instead of by cost
+        const uint32_t levels = 32 - __builtin_clz(end - start - 1);
+        const bool balanced = depth + levels >= 64;
+
+        float minCost = FLT_MAX;
+        int minCostSplitBucket = -1, minCostSplitDim = -1;
+
+        for (int dim = 0; dim < 3 && !balanced; ++dim) {
+
+            if (cbox.maxi[dim] == cbox.mini[dim]) { continue; }
+
+            LightBounds bucketLightBounds[nBuckets];
+
+            for (uint32_t i = start; i < end; ++i) {
+                auto& lb = items[i].second;
+                uint32_t b = nBuckets * cbox.relative(lb.bounds.centroid())[dim];
+                b = std::min(b, nBuckets - 1);
+                bucketLightBounds[b] = Union(bucketLightBounds[b], lb);
+            }
+
+            for (uint32_t i = 0; i < nBuckets - 1; ++i) {
+
+                LightBounds b0, b1;
+                for (uint32_t j = 0; j <= i; ++j) { b0 = Union(b0, bucketLightBounds[j]); }
+                for (uint32_t j = i + 1; j < nBuckets; ++j) { b1 = Union(b1, bucketLightBounds[j]); }
+
+                float cost = EvaluateCost(b0, bounds, dim) + EvaluateCost(b1, bounds, dim);
+
+                if (cost > 0 && cost < minCost) {
+                    minCost = cost;
+                    minCostSplitBucket = i;
+                    minCostSplitDim = dim;
+                }
+            }
+        }
+
+        uint32_t mid = (start + end) / 2;
+
+        if (minCostSplitDim != -1) {
+            auto pmid = std::partition(items.begin() + start, items.begin() + end, [&](auto& item) {
+                uint32_t b = nBuckets * cbox.relative(item.second.bounds.centroid())[minCostSplitDim];
+                return std::min(b, nBuckets - 1) <= (uint32_t)minCostSplitBucket;
+            });
+            mid = uint32_t(pmid - items.begin());
+
+            if (mid == start || mid == end) { mid = (start + end) / 2; }
+        }
+
+        assert(depth < 64);
+
+        auto nodeIndex = (uint32_t)nodes.size();
+        nodes.push_back({});
+
+        auto child0 = make(items, start, mid, bitTrail, depth + 1, lights);
+        auto child1 = make(items, mid, end, bitTrail | (1ull << depth), depth + 1, lights);
+
+        auto lb = Union(child0.second, child1.second);
+        nodes[nodeIndex] = { lb, child1.first, false };
+
+        return { nodeIndex, lb };
+    }
+};
+
+#endif
+
+#endif /* LightBVH_h */
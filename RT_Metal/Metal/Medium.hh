@@ -5,6 +5,16 @@
     #include "Ray.hh"
     #include "Sampling.hh"
     #include "HitRecord.hh"
+#else
+    #include <cfloat>
+    #include <climits>
+    #include <cstdint>
+    #include <vector>
+    #include <cmath>
+    #include <cstring>
+    #include <cassert>
+    #include <algorithm>
+    #include <dispatch/dispatch.h>
 #endif
 
 class HomogeneousMedium;
@@ -83,6 +93,21 @@ class HomogeneousMedium {
     const float g;
 };
 
+enum struct TransmittanceEstimator { RatioTracking, ResidualRatioTracking };
+
+// Voxels per majorant cell along each axis
+#define MAJORANT_CELL 16
+// Voxels per density brick along each axis, bricks store one more for the +1 apron
+#define DENSITY_BRICK 8
+#define DENSITY_BRICK_APRON (DENSITY_BRICK + 1)
+
+// One brick of the sparse density grid, values decode as minimum + scale * stored.
+// Bricks with nothing but zero density are not stored, offset is UINT_MAX for those.
+struct DensityBrick {
+    uint offset; // in elements of the quantized storage
+    float minimum, scale;
+};
+
 struct GridDensityInfo {
     float sigma_a, sigma_s;
     float sigma_t; float g;
@@ -90,31 +115,381 @@ struct GridDensityInfo {
     float invMaxDensity;
     
     uint nx, ny, nz;
+    uint mx, my, mz; // majorant grid resolution
+    uint bx, by, bz; // brick grid resolution
+    uint bits; // 8, 16 or 32 bits per stored density
+    
+    enum TransmittanceEstimator estimator;
     
 #ifdef __METAL_VERSION__
     GridDensityInfo() {}
 #else
+    GridDensityInfo() = default;
+    
     GridDensityInfo(float sigma_a, float sigma_s, float g,
-                    int nx, int ny, int nz, float* _density)
-        : sigma_a(sigma_a), sigma_s(sigma_s), g(g), nx(nx), ny(ny), nz(nz)
+                    int nx, int ny, int nz, float* _density, uint bits = 32,
+                    TransmittanceEstimator estimator = TransmittanceEstimator::ResidualRatioTracking)
+        : sigma_a(sigma_a), sigma_s(sigma_s), g(g), nx(nx), ny(ny), nz(nz), bits(bits), estimator(estimator)
     {
         sigma_t = (sigma_a + sigma_s);
         
-        float maxDensity = 0;
-        for (int i = 0; i < (nx * ny * nz); ++i) {
-            maxDensity = fmax(maxDensity, _density[i]);
-        }
+        // Max over chunks in parallel, then over the chunk results
+        const size_t count = size_t(nx) * ny * nz;
+        const size_t chunks = 64, quota = (count + chunks - 1) / chunks;
+        
+        float chunkMax[chunks] = {};
+        float* chunkMaxPtr = chunkMax;
+        
+        dispatch_apply(chunks, dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^(size_t c) {
+            float maxDensity = 0;
+            for (size_t i = c * quota; i < std::min(count, (c + 1) * quota); ++i) {
+                maxDensity = fmax(maxDensity, _density[i]);
+            }
+            chunkMaxPtr[c] = maxDensity;
+        });
+        
+        float maxDensity = *std::max_element(chunkMax, chunkMax + chunks);
         invMaxDensity = 1 / maxDensity;
+        
+        mx = (nx + MAJORANT_CELL - 1) / MAJORANT_CELL;
+        my = (ny + MAJORANT_CELL - 1) / MAJORANT_CELL;
+        mz = (nz + MAJORANT_CELL - 1) / MAJORANT_CELL;
+        
+        bx = (nx + DENSITY_BRICK - 1) / DENSITY_BRICK;
+        by = (ny + DENSITY_BRICK - 1) / DENSITY_BRICK;
+        bz = (nz + DENSITY_BRICK - 1) / DENSITY_BRICK;
+    }
+    
+    // Splits the dense grid into bricks, leaving out the empty ones, and quantizes each
+    // brick against its own value range. Returns the byte size of the stored values.
+    size_t makeBricks(const float* _density, std::vector<DensityBrick>& table, std::vector<uint8_t>& data) const {
+        
+        const uint A = DENSITY_BRICK_APRON;
+        const uint elementSize = bits / 8;
+        
+        table.assign(bx * by * bz, { UINT_MAX, 0, 0 });
+        data.clear();
+        
+        std::vector<float> values(A * A * A);
+        uint stored = 0;
+        
+        for (uint z = 0; z < bz; ++z) {
+            for (uint y = 0; y < by; ++y) {
+                for (uint x = 0; x < bx; ++x) {
+                    
+                    float minimum = FLT_MAX, maximum = 0;
+                    
+                    for (uint k = 0; k < A * A * A; ++k) {
+                        uint vx = x * DENSITY_BRICK + k % A;
+                        uint vy = y * DENSITY_BRICK + (k / A) % A;
+                        uint vz = z * DENSITY_BRICK + k / (A * A);
+                        
+                        // The apron past the grid reads as empty, like out of range lookups
+                        float value = 0;
+                        if (vx < nx && vy < ny && vz < nz) {
+                            value = _density[(vz * ny + vy) * nx + vx];
+                        }
+                        values[k] = value;
+                        
+                        minimum = fmin(minimum, value);
+                        maximum = fmax(maximum, value);
+                    }
+                    
+                    if (maximum <= 0) { continue; }
+                    
+                    auto& brick = table[(z * by + y) * bx + x];
+                    brick.offset = stored;
+                    stored += A * A * A;
+                    
+                    data.resize(stored * elementSize);
+                    auto ptr = data.data() + brick.offset * elementSize;
+                    
+                    if (bits == 32) {
+                        brick.minimum = 0; brick.scale = 1;
+                        memcpy(ptr, values.data(), values.size() * sizeof(float));
+                        continue;
+                    }
+                    
+                    float levels = bits == 8 ? UINT8_MAX : UINT16_MAX;
+                    brick.minimum = minimum;
+                    brick.scale = (maximum - minimum) / levels;
+                    
+                    for (uint k = 0; k < A * A * A; ++k) {
+                        float q = brick.scale > 0 ? roundf((values[k] - minimum) / brick.scale) : 0;
+                        if (bits == 8) {
+                            ptr[k] = (uint8_t)q;
+                        } else {
+                            ((uint16_t*)ptr)[k] = (uint16_t)q;
+                        }
+                    }
+                }
+            }
+        }
+        return data.size();
+    }
+    
+    // Voxels a trilinear lookup can read inside majorant cell c of m along an axis of n voxels.
+    // The cell is its share of the unit cube, as the DDA walks it, widened by the lookup
+    // footprint as pbrt-v4 does. Unclamped, the ends may fall past the grid.
+    static void majorantVoxels(uint c, uint m, uint n, int& v0, int& v1) {
+        v0 = int(floorf(float(c) * n / m - 0.5f));
+        v1 = int(ceilf(float(c + 1) * n / m + 0.5f));
+    }
+    
+    // Stored value k of a brick as the GPU decodes it
+    float voxel(const DensityBrick& brick, const std::vector<uint8_t>& data, uint k) const {
+        
+        switch (bits) {
+            case 8:
+                return brick.minimum + brick.scale * data[brick.offset + k];
+            case 16:
+                return brick.minimum + brick.scale * ((const uint16_t*)data.data())[brick.offset + k];
+            default:
+                return ((const float*)data.data())[brick.offset + k];
+        }
+    }
+    
+    // Min and max density per majorant cell, interleaved, over the values the GPU reads: the
+    // quantized ones of every brick whose voxels or apron fall in the cell. Lookups past the grid
+    // and in empty bricks read zero, so a cell reaching them has a minimum of zero.
+    std::vector<float> majorantGrid(const std::vector<DensityBrick>& table, const std::vector<uint8_t>& data) const {
+        
+        const int B = DENSITY_BRICK, A = DENSITY_BRICK_APRON;
+        
+        std::vector<float> grid(mx * my * mz * 2, 0);
+        
+        for (uint cz = 0; cz < mz; ++cz) {
+            for (uint cy = 0; cy < my; ++cy) {
+                for (uint cx = 0; cx < mx; ++cx) {
+                    
+                    float minDensity = FLT_MAX, maxDensity = 0;
+                    
+                    int x0, x1, y0, y1, z0, z1;
+                    majorantVoxels(cx, mx, nx, x0, x1);
+                    majorantVoxels(cy, my, ny, y0, y1);
+                    majorantVoxels(cz, mz, nz, z0, z1);
+                    
+                    bool border = x0 < 0 || y0 < 0 || z0 < 0 || x1 >= int(nx) || y1 >= int(ny) || z1 >= int(nz);
+                    
+                    x0 = std::max(x0, 0); x1 = std::min(x1, int(nx) - 1);
+                    y0 = std::max(y0, 0); y1 = std::min(y1, int(ny) - 1);
+                    z0 = std::max(z0, 0); z1 = std::min(z1, int(nz) - 1);
+                    
+                    // Brick b stores the voxels b*B to b*B+B, the last one as the apron
+                    for (int kz = std::max((z0 + B - 1) / B - 1, 0); kz <= z1 / B; ++kz) {
+                        for (int ky = std::max((y0 + B - 1) / B - 1, 0); ky <= y1 / B; ++ky) {
+                            for (int kx = std::max((x0 + B - 1) / B - 1, 0); kx <= x1 / B; ++kx) {
+                                
+                                auto& brick = table[(kz * by + ky) * bx + kx];
+                                
+                                for (int k = 0; k < A * A * A; ++k) {
+                                    int x = kx * B + k % A, y = ky * B + (k / A) % A, z = kz * B + k / (A * A);
+                                    if (x < x0 || x > x1 || y < y0 || y > y1 || z < z0 || z > z1) { continue; }
+                                    
+                                    auto density = brick.offset == UINT_MAX ? 0 : voxel(brick, data, k);
+                                    minDensity = fmin(minDensity, density);
+                                    maxDensity = fmax(maxDensity, density);
+                                }
+                            }
+                        }
+                    }
+                    
+                    if (border) { minDensity = 0; }
+                    
+                    // A fused multiply-add on the GPU may round the decoded values the other way
+                    if (bits != 32) {
+                        minDensity = nextafterf(minDensity, 0);
+                        maxDensity = nextafterf(maxDensity, FLT_MAX);
+                    }
+                    
+                    auto cell = (cz * my + cy) * mx + cx;
+                    grid[cell * 2 + 0] = minDensity;
+                    grid[cell * 2 + 1] = maxDensity;
+                }
+            }
+        }
+        
+#ifndef NDEBUG
+        checkMajorants(table, data, grid);
+#endif
+        return grid;
+    }
+    
+    // The trilinear density of GridDensityMedium::Density, read from the bricks the same way
+    float density(const std::vector<DensityBrick>& table, const std::vector<uint8_t>& data,
+                  float px, float py, float pz) const {
+        
+        const int B = DENSITY_BRICK, A = DENSITY_BRICK_APRON;
+        
+        auto D = [&](int x, int y, int z) -> float {
+            if (x < 0 || y < 0 || z < 0 || x >= int(nx) || y >= int(ny) || z >= int(nz)) { return 0; }
+            auto& brick = table[((z / B) * by + y / B) * bx + x / B];
+            if (brick.offset == UINT_MAX) { return 0; }
+            return voxel(brick, data, ((z % B) * A + y % B) * A + x % B);
+        };
+        
+        float sx = px * nx - 0.5f, sy = py * ny - 0.5f, sz = pz * nz - 0.5f;
+        int ix = int(floorf(sx)), iy = int(floorf(sy)), iz = int(floorf(sz));
+        float dx = sx - ix, dy = sy - iy, dz = sz - iz;
+        
+        float c[8];
+        
+        if (ix >= 0 && iy >= 0 && iz >= 0 && ix < int(nx) && iy < int(ny) && iz < int(nz)) {
+            auto& brick = table[((iz / B) * by + iy / B) * bx + ix / B];
+            if (brick.offset == UINT_MAX) { return 0; }
+            
+            uint base = ((iz % B) * A + iy % B) * A + ix % B;
+            for (uint i = 0; i < 8; ++i) {
+                c[i] = voxel(brick, data, base + (i & 1) + ((i >> 1) & 1) * A + (i >> 2) * A * A);
+            }
+        } else {
+            for (int i = 0; i < 8; ++i) {
+                c[i] = D(ix + (i & 1), iy + ((i >> 1) & 1), iz + (i >> 2));
+            }
+        }
+        
+        auto lerp = [](float t, float a, float b) { return (1 - t) * a + t * b; };
+        
+        float d00 = lerp(dx, c[0], c[1]);
+        float d10 = lerp(dx, c[2], c[3]);
+        float d01 = lerp(dx, c[4], c[5]);
+        float d11 = lerp(dx, c[6], c[7]);
+        return lerp(dz, lerp(dy, d00, d10), lerp(dy, d01, d11));
+    }
+    
+    // Every trilinear lookup on a lattice through each cell, its faces included, lies within the cell's bounds
+    void checkMajorants(const std::vector<DensityBrick>& table, const std::vector<uint8_t>& data,
+                        const std::vector<float>& grid) const {
+        
+        const uint steps = 8;
+        
+        for (uint cz = 0; cz < mz; ++cz) {
+            for (uint cy = 0; cy < my; ++cy) {
+                for (uint cx = 0; cx < mx; ++cx) {
+                    
+                    auto cell = (cz * my + cy) * mx + cx;
+                    
+                    for (uint k = 0; k <= steps; ++k) {
+                        for (uint j = 0; j <= steps; ++j) {
+                            for (uint i = 0; i <= steps; ++i) {
+                                float d = density(table, data, (cx + float(i) / steps) / mx,
+                                                               (cy + float(j) / steps) / my,
+                                                               (cz + float(k) / steps) / mz);
+                                assert(d <= grid[cell * 2 + 1] * (1 + 1e-5f));
+                                assert(d >= grid[cell * 2 + 0] * (1 - 1e-5f));
+                            }
+                        }
+                    }
+                }
+            }
+        }
     }
 #endif
     
 };
 
+#ifdef __METAL_VERSION__
+
+struct MajorantSegment {
+    float tMin, tMax;
+    float sigma_min, sigma_maj;
+};
+
+// Walks the majorant cells crossed by a ray in the medium's unit cube (pbrt-v4 DDAMajorantIterator)
+struct MajorantIterator {
+    
+    constant float* grid;
+    int3 res;
+    float sigma_t;
+    
+    float tMin, tMax;
+    
+    float3 nextCrossingT, deltaT;
+    int3 step, voxelLimit, voxel;
+    
+    MajorantIterator(const thread Ray& ray, float tMax, constant GridDensityInfo* info, constant float* grid)
+        : grid(grid), res(int3(info->mx, info->my, info->mz)), sigma_t(info->sigma_t), tMax(tMax)
+    {
+        // Clip against the unit cube, the ray may start outside of it
+        auto inverse = 1.0 / ray.direction;
+        auto ts = (0 - ray.origin) * inverse;
+        auto te = (1 - ray.origin) * inverse;
+        
+        tMin = max(0.0, max3(min(ts, te).x, min(ts, te).y, min(ts, te).z));
+        this->tMax = min(tMax, min3(max(ts, te).x, max(ts, te).y, max(ts, te).z));
+        
+        auto pGrid = ray.pointAt(tMin);
+        
+        for (int axis = 0; axis < 3; ++axis) {
+            
+            float d = ray.direction[axis];
+            if (d == -0.0) { d = 0.0; }
+            
+            voxel[axis] = clamp(int(pGrid[axis] * res[axis]), 0, res[axis] - 1);
+            deltaT[axis] = 1 / (abs(d) * res[axis]);
+            
+            if (d >= 0) {
+                float nextVoxelPos = float(voxel[axis] + 1) / res[axis];
+                nextCrossingT[axis] = d == 0 ? FLT_MAX : tMin + (nextVoxelPos - pGrid[axis]) / d;
+                step[axis] = 1;
+                voxelLimit[axis] = res[axis];
+            } else {
+                float nextVoxelPos = float(voxel[axis]) / res[axis];
+                nextCrossingT[axis] = tMin + (nextVoxelPos - pGrid[axis]) / d;
+                step[axis] = -1;
+                voxelLimit[axis] = -1;
+            }
+        }
+    }
+    
+    bool next(thread MajorantSegment& segment) {
+        
+        if (tMin >= tMax) { return false; }
+        
+        // Axis of the nearest cell boundary
+        int bits = ((nextCrossingT[0] < nextCrossingT[1]) << 2) +
+                   ((nextCrossingT[0] < nextCrossingT[2]) << 1) +
+                   ((nextCrossingT[1] < nextCrossingT[2]));
+        const int cmpToAxis[8] = { 2, 1, 2, 1, 2, 2, 0, 0 };
+        int stepAxis = cmpToAxis[bits];
+        
+        float tVoxelExit = min(tMax, nextCrossingT[stepAxis]);
+        
+        auto cell = (voxel.z * res.y + voxel.y) * res.x + voxel.x;
+        segment = { tMin, tVoxelExit, sigma_t * grid[cell * 2], sigma_t * grid[cell * 2 + 1] };
+        
+        tMin = tVoxelExit;
+        if (nextCrossingT[stepAxis] > tMax) { tMin = tMax; }
+        
+        voxel[stepAxis] += step[stepAxis];
+        if (voxel[stepAxis] == voxelLimit[stepAxis]) { tMin = tMax; }
+        
+        nextCrossingT[stepAxis] += deltaT[stepAxis];
+        return true;
+    }
+};
+
+#endif
+
 class GridDensityMedium {
 #ifdef __METAL_VERSION__
   public:
     constant GridDensityInfo* info;
-    constant float* density;
+    constant DensityBrick* bricks;
+    constant uchar* density;
+    constant float* majorant;
+    
+    float voxel(constant DensityBrick& brick, uint k) const {
+        
+        switch (info->bits) {
+            case 8:
+                return brick.minimum + brick.scale * density[brick.offset + k];
+            case 16:
+                return brick.minimum + brick.scale * ((constant ushort*)density)[brick.offset + k];
+            default:
+                return ((constant float*)density)[brick.offset + k];
+        }
+    }
     
     float D(const thread int3 &p) const {
         
@@ -122,7 +497,13 @@ class GridDensityMedium {
         int3 tmp = int3(nx, ny, nz);
         
         if (any(p<0) || any(p>=tmp)) { return 0; }
-        return density[(p.z * ny + p.y) * nx + p.x];
+        
+        auto b = p / DENSITY_BRICK;
+        constant auto& brick = bricks[(b.z * info->by + b.y) * info->bx + b.x];
+        if (brick.offset == UINT_MAX) { return 0; }
+        
+        auto l = p - b * DENSITY_BRICK;
+        return voxel(brick, (l.z * DENSITY_BRICK_APRON + l.y) * DENSITY_BRICK_APRON + l.x);
     }
     
     // GridDensityMedium Public Methods
@@ -133,12 +514,33 @@ class GridDensityMedium {
         
         int3 pi = (int3) floor(pSamples);
         float3 d = pSamples - (float3)pi;
+        
+        float c[8];
+        
+        if (all(pi >= 0) && all(pi < int3(info->nx, info->ny, info->nz))) {
+            // All 8 corners live in the brick holding pi, thanks to the apron
+            auto b = pi / DENSITY_BRICK;
+            constant auto& brick = bricks[(b.z * info->by + b.y) * info->bx + b.x];
+            if (brick.offset == UINT_MAX) { return 0; }
+            
+            const uint A = DENSITY_BRICK_APRON;
+            auto l = uint3(pi - b * DENSITY_BRICK);
+            uint base = (l.z * A + l.y) * A + l.x;
+            
+            for (uint i = 0; i < 8; ++i) {
+                c[i] = voxel(brick, base + (i & 1) + ((i >> 1) & 1) * A + (i >> 2) * A * A);
+            }
+        } else {
+            for (int i = 0; i < 8; ++i) {
+                c[i] = D(pi + int3(i & 1, (i >> 1) & 1, i >> 2));
+            }
+        }
 
         // Trilinearly interpolate density values to compute local density
-        float d00 = Lerp(d.x, D(pi), D(pi + int3(1, 0, 0)));
-        float d10 = Lerp(d.x, D(pi + int3(0, 1, 0)), D(pi + int3(1, 1, 0)));
-        float d01 = Lerp(d.x, D(pi + int3(0, 0, 1)), D(pi + int3(1, 0, 1)));
-        float d11 = Lerp(d.x, D(pi + int3(0, 1, 1)), D(pi + int3(1, 1, 1)));
+        float d00 = Lerp(d.x, c[0], c[1]);
+        float d10 = Lerp(d.x, c[2], c[3]);
+        float d01 = Lerp(d.x, c[4], c[5]);
+        float d11 = Lerp(d.x, c[6], c[7]);
         float d0 = Lerp(d.y, d00, d10);
         float d1 = Lerp(d.y, d01, d11);
         return Lerp(d.z, d0, d1);
@@ -147,50 +549,122 @@ class GridDensityMedium {
     template <typename XSampler>
     float3 Tr(const thread Ray& ray, const thread HitRecord& hitRecord, thread XSampler &sampler) const {
         
-        float tMax = hitRecord._t;
-        float t = 0, Tr = 1;
+        switch (info->estimator) {
+            case TransmittanceEstimator::RatioTracking:
+                return RatioTrackingTr(ray, hitRecord._t, sampler);
+            default:
+                return ResidualRatioTrackingTr(ray, hitRecord._t, sampler);
+        }
+    }
+    
+    // Ratio tracking, stepping with the local majorant of every cell along the ray
+    template <typename XSampler>
+    float RatioTrackingTr(const thread Ray& ray, float tMax, thread XSampler &sampler) const {
+        
+        float Tr = 1;
+        
+        MajorantSegment segment;
+        MajorantIterator iter(ray, tMax, info, majorant);
         
-        while (true) {
-            t -= log(1 - sampler.sample1D()) * info->invMaxDensity / info->sigma_t;
+        while (iter.next(segment)) {
             
-            if (t >= tMax) break;
-            auto p = ray.pointAt(t);
+            // Empty cells are skipped in one step
+            if (segment.sigma_maj <= 0) { continue; }
             
-            float density = Density(p);
-            Tr *= 1 - max(0.0, density * info->invMaxDensity);
-            // Added after book publication: when transmittance gets low,
-            // start applying Russian roulette to terminate sampling.
-            const float rrThreshold = .1;
-            if (Tr < rrThreshold) {
-                float q = max(.05, 1 - Tr);
-                if (sampler.sample1D() < q) return 0;
-                Tr /= 1 - q;
+            float t = segment.tMin;
+            
+            while (true) {
+                t -= log(1 - sampler.sample1D()) / segment.sigma_maj;
+                
+                if (t >= segment.tMax) break;
+                auto p = ray.pointAt(t);
+                
+                float density = Density(p);
+                // Quantized densities may round slightly past the majorant
+                Tr *= max(0.0, 1 - density * info->sigma_t / segment.sigma_maj);
+                // Added after book publication: when transmittance gets low,
+                // start applying Russian roulette to terminate sampling.
+                const float rrThreshold = .1;
+                if (Tr < rrThreshold) {
+                    float q = max(.05, 1 - Tr);
+                    if (sampler.sample1D() < q) return 0;
+                    Tr /= 1 - q;
+                }
             }
         }
         return Tr;
     }
     
+    // Residual ratio tracking (Novak et al. 2014). The cell minimum is a control
+    // extinction whose transmittance is analytic, only the residual up to the cell
+    // maximum is tracked, so near-homogeneous cells take few or no density lookups.
+    template <typename XSampler>
+    float ResidualRatioTrackingTr(const thread Ray& ray, float tMax, thread XSampler &sampler) const {
+        
+        float Tr = 1;
+        
+        MajorantSegment segment;
+        MajorantIterator iter(ray, tMax, info, majorant);
+        
+        while (iter.next(segment)) {
+            
+            float sigma_c = segment.sigma_min;
+            float sigma_r = segment.sigma_maj - sigma_c;
+            
+            Tr *= exp(-sigma_c * (segment.tMax - segment.tMin));
+            
+            if (sigma_r <= 0) { continue; }
+            
+            float t = segment.tMin;
+            
+            while (true) {
+                t -= log(1 - sampler.sample1D()) / sigma_r;
+                
+                if (t >= segment.tMax) break;
+                auto p = ray.pointAt(t);
+                
+                float sigma = Density(p) * info->sigma_t;
+                Tr *= max(0.0, 1 - (sigma - sigma_c) / sigma_r);
+                
+                const float rrThreshold = .1;
+                if (Tr < rrThreshold) {
+                    float q = max(.05, 1 - Tr);
+                    if (sampler.sample1D() < q) return 0;
+                    Tr /= 1 - q;
+                }
+            }
+        }
+        return Tr;
+    }
+    
+    // Delta tracking, stepping with the local majorant of every cell along the ray
     template <typename XSampler>
     float3 Sample(const thread Ray &ray, const thread HitRecord& hitRecord, thread MediumInteraction *mi, thread XSampler &sampler) {
         
-        float tMax = hitRecord._t;
-        float t = 0;
+        MajorantSegment segment;
+        MajorantIterator iter(ray, hitRecord._t, info, majorant);
         
-        while (true)
-        {
-            t -= log(1 - sampler.sample1D()) * info->invMaxDensity / info->sigma_t;
+        while (iter.next(segment)) {
+            
+            if (segment.sigma_maj <= 0) { continue; }
             
-            if (t >= tMax) break;
-            auto p = ray.pointAt(t);
+            float t = segment.tMin;
             
-            if (Density(p) * info->invMaxDensity > sampler.sample1D()) {
+            while (true) {
+                t -= log(1 - sampler.sample1D()) / segment.sigma_maj;
                 
-                mi->p = (hitRecord.modelMatrix * float4(p, 1.0)).xyz;
-                //hitRecord.p - hitRecord.w * hitRecord.t *(1.0-t/tMax);
-                mi->phaseG = info->g;
-                mi->density = this;
+                if (t >= segment.tMax) break;
+                auto p = ray.pointAt(t);
                 
-                return info->sigma_s / info->sigma_t;
+                if (Density(p) * info->sigma_t / segment.sigma_maj > sampler.sample1D()) {
+                    
+                    mi->p = (hitRecord.modelMatrix * float4(p, 1.0)).xyz;
+                    //hitRecord.p - hitRecord.w * hitRecord.t *(1.0-t/tMax);
+                    mi->phaseG = info->g;
+                    mi->density = this;
+                    
+                    return info->sigma_s / info->sigma_t;
+                }
             }
         }
         
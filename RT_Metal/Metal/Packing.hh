@@ -0,0 +1,65 @@
+#ifndef Packing_h
+#define Packing_h
+
+#include "Common.hh"
+
+#ifdef __METAL_VERSION__
+    typedef packed_float3 PackedFloat3;
+#else
+    // Only the size matters on the host side
+    struct PackedFloat3 { float x, y, z; };
+#endif
+
+#define SHARED_EXPONENT_BIAS 8
+
+#ifdef __METAL_VERSION__
+
+// Octahedral map of a unit vector, 16 bits per axis
+inline uint PackUnitVector(float3 v) {
+
+    v /= abs(v.x) + abs(v.y) + abs(v.z);
+
+    float2 p = v.xy;
+    if (v.z < 0) {
+        p = (1.0 - abs(v.yx)) * select(float2(-1.0), float2(1.0), v.xy >= 0.0);
+    }
+    return pack_float_to_snorm2x16(p);
+}
+
+inline float3 UnpackUnitVector(uint u) {
+
+    float2 p = unpack_snorm2x16_to_float(u);
+    float3 v = float3(p, 1.0 - abs(p.x) - abs(p.y));
+
+    float t = saturate(-v.z);
+    v.xy += select(float2(t), float2(-t), v.xy >= 0.0);
+    return normalize(v);
+}
+
+// RGB with 9 bit mantissas and a shared 5 bit exponent, as RGB9E5 but biased
+// to cover about 2^-17 to 2^23 for flux and throughput instead of half float range
+inline uint PackSharedExponent(float3 rgb) {
+
+    const float maxValue = 511.0 * exp2(float(31 - SHARED_EXPONENT_BIAS - 9));
+    rgb = clamp(rgb, 0.0, maxValue);
+
+    float maxChannel = max(max(rgb.r, rgb.g), max(rgb.b, FLT_MIN));
+    int exponent = max(-SHARED_EXPONENT_BIAS - 1, int(floor(log2(maxChannel)))) + 1 + SHARED_EXPONENT_BIAS;
+
+    float scale = exp2(float(exponent - SHARED_EXPONENT_BIAS - 9));
+    if (uint(floor(maxChannel / scale + 0.5)) == 512) {
+        scale *= 2; exponent += 1;
+    }
+
+    uint3 m = min(uint3(floor(rgb / scale + 0.5)), 511u);
+    return m.r | (m.g << 9) | (m.b << 18) | (uint(exponent) << 27);
+}
+
+inline float3 UnpackSharedExponent(uint u) {
+    float scale = exp2(float(int(u >> 27) - SHARED_EXPONENT_BIAS - 9));
+    return float3(u & 511, (u >> 9) & 511, (u >> 18) & 511) * scale;
+}
+
+#endif
+
+#endif /* Packing_h */
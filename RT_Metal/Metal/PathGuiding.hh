@@ -0,0 +1,155 @@
+#ifndef PathGuiding_h
+#define PathGuiding_h
+
+#include "Common.hh"
+#include "Packing.hh"
+#include "AABB.hh"
+
+// Training iterations of 1, 2, 4 ... frames, the image restarts with every new tree
+#define GUIDE_TRAINING_ITERATIONS 6
+
+// A spatial leaf splits once it has seen more than c * sqrt(2^iteration) samples
+#define GUIDE_SPATIAL_THRESHOLD 12000
+
+// A quadrant holding more than this share of the energy of its quadtree is subdivided
+#define GUIDE_QUAD_FRACTION 0.01
+#define GUIDE_QUAD_DEPTH 20
+
+// Bounces of a guided camera path, whose vertices are kept until the path ends for their training records
+#define GUIDE_PATH_DEPTH 8
+
+// One pixel in this many, along diagonals moving every frame, records its path while training
+#define GUIDE_RECORD_STRIDE 4
+
+// Node of the spatial binary tree over the scene box, split in the middle along axis.
+// Müller et al., Practical Path Guiding for Efficient Light-Transport Simulation
+struct GuideSpatialNode {
+    uint32_t child;     // first of the two children, 0 for a leaf
+    uint32_t axis;
+    uint32_t quadRoot;  // directional quadtree of a leaf
+    float bsdfFraction; // chance to sample the BXDF instead of the quadtree, learned per leaf
+};
+
+// Node of a directional quadtree over the cylindrical mapping of the sphere,
+// quadrant q covers x half (q & 1) and y half (q >> 1)
+struct GuideQuadNode {
+    float sum[4];       // radiance through each quadrant
+    uint32_t child[4];  // 0 for a leaf quadrant
+};
+
+// Training sample of a camera path vertex, written while the trees are learned
+struct GuideRecord {
+    PackedFloat3 position;
+    float radiance;     // luminance of the incident radiance over the sampling density
+    float2 direction;   // cylindrical, (cos theta + 1) / 2 and phi / 2 pi
+    float product;      // luminance of f cos Li over the sampling density
+    float bsdfPDF;
+    float guidePDF;
+};
+
+#ifdef __METAL_VERSION__
+
+inline float2 GuideCylindrical(float3 d) {
+    auto phi = atan2(d.y, d.x);
+    if (phi < 0) { phi += 2 * M_PI_F; }
+    return float2((clamp(d.z, -1.0f, 1.0f) + 1) / 2, phi / (2 * M_PI_F));
+}
+
+inline float3 GuideDirection(float2 p) {
+    auto cosTheta = 2 * p.x - 1;
+    auto sinTheta = sqrt(max(0.0f, 1 - cosTheta * cosTheta));
+    auto phi = 2 * M_PI_F * p.y;
+    return float3(sinTheta * cos(phi), sinTheta * sin(phi), cosTheta);
+}
+
+// The quadtree of the spatial leaf around a shading point, mixed with the BXDF
+struct GuideSampler {
+    constant GuideQuadNode* quads;
+    uint32_t root;
+    float bsdfFraction;
+
+    GuideSampler(constant GuideSpatialNode* spatial, constant GuideQuadNode* quads, AABB box, float3 p): quads(quads) {
+
+        uint32_t i = 0;
+        while (spatial[i].child != 0) {
+            auto axis = spatial[i].axis;
+            auto mid = (box.mini[axis] + box.maxi[axis]) / 2;
+            if (p[axis] < mid) {
+                box.maxi[axis] = mid; i = spatial[i].child;
+            } else {
+                box.mini[axis] = mid; i = spatial[i].child + 1;
+            }
+        }
+        root = spatial[i].quadRoot;
+        bsdfFraction = spatial[i].bsdfFraction;
+    }
+
+    // Solid angle density, the cylindrical mapping keeps areas so it is the density over the square / 4 pi
+    float pdf(float3 direction) const {
+
+        auto p = GuideCylindrical(direction);
+        float density = 1;
+
+        for (auto i = root;;) {
+            constant auto& node = quads[i];
+            auto total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+            if (total <= 0) { break; }
+
+            auto qx = p.x >= 0.5 ? 1 : 0;
+            auto qy = p.y >= 0.5 ? 1 : 0;
+            auto q = qx | (qy << 1);
+
+            density *= 4 * node.sum[q] / total;
+            if (node.child[q] == 0) { break; }
+
+            p = p * 2 - float2(qx, qy);
+            i = node.child[q];
+        }
+        return density / (4 * M_PI_F);
+    }
+
+    float3 sample(float2 u, thread float& pdf) const {
+
+        float2 origin = 0; float scale = 1;
+        float density = 1;
+
+        for (auto i = root;;) {
+            constant auto& node = quads[i];
+            auto total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+            if (total <= 0) { break; }
+
+            // Column first, then the quadrant inside it
+            auto left = (node.sum[0] + node.sum[2]) / total;
+            int qx = u.x < left ? 0 : 1;
+            u.x = qx == 0 ? u.x / left : (u.x - left) / (1 - left);
+
+            auto column = node.sum[qx] + node.sum[qx + 2];
+            auto bottom = node.sum[qx] / column;
+            int qy = u.y < bottom ? 0 : 1;
+            u.y = qy == 0 ? u.y / bottom : (u.y - bottom) / (1 - bottom);
+
+            u = clamp(u, 0.0f, 1.0f - FLT_EPSILON);
+
+            auto q = qx | (qy << 1);
+            density *= 4 * node.sum[q] / total;
+
+            scale /= 2;
+            origin += scale * float2(qx, qy);
+
+            if (node.child[q] == 0) { break; }
+            i = node.child[q];
+        }
+
+        pdf = density / (4 * M_PI_F);
+        return GuideDirection(origin + scale * u);
+    }
+
+    // Density of the one-sample mixture, what the MIS weights compare light sampling against
+    float mix(float bxPDF, float3 direction) const {
+        return bsdfFraction * bxPDF + (1 - bsdfFraction) * pdf(direction);
+    }
+};
+
+#endif
+
+#endif /* PathGuiding_h */
@@ -4,11 +4,34 @@
 #define Photon_h
 
 #include "Common.hh"
+#include "Packing.hh"
 
 #ifdef __METAL_VERSION__
 #include "Render.hh"
 #endif
 
+// Bounces of a photon path
+#define PHOTON_DEPTH 8
+
+// Primary samples of a photon path, 6 for the emission and 3 per bounce
+#define PHOTON_DIMS (6 + 3 * PHOTON_DEPTH)
+
+// Slots of the photon counter buffer
+#define PHOTON_COUNT_DEPOSITS 0
+#define PHOTON_COUNT_CHAIN 1
+#define PHOTON_COUNT_UNIFORM 2
+#define PHOTON_COUNT_VISIBLE 3
+#define PHOTON_COUNTERS 4
+
+// Markov chain of visible photon paths, one per emitting thread, its state is a
+// PHOTON_DIMS vector of primary samples kept in a separate buffer
+struct PhotonChain {
+    float size;         // mutation size, adapted towards 23.4% acceptance
+    uint32_t mutations;
+    uint32_t accepted;
+    uint32_t valid;     // a visible path has been found
+};
+
 struct PhotonRecord {
     
     float3 flux = 1;
@@ -27,6 +50,15 @@ struct PhotonRecord {
     }
 };
 
+// Stored photon, 24 bytes instead of the 80 of PhotonRecord
+struct PhotonPacked {
+    PackedFloat3 position;
+    uint32_t flux;      // shared exponent RGB
+    uint32_t direction; // octahedral
+    uint32_t normal;    // octahedral
+};
+
+// Camera path vertex while it is traced
 struct CameraRecord {
     float3 ratio = 1;
     float3 position = 0;
@@ -34,10 +66,6 @@ struct CameraRecord {
     
     bool valid = false;
     float3 alternative = 0;
-
-    float3 flux = 0;
-    float radius = 0;
-    uint photonCount = 0;
     
     void reset() {
         ratio = 1;
@@ -45,49 +73,76 @@ struct CameraRecord {
         direction = 0;
         
         valid = false;
-
-        flux = 0;
-        radius = 0;
-        photonCount = 0;
+        alternative = 0;
     }
 };
 
+// Camera record fields the gather reads and writes for every pixel, kept apart from the
+// ones only read once per pixel, 32 + 16 bytes instead of 112
+struct CameraGather {
+    PackedFloat3 position;
+    float radius;
+    PackedFloat3 flux;
+    uint32_t photonCount;
+};
+
+struct CameraShade {
+    uint32_t ratio;       // shared exponent RGB
+    uint32_t alternative; // shared exponent RGB
+    uint32_t direction;   // octahedral
+    uint32_t valid;
+};
+
 #ifdef __METAL_VERSION__
 
-inline float mod(float x, float y) {
-    return x - y * floor(x/y);
+inline PhotonPacked Pack(const thread PhotonRecord& photon) {
+    return { photon.position, PackSharedExponent(photon.flux),
+             PackUnitVector(photon.direction), PackUnitVector(photon.normal) };
 }
 
-inline float2 convert1Dto2D(const float t, const float BufInfo)
-{
-    float2 tmp;
-    
-    tmp.x = mod(t, BufInfo);
-    tmp.y = floor(t / BufInfo);
+inline CameraShade Pack(const thread CameraRecord& cr) {
+    return { PackSharedExponent(cr.ratio), PackSharedExponent(cr.alternative),
+             cr.valid ? PackUnitVector(cr.direction) : 0, cr.valid };
+}
+
+#endif
+
+// The hash grid has as many cells as photons
+#define PHOTON_HASH_CELLS (PHOTON_HASHN * PHOTON_HASHN)
 
-    return tmp;
+// 21 bits per axis of the cell coordinate, unique for any cell inside the photon box
+inline uint64_t PhotonCellKey(uint32_t x, uint32_t y, uint32_t z) {
+    return (uint64_t(x & 0x1FFFFF) << 42) | (uint64_t(y & 0x1FFFFF) << 21) | uint64_t(z & 0x1FFFFF);
 }
 
-inline float hash(const float3 idx, const float HashScale, const float BufInfo)
-{
-    const float HashNum = BufInfo * BufInfo;
-    // use the same procedure as GPURnd
-    float4 n = float4(idx, idx.x + idx.y - idx.z) * 4194304.0 / HashScale;
-    //float4 n = float4(idx, HashScale * 0.5) * 4194304.0 / HashScale;
+// MurmurHash3 finaliser of the cell key
+inline uint32_t PhotonCellMix(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return uint32_t(key);
+}
 
-    const float4 q = float4(   1225.0,    1585.0,    2457.0,    2098.0);
-    const float4 r = float4(   1112.0,     367.0,      92.0,     265.0);
-    const float4 a = float4(   3423.0,    2646.0,    1707.0,    1999.0);
-    const float4 m = float4(4194287.0, 4194277.0, 4194191.0, 4194167.0);
+// Cells sharing a slot are told apart by their key
+inline uint32_t PhotonCellHash(uint64_t key) {
+    return PhotonCellMix(key) & (PHOTON_HASH_CELLS - 1);
+}
 
-    float4 beta = floor(n / q);
-    float4 p = a * (n - beta * q) - beta * r;
-    beta = (sign(-p) + float4(1.0)) * float4(0.5) * m;
-    n = (p + beta);
+// The camera visibility of the photon chains has its own grid, PHOTON_VISIBLE_CELL hash cells
+// per axis, so the records of a full frame set only a small share of the bits
+#define PHOTON_VISIBLE_CELL 16
+#define PHOTON_VISIBLE_BITS (1u << 22)
 
-    return floor( fract(dot(n / m, float4(1.0, -1.0, 1.0, -1.0))) * HashNum );
+inline uint32_t PhotonVisibleHash(uint64_t key) {
+    return PhotonCellMix(key) & (PHOTON_VISIBLE_BITS - 1);
 }
 
-#endif
+// Sorted by hash slot, the key of its cell travels with every photon
+struct PhotonCellEntry {
+    uint64_t key;
+    uint32_t index;
+};
 
 #endif /* Photon_h */
@@ -1,9 +1,15 @@
 #include "Photon.hh"
+#include "PhotonMap.hh"
+#include "PrimaryCache.hh"
 
+// A new camera path every pass, through a cached jitter pattern inside the pixel of size texel
+// while the image warms up, then the lens and glossy lobes. The first hit of a pattern is traced
+// once after a reset.
 template <typename XSampler>
-bool traceCameraRecord(half depth, thread Ray& ray, thread XSampler& xsampler,
+bool traceCameraRecord(half depth, constant Camera* camera, float2 uv, float2 texel, thread XSampler& xsampler,
+                       device PrimaryHit& primary, uint2 pixel, uint pattern, bool cached,
                        
-                       thread half4& zN, thread CameraRecord& cr,
+                       thread half4& zN, thread float3& position, thread CameraRecord& cr,
                 
                        constant PackageEnv& packageEnv,
                        constant PackagePBR& packagePBR,
@@ -17,11 +23,24 @@ bool traceCameraRecord(half depth, thread Ray& ray, thread XSampler& xsampler,
     Scene scene { primitives };
     Spectrum ratio = Spectrum(1.0);
     
-    bool hitted = scene.hit(ray, hitRecord, FLT_MAX);
+    auto jitter = xsampler.sample2D();
+    if (pattern != PRIMARY_FRESH) { jitter = PrimaryJitter(pixel, pattern); }
+    uv += texel * jitter;
+    
+    auto ray = castRay(camera, uv.x, uv.y, &xsampler);
+    bool hitted;
+    
+    if (cached) {
+        hitted = PrimaryHitUnpack(primary, ray, hitRecord);
+    } else {
+        hitted = scene.hit(ray, hitRecord, FLT_MAX);
+        if (pattern != PRIMARY_FRESH) { primary = PrimaryHitPack(hitted, hitRecord); }
+    }
     
     if (hitted) {
         zN.r = hitRecord.t / 1024;
         zN.gba = half3(hitRecord.sn);
+        position = hitRecord.p;
     }
     
     do { // each ray
@@ -108,11 +127,15 @@ kernelCameraRecording(texture2d<uint32_t, access::read>        inRNG [[texture(0
                       constant Complex*            complex [[buffer(1)]],
                       
                       device AABB*              cameraAABB [[buffer(2)]],
-                      device CameraRecord*    cameraRecord [[buffer(3)]],
+                      device CameraGather*    cameraGather [[buffer(3)]],
+                      device CameraShade*      cameraShade [[buffer(4)]],
+                      constant Camera*      cameraPrevious [[buffer(5)]],
              
                       constant Primitive&       primitives [[buffer(7)]],
                       constant PackageEnv&      packageEnv [[buffer(8)]],
-                      constant PackagePBR*      packagePBR [[buffer(9)]])
+                      constant PackagePBR*      packagePBR [[buffer(9)]],
+                      
+                      device PrimaryHit*      primaryCache [[buffer(10)]])
 {
     #ifndef DEVICE_SUPPORTS_NON_UNIFORM_TREADGROUPS
     if (thread_pos.x >= inRNG.get_width() || thread_pos.y >= inRNG.get_height()) {
@@ -132,27 +155,58 @@ kernelCameraRecording(texture2d<uint32_t, access::read>        inRNG [[texture(0
     auto frame = complex->frame_count;
     auto u = float(thread_pos.x)/inRNG.get_width();
     auto v = float(thread_pos.y)/inRNG.get_height();
+    auto texel = 1.0 / float2(inRNG.get_width(), inRNG.get_height());
     
     auto idx = thread_pos.x + thread_pos.y * grid_size.x;
     
-    RandomSampler rs { &rng };
-    auto ray = castRay(camera, u, v, &rs);
-    
-    auto cr = cameraRecord[idx];
+    CameraRecord cr;
     
     half depth = 8;
     if (frame == 0) {
-        cr.reset();
+        cameraGather[idx].flux = float3(0);
+        cameraGather[idx].photonCount = 0;
         depth = 3;
     }
     
     half4 zN = 0;
-    bool hasCameraRecord = traceCameraRecord(depth, ray, rs, zN, cr,
-                                             packageEnv,
-                                             packagePBR[1],
-                                             primitives);
+    float3 position;
+    bool hasCameraRecord;
+    
+    auto pattern = PrimaryPattern(frame, camera->lenRadius);
+    auto cached = pattern != PRIMARY_FRESH && frame >= PRIMARY_PATTERNS;
+    device auto& primary = primaryCache[idx + pattern % PRIMARY_PATTERNS * grid_size.x * grid_size.y];
+    
+    switch (complex->sampler) {
+        case SamplerType::Halton: {
+            HaltonSampler hs { &rng, packageEnv.haltonPermutations, thread_pos, frame };
+            hasCameraRecord = traceCameraRecord(depth, camera, float2(u, v), texel, hs, primary, thread_pos, pattern, cached, zN, position, cr,
+                                                packageEnv, packagePBR[1], primitives);
+            break;
+        }
+        case SamplerType::BlueNoise: {
+            BlueNoiseSampler bs { &rng, packageEnv.blueNoiseTiles, thread_pos, frame };
+            hasCameraRecord = traceCameraRecord(depth, camera, float2(u, v), texel, bs, primary, thread_pos, pattern, cached, zN, position, cr,
+                                                packageEnv, packagePBR[1], primitives);
+            break;
+        }
+        case SamplerType::Random: {
+            RandomSampler rs { &rng };
+            hasCameraRecord = traceCameraRecord(depth, camera, float2(u, v), texel, rs, primary, thread_pos, pattern, cached, zN, position, cr,
+                                                packageEnv, packagePBR[1], primitives);
+            break;
+        }
+        default: {
+            pbrt::SobolSampler ss { &rng, thread_pos, frame };
+            hasCameraRecord = traceCameraRecord(depth, camera, float2(u, v), texel, ss, primary, thread_pos, pattern, cached, zN, position, cr,
+                                                packageEnv, packagePBR[1], primitives);
+        }
+    }
+    
     zNormal.write(zN, thread_pos);
-    motion2D.write(10.0h, thread_pos);
+    
+    auto size = float2(grid_size);
+    auto motion = zN.r > 0 ? CameraMotion(camera, cameraPrevious, position, size) : float2(0);
+    motion2D.write(half4(half2(motion), 0, 0), thread_pos);
     
     if (hasCameraRecord) {
         cameraAABB[idx] = {cr.position, cr.position};
@@ -160,7 +214,8 @@ kernelCameraRecording(texture2d<uint32_t, access::read>        inRNG [[texture(0
         cameraAABB[idx] = {FLT_MAX, -FLT_MAX};
     }
     
-    cameraRecord[idx] = cr;
+    cameraGather[idx].position = cr.position;
+    cameraShade[idx] = Pack(cr);
     
     rng_cache = exRNG(rng);
     outRNG.write(rng_cache, thread_pos);
@@ -217,8 +272,9 @@ kernelCameraReducing(constant Camera*           camera [[buffer(0)]],
     }
 }
 
+// One bounce of a photon path, false once the path ends
 template <typename XSampler>
-void tracePhotonRecord(thread Ray& ray, thread XSampler& xsampler,
+bool tracePhotonRecord(thread Ray& ray, thread XSampler& xsampler,
              
                        thread PhotonRecord& photonRecord,
                 
@@ -237,8 +293,7 @@ void tracePhotonRecord(thread Ray& ray, thread XSampler& xsampler,
     constant auto& material = packageEnv.materials[hitRecord.material];
     
     if ( !hitted || material.type == MaterialType::Diffuse ) {
-        photonRecord.reset();
-        return;
+        return false;
     }
     
         float3 nx, ny;
@@ -255,8 +310,7 @@ void tracePhotonRecord(thread Ray& ray, thread XSampler& xsampler,
         scatRecord.bxPDF = bxPDF;
     
         if (bxPDF <= 0) {
-            photonRecord.reset();
-            return;
+            return false;
         }
         
     ratio *= scatRecord.attenuation / max(FLT_EPSILON, scatRecord.bxPDF);
@@ -265,8 +319,7 @@ void tracePhotonRecord(thread Ray& ray, thread XSampler& xsampler,
             float3 xyz; RGBToXYZ(ratio, xyz);
             float p = xyz.y;   //max3(ratio);
             if (xsampler.random() > p) {
-                photonRecord.reset();
-                return;
+                return false;
             }
             // Add the energy we 'lose'
             ratio *= 1.0f / p;
@@ -281,8 +334,108 @@ void tracePhotonRecord(thread Ray& ray, thread XSampler& xsampler,
         photonRecord.step += 1;
         
         photonRecord.active = !material.specular;
+    
+    return true;
 }
   
+// A point is visible when its visibility cell holds the neighbourhood of some camera record
+inline bool PhotonVisible(constant uint32_t* visibility, constant Complex* complex, float3 p) {
+    
+    if (any(p < complex->photonBox.mini) || any(p > complex->photonBox.maxi)) { return false; }
+    
+    uint3 cell = uint3((p - complex->photonBox.mini) * complex->photonHashScale / PHOTON_VISIBLE_CELL);
+    uint32_t h = PhotonVisibleHash(PhotonCellKey(cell.x, cell.y, cell.z));
+    
+    return visibility[h >> 5] & (1u << (h & 31));
+}
+
+// Marks the visibility cells a camera record can gather from, 2 per axis at most as the radius is below the cell size
+kernel void
+kernelPhotonVisibility(constant Complex*           complex [[buffer(0)]],
+                       constant CameraGather* cameraGather [[buffer(1)]],
+                       constant CameraShade*   cameraShade [[buffer(2)]],
+                       device atomic_uint*      visibility [[buffer(3)]],
+                       
+                       uint2 thread_pos         [[thread_position_in_grid]],
+                       uint2 grid_size                 [[threads_per_grid]])
+{
+    size_t thread_idx = thread_pos.y * grid_size.x + thread_pos.x;
+    if (!cameraShade[thread_idx].valid) { return; }
+    
+    float3 p = cameraGather[thread_idx].position;
+    float r = complex->photonInitialRadius;
+    float scale = complex->photonHashScale / PHOTON_VISIBLE_CELL;
+    
+    uint3 lo = uint3(max((p - r - complex->photonBox.mini) * scale, 0.0));
+    uint3 hi = uint3(max((p + r - complex->photonBox.mini) * scale, 0.0));
+    
+    for (uint z = lo.z; z <= hi.z; ++z) {
+        for (uint y = lo.y; y <= hi.y; ++y) {
+            for (uint x = lo.x; x <= hi.x; ++x) {
+                uint32_t h = PhotonVisibleHash(PhotonCellKey(x, y, z));
+                atomic_fetch_or_explicit(visibility + (h >> 5), 1u << (h & 31), memory_order_relaxed);
+            }
+        }
+    }
+}
+
+// Traces the photon path of a primary sample vector, keeping its records, true if any is visible
+inline bool tracePhotonPath(thread float* u, thread PhotonPacked* records, thread uint& recordCount,
+                            
+                            constant Complex*     complex,
+                            constant uint32_t*    visibility,
+                            
+                            constant Primitive&   primitives,
+                            constant PackageEnv&  packageEnv,
+                            constant PackagePBR&  packagePBR)
+{
+    PrimarySampler ps { u, PHOTON_DIMS };
+    
+    PhotonRecord photon_cache;
+    
+    float lightPMF;
+    auto lightIndex = SampleLight(primitives, ps.sample1D(), lightPMF);
+    if (lightPMF == 0) { recordCount = 0; return false; }
+    constant auto& light = primitives.lightList[lightIndex];
+    
+    LightSampleRecord lsr;
+    float2 uu = ps.sample2D();
+    auto side = ps.random() - 0.5;
+    primitives.squareList[light.pIndex].sampleEmission(uu, side, lsr);
+    
+    // Le * cos / (pmf * areaPDF * 1/2 side * cos/PI)
+    auto le = packageEnv.materials[lsr.material].textureInfo.albedo;
+    photon_cache.flux = le * 2 * M_PI_F / (lightPMF * lsr.areaPDF);
+    
+    float3 nx, ny;
+    CoordinateSystem(lsr.n, nx, ny);
+    float3x3 stw = { nx, ny, lsr.n };
+    
+    uu = ps.sample2D(); // reuse previous uu is bad
+    Ray ray = Ray(lsr.p, stw * CosineSampleHemisphere(uu));
+    
+    bool visible = false;
+    recordCount = 0;
+    
+    while (photon_cache.step < PHOTON_DEPTH) {
+        
+        if (!tracePhotonRecord(ray, ps, photon_cache, packageEnv, packagePBR, primitives)) { break; }
+        
+        if (photon_cache.active) {
+            records[recordCount++] = Pack(photon_cache);
+            visible = visible || PhotonVisible(visibility, complex, photon_cache.position);
+        }
+        
+        ray = Ray(photon_cache.position, photon_cache.direction);
+    }
+    
+    return visible;
+}
+
+// Visual importance driven emission, after Hachisuka and Jensen, Robust Adaptive Photon Tracing.
+// Every thread runs a Markov chain over the primary samples of visible photon paths: a uniform
+// path replaces the state when visible, else a mutation of the state is tried. The chain records
+// are deposited each iteration and the host scales them by the visible share of the uniform paths.
 kernel void
 kernelPhotonRecording(texture2d<uint32_t, access::read>       inRNG [[texture(0)]],
                       texture2d<uint32_t, access::write>     outRNG [[texture(1)]],
@@ -294,7 +447,13 @@ kernelPhotonRecording(texture2d<uint32_t, access::read>       inRNG [[texture(0)
                       constant Camera*              camera [[buffer(0)]],
                       constant Complex*            complex [[buffer(1)]],
                       
-                      device PhotonRecord*     photonRecord [[buffer(2)]],
+                      device PhotonPacked*     photonRecord [[buffer(2)]],
+                      device atomic_uint*     photonCounter [[buffer(3)]],
+                      constant uint&         photonCapacity [[buffer(4)]],
+                      
+                      device PhotonChain*       photonChain [[buffer(5)]],
+                      device float*             chainState  [[buffer(6)]],
+                      constant uint32_t*        visibility  [[buffer(10)]],
              
                       constant Primitive&   primitives [[buffer(7)]],
                       constant PackageEnv&  packageEnv [[buffer(8)]],
@@ -306,51 +465,74 @@ kernelPhotonRecording(texture2d<uint32_t, access::read>       inRNG [[texture(0)
     }
     #endif
     
-    uint idx = thread_pos.y * grid_size.x + thread_pos.x;
-    auto photon_cache = photonRecord[idx];
-    auto frame = complex->frame_count;
-    
     auto rng_cache = inRNG.read(thread_pos);
     pcg32_t rng = toRNG(rng_cache);
     RandomSampler rs { &rng };
     
-    Ray ray;
+    size_t thread_idx = thread_pos.y * grid_size.x + thread_pos.x;
+    device float* state = chainState + thread_idx * PHOTON_DIMS;
     
-    bool check = (frame == 0) || (photon_cache.step == 0) || (photon_cache.step == 8);
+    PhotonChain chain = photonChain[thread_idx];
+    if (complex->frame_count == 0) {
+        chain = { 0.1, 0, 0, 0 };
+    }
     
-    if (check) { // ray from light source
+    float current[PHOTON_DIMS], proposal[PHOTON_DIMS];
+    for (uint i = 0; i < PHOTON_DIMS; ++i) {
+        current[i] = state[i];
+        proposal[i] = rs.sample1D();
+    }
+    
+    PhotonPacked records[PHOTON_DEPTH];
+    uint recordCount = 0;
+    
+    bool visible = tracePhotonPath(proposal, records, recordCount, complex, visibility, primitives, packageEnv, packagePBR[1]);
+    
+    atomic_fetch_add_explicit(photonCounter + PHOTON_COUNT_UNIFORM, 1, memory_order_relaxed);
+    
+    if (visible) {
         
-        photon_cache.reset();
+        atomic_fetch_add_explicit(photonCounter + PHOTON_COUNT_VISIBLE, 1, memory_order_relaxed);
+        for (uint i = 0; i < PHOTON_DIMS; ++i) { current[i] = proposal[i]; }
+        chain.valid = 1;
         
-        LightSampleRecord lsr;
-        float2 uu = rs.sample2D();
-        auto _origin = float3(450, 250, 250); //float3(0.0);
+    } else if (chain.valid) {
         
-        if (rs.random() < 1) {
-            primitives.squareList[5].sample(uu, _origin, lsr);
-        } else {
-            primitives.squareList[6].sample(uu, _origin, lsr);
+        for (uint i = 0; i < PHOTON_DIMS; ++i) {
+            proposal[i] = fract(current[i] + chain.size * (2.0 * rs.random() - 1.0) + 1.0);
         }
         
-        photon_cache.flux = packageEnv.materials[lsr.material].textureInfo.albedo * 100000;
+        visible = tracePhotonPath(proposal, records, recordCount, complex, visibility, primitives, packageEnv, packagePBR[1]);
         
-        float3 nx, ny;
-        CoordinateSystem(lsr.n, nx, ny);
-        float3x3 stw = { nx, ny, lsr.n };
-        //float3x3 wts = transpose(stw);
-        uu = rs.sample2D(); // reuse previous uu is bad
-        ray = Ray(lsr.p, stw * UniformSampleHemisphere(uu));
+        chain.mutations += 1;
+        if (visible) {
+            chain.accepted += 1;
+            for (uint i = 0; i < PHOTON_DIMS; ++i) { current[i] = proposal[i]; }
+        }
+        
+        float acceptance = float(chain.accepted) / chain.mutations;
+        chain.size = clamp(chain.size + (acceptance - 0.234) / chain.mutations, 1e-4, 1.0);
+        
+        // Rejected, the chain stays and its path is deposited again
+        if (!visible) {
+            tracePhotonPath(current, records, recordCount, complex, visibility, primitives, packageEnv, packagePBR[1]);
+        }
     }
-    else { // ray from previous photon position
-        ray = Ray(photon_cache.position, photon_cache.direction);
+    
+    if (chain.valid) {
+        
+        atomic_fetch_add_explicit(photonCounter + PHOTON_COUNT_CHAIN, 1, memory_order_relaxed);
+        
+        // Past the capacity the host grows the buffer for the next frame
+        auto slot = atomic_fetch_add_explicit(photonCounter + PHOTON_COUNT_DEPOSITS, recordCount, memory_order_relaxed);
+        for (uint i = 0; i < recordCount; ++i) {
+            if (slot + i < photonCapacity) { photonRecord[slot + i] = records[i]; }
+        }
     }
     
-    tracePhotonRecord(ray, rs, photon_cache,
-                      packageEnv,
-                      packagePBR[1],
-                      primitives);
+    for (uint i = 0; i < PHOTON_DIMS; ++i) { state[i] = current[i]; }
+    photonChain[thread_idx] = chain;
     
-    photonRecord[idx] = photon_cache;
     outRNG.write(exRNG(rng), thread_pos);
 };
 
@@ -373,140 +555,50 @@ kernelPhotonParams(device Complex* x [[buffer(0)]],
 
 kernel void
 kernelPhotonRadius(constant Complex*              complex [[buffer(0)]],
-                   device CameraRecord*      cameraRecord [[buffer(1)]],
+                   device CameraGather*      cameraGather [[buffer(1)]],
                    
                    uint2 thread_pos         [[thread_position_in_grid]],
                    uint2 group_size         [[threads_per_threadgroup]],
                    uint2 grid_size                 [[threads_per_grid]])
 {
     size_t thread_idx = thread_pos.y * grid_size.x + thread_pos.x;
-    cameraRecord[thread_idx].radius = complex->photonInitialRadius;
+    cameraGather[thread_idx].radius = complex->photonInitialRadius;
 }
 
-kernel void
-kernelPhotonHashing(device Complex*              complex [[buffer(1)]],
-                    constant PhotonRecord*    photonRecord [[buffer(2)]],
-                    
-                    device float4*            photonHashed [[buffer(3)]],
-                    
-                    uint2 thread_pos         [[thread_position_in_grid]],
-                    uint2 group_size         [[threads_per_threadgroup]],
-                    uint2 grid_size                 [[threads_per_grid]])
-{
-    size_t thread_idx = thread_pos.y * grid_size.x + thread_pos.x;
-    float3 position = photonRecord[thread_idx].position;
-    
-    float HashScale = complex->photonHashScale;
-    
-    float3 HashIndex = floor((position - complex->photonBox.mini) * HashScale);
-    
-    auto hashed = hash( HashIndex, HashScale, photonHashN );
-    float2 pos2DHashedGrid = convert1Dto2D(hashed, photonHashN);
-    //float2 pos2D = as_type<float2>(thread_pos);
-    float2 pos2D = (float2)(thread_pos);
-    
-    photonHashed[thread_idx] = float4(pos2D, pos2DHashedGrid);
-}
-
-struct PhotonMarkVSData
-{
-    float4 position [[position]];
-    float4 PhotonMark;
-};
-vertex PhotonMarkVSData
-PhotonMarkVS(const uint vertexID [[ vertex_id ]],
-             constant float4* vertices [[ buffer(0) ]],
-             constant PhotonRecord* photonRecord [[buffer(1)]])
-{
-    PhotonMarkVSData out;
-    
-    auto element = vertices[vertexID]; //
-    auto photonPosition2DHashedGrid = element.zw;
-    
-    auto z = photonRecord[vertexID].active ? 0.5 : -1.0; // visible or not
-    
-    photonPosition2DHashedGrid.y = photonHashN - photonPosition2DHashedGrid.y;
-    photonPosition2DHashedGrid = photonPosition2DHashedGrid * 2.0/photonHashN - 1.0;
-    
-    out.position = float4(photonPosition2DHashedGrid, z, 1.0);
-    out.PhotonMark = element - float4(0, 0, 1, 1);
-    
-//    uint y = vertexID / photonHashN;
-//    uint x = vertexID % photonHashN;
-//
-//    out.position.xy = (float2(x, y)+0.5) * 2.0 / photonHashN - 1.0;
-//    out.position.zw = float2(0.5, 1.0);
-
-    return out;
-};
-
-struct PhotonMarkFSData {
-    float4 PhotonMark [[color(0)]];
-    float count [[color(1)]];
-};
-fragment PhotonMarkFSData
-PhotonMarkFS(PhotonMarkVSData in [[stage_in]])
-{
-    PhotonMarkFSData result;
+// Sums the photons found around a camera record, decoding only the ones in range
+struct PhotonAccumulator {
+    constant PhotonPacked* photons;
+    float3 direction;
     
-    result.PhotonMark = in.PhotonMark;
-    result.count = 1; // count in grid
-    
-    return result;
-}
-
-kernel void
-kernelPhotonSumming(device Complex*                _complex         [[buffer(0)]],
-                    texture2d<float, access::read> _countHashGrid  [[texture(0)]],
-                    
-                    uint2 thread_pos                [[ thread_position_in_grid ]],
-                    uint2 group_pos            [[ threadgroup_position_in_grid ]],
-                    uint2 local_pos          [[ thread_position_in_threadgroup ]],
-                      
-                    uint2 batch_size                       [[ threads_per_grid ]],
-                    uint2 group_size                [[ threads_per_threadgroup ]])
-{
-    threadgroup uint shared_memory[64]; uint bound = 64 >> 1;
+    float3 flux = 0;
+    uint count = 0;
     
-    uint local_i = local_pos.y * group_size.x + local_pos.x;
-    float count = _countHashGrid.read(thread_pos).x;
-    //count = round(count);
-    
-    if (count > 0) {
-        shared_memory[local_i] = max(1u, (uint)count);
-    } else {
-        shared_memory[local_i] = 0;
-    }
-    
-    //shared_memory[local_i] = max(1u, (uint)count);
-    threadgroup_barrier(mem_flags::mem_threadgroup);
-    
-    while(bound > 0) {
+    void operator()(uint index, float distance2) {
+        constant auto& photon = photons[index];
         
-        if (local_i < bound) {
-            shared_memory[local_i] += shared_memory[local_i+bound];
+        if (-dot(direction, UnpackUnitVector(photon.direction)) > 0.001) {
+            flux += UnpackSharedExponent(photon.flux);
+            count += 1;
         }
-        bound = bound >> 1;
-        threadgroup_barrier(mem_flags::mem_threadgroup);
     }
-    
-    if (0 == local_i) {
-        atomic_fetch_add_explicit(&_complex->framePhotonSum, shared_memory[0], memory_order_relaxed);
-    }
-}
+};
 
 kernel void
 kernelPhotonRefine(const device Complex*             _complex       [[buffer(0)]],
-                   constant PhotonRecord*            _photonRecords [[buffer(1)]],
-                   device   CameraRecord*            _cameraRecords [[buffer(2)]],
+                   constant PhotonPacked*            _photonRecords [[buffer(1)]],
+                   device   CameraGather*            _cameraGather  [[buffer(2)]],
                    
-                   texture2d<float, access::sample> _marksHashGrid [[texture(0)]],
-                   texture2d<float, access::sample> _countHashGrid [[texture(1)]],
+                   constant uint32_t*                _cellStart     [[buffer(3)]],
+                   constant PhotonCellEntry*         _photonEntries [[buffer(4)]],
                    
-                   texture2d<float, access::read>        inTexture [[texture(2)]],
-                   texture2d<float, access::write>      outTexture [[texture(3)]],
+                   constant CameraShade*             _cameraShade   [[buffer(5)]],
+                   constant PhotonKDNode*            _photonTree    [[buffer(6)]],
+                   device   float4*                  _cameraDirect  [[buffer(7)]],
                    
-                   texture2d<float, access::write>      sourceSVGF [[texture(4)]],
+                   texture2d<float, access::read>        inTexture [[texture(0)]],
+                   texture2d<float, access::write>      outTexture [[texture(1)]],
+                   
+                   texture2d<float, access::write>      sourceSVGF [[texture(2)]],
                    
                    uint2 thread_pos                   [[thread_position_in_grid]],
                    uint2 group_size                   [[threads_per_threadgroup]],
@@ -515,26 +607,22 @@ kernelPhotonRefine(const device Complex*             _complex       [[buffer(0)]
     size_t thread_idx = thread_pos.y * grid_size.x + thread_pos.x;
     size_t frame = _complex->frame_count;
     
-    if (!_cameraRecords[thread_idx].valid) {
-        
-        auto color = _cameraRecords[thread_idx].alternative;
-        auto cache = inTexture.read(thread_pos).xyz;
-        
-        auto result = (cache*frame + color) / (frame + 1);
-        outTexture.write(float4(result, 1.0), thread_pos);
-        sourceSVGF.write(float4(result, 1.0), thread_pos);
-        
-        return;
-    }
+    const auto shade = _cameraShade[thread_idx];
+    const auto gather = _cameraGather[thread_idx];
     
-    float3 QueryPosition = _cameraRecords[thread_idx].position;
-    float3 QueryDirection = _cameraRecords[thread_idx].direction;
+    // Lights and environment seen through the camera path, averaged over the passes of the pixel
+    float3 direct = _cameraDirect[thread_idx].xyz;
+    direct = (direct * frame + UnpackSharedExponent(shade.alternative)) / (frame + 1);
+    _cameraDirect[thread_idx] = float4(direct, 1.0);
+    
+    float3 QueryPosition = gather.position;
+    float3 QueryDirection = UnpackUnitVector(shade.direction);
 
-    float3 QueryFlux = _cameraRecords[thread_idx].flux;
-    float QueryRadius = _cameraRecords[thread_idx].radius;
+    float3 QueryFlux = gather.flux;
+    float QueryRadius = gather.radius;
     
-    float3 QueryReflectance = _cameraRecords[thread_idx].ratio;
-    uint QueryPhotonCount = _cameraRecords[thread_idx].photonCount;
+    float3 QueryReflectance = UnpackSharedExponent(shade.ratio);
+    uint QueryPhotonCount = gather.photonCount;
     
     float3 BBoxMin = _complex->photonBox.mini;
     float HashScale = _complex->photonHashScale;
@@ -542,7 +630,20 @@ kernelPhotonRefine(const device Complex*             _complex       [[buffer(0)]
     float3 RangeMin = abs(QueryPosition - float3(QueryRadius) - BBoxMin) * HashScale;
     float3 RangeMax = abs(QueryPosition + float3(QueryRadius) - BBoxMin) * HashScale;
      
-    float3 _Flux = 0; uint _PhotonCount = 0;
+    PhotonAccumulator accumulator { _photonRecords, QueryDirection };
+    
+    if (!shade.valid) {
+        // No diffuse surface on this pass, the pixel keeps the statistics of the earlier ones
+    } else if (_complex->photonGather == PhotonGather::KDTree) {
+        
+        // Adapt the first radius to the local photon density
+        if (QueryPhotonCount == 0) {
+            QueryRadius = sqrt(PhotonMapKNN<PHOTON_KNN>(_photonTree, _complex->photonTreeCount, QueryPosition, QueryRadius));
+        }
+        
+        PhotonMapQuery(_photonTree, _complex->photonTreeCount, QueryPosition, QueryRadius, accumulator);
+        
+    } else {
     
 for (int iz = int(RangeMin.z); iz <= int(RangeMax.z); iz++)
 {
@@ -551,70 +652,59 @@ for (int iz = int(RangeMin.z); iz <= int(RangeMax.z); iz++)
         for (int ix = int(RangeMin.x); ix <= int(RangeMax.x); ix++)
         {
             
-float3 hashIndex = float3(ix, iy, iz);
-float hashed = hash(hashIndex, HashScale, photonHashN);
-float2 HashedPhotonIndex2D = convert1Dto2D(hashed, photonHashN);
-       HashedPhotonIndex2D -= 1.0;
-            
-float2 PhotonIndex2D = _marksHashGrid.read((uint2)(HashedPhotonIndex2D)).xy;
-        //_marksHashGrid.sample(photonSampler, HashedPhotonIndex2D/1024).xy;
-            if (PhotonIndex2D.x < 0){continue;}
+uint64_t key = PhotonCellKey(ix, iy, iz);
+uint hashed = PhotonCellHash(key);
             
-uint PhotonIndex1D = (uint)PhotonIndex2D.y * photonHashN + (uint)(PhotonIndex2D.x);
+// every photon of the cell
+for (uint i = _cellStart[hashed]; i < _cellStart[hashed + 1]; i++)
+{
+// another cell in the same slot
+if (_photonEntries[i].key != key) { continue; }
+    
+uint PhotonIndex1D = _photonEntries[i].index;
             
 // accumulate photon
-float3 PhotonFlux = _photonRecords[PhotonIndex1D].flux;
 float3 PhotonPosition = _photonRecords[PhotonIndex1D].position;
-float3 PhotonDirection = _photonRecords[PhotonIndex1D].direction;
 
-// make sure that the photon is actually in the given grid cell
-float3 _RangeMin = hashIndex / HashScale + BBoxMin;
-float3 _RangeMax = (hashIndex + float3(1.0)) / HashScale + BBoxMin;
-            
-if ((_RangeMin.x < PhotonPosition.x) && (PhotonPosition.x < _RangeMax.x)
-    && (_RangeMin.y < PhotonPosition.y) && (PhotonPosition.y < _RangeMax.y)
-    && (_RangeMin.z < PhotonPosition.z) && (PhotonPosition.z < _RangeMax.z))
-{
-    float d = distance(PhotonPosition, QueryPosition);
-
-    if ((d < QueryRadius) && (-dot(QueryDirection, PhotonDirection) > 0.001))
-    {
-        float Correction = _countHashGrid.read((uint2)HashedPhotonIndex2D).x;
-        //_countHashGrid.sample(photonSampler, HashedPhotonIndex2D/1024).x;
-        _Flux += PhotonFlux * Correction;
-        _PhotonCount += Correction;
-    }
+    float d2 = distance_squared(PhotonPosition, QueryPosition);
+    if (d2 < QueryRadius * QueryRadius) { accumulator(PhotonIndex1D, d2); }
 }
 //outTexture.write(float4(_Flux , 1.0), thread_pos);
 //return;
         }
     }
 }
+    }
+    
+    float3 _Flux = accumulator.flux; uint _PhotonCount = accumulator.count;
+    
     // BRDF (Lambertian)
     _Flux = _Flux * (QueryReflectance / 3.141592);
     //if (FullSpectrum) Flux = Spectrum2RGB(Wavelength) * Flux.r;
     
-    // progressive refinement
+    // progressive refinement of the pixel, the flux of this pass is weighted by its own camera path
     const float alpha = 0.8;
-    float g = min((QueryPhotonCount + _PhotonCount * alpha ) / (QueryPhotonCount + _PhotonCount), 1.0);
+    float g = _PhotonCount > 0 ? min((QueryPhotonCount + _PhotonCount * alpha ) / (QueryPhotonCount + _PhotonCount), 1.0) : 1.0;
     QueryRadius = QueryRadius * sqrt(g);
     
     QueryPhotonCount = QueryPhotonCount + _PhotonCount * alpha;
     QueryFlux = (QueryFlux + _Flux) * g;
     
-    _cameraRecords[thread_idx].flux = QueryFlux;
-    _cameraRecords[thread_idx].radius = QueryRadius;
-    _cameraRecords[thread_idx].photonCount = QueryPhotonCount;
+    _cameraGather[thread_idx].flux = QueryFlux;
+    _cameraGather[thread_idx].radius = QueryRadius;
+    _cameraGather[thread_idx].photonCount = QueryPhotonCount;
     
     //uint32_t TotalPhotonNum = _complex->photonSum;
     float TotalPhotonNum = _complex->totalPhotonSum;
     TotalPhotonNum += atomic_load_explicit(&_complex->framePhotonSum, memory_order_relaxed);
+    TotalPhotonNum = max(TotalPhotonNum, 1.0f); // no chain has found the camera yet
     
-    float3 color = float3(QueryFlux / (QueryRadius * QueryRadius * 3.141592 * TotalPhotonNum));
+    // Chain photons only cover the visible paths, their share of all paths restores the flux
+    float3 color = float3(QueryFlux * _complex->photonVisibleFraction / (QueryRadius * QueryRadius * 3.141592 * TotalPhotonNum));
     //color = CETone(color, 1.0);
-    auto cache = inTexture.read(thread_pos).xyz;
     
-    float3 result = (cache*frame + color) / (frame+1);
+    // Both terms are progressive estimates already, no averaging with the last frame
+    float3 result = direct + color;
     
     if (any(isnan(result))) {result = 0;}
     
@@ -0,0 +1,175 @@
+#ifndef PhotonMap_h
+#define PhotonMap_h
+
+#include "Common.hh"
+#include "Packing.hh"
+
+// Nearest photons used to shrink the first radius of a query with the kd-tree
+#define PHOTON_KNN 16
+
+// Node of a left-balanced kd-tree in heap order, the children of i are 2i+1 and 2i+2
+struct PhotonKDNode {
+    PackedFloat3 position;
+    uint32_t photonAndAxis; // photon index in the low 30 bits, split axis in the top 2
+};
+
+#ifdef __METAL_VERSION__
+
+// Calls gather(photonIndex, distance2) for every photon closer than radius to p
+template <typename Gather>
+inline void PhotonMapQuery(constant PhotonKDNode* nodes, uint count, float3 p, float radius, thread Gather& gather) {
+
+    uint stack[48]; uint top = 0;
+    stack[top++] = 0;
+
+    float radius2 = radius * radius;
+
+    while (top > 0) {
+
+        uint i = stack[--top];
+        if (i >= count) { continue; }
+
+        constant auto& node = nodes[i];
+        float3 position = node.position;
+        uint axis = node.photonAndAxis >> 30;
+
+        float d2 = distance_squared(position, p);
+        if (d2 < radius2) { gather(node.photonAndAxis & 0x3FFFFFFF, d2); }
+
+        float d = p[axis] - position[axis];
+        uint near = d < 0 ? 2 * i + 1 : 2 * i + 2;
+
+        if (d * d < radius2) { stack[top++] = 4 * i + 3 - near; }
+        stack[top++] = near;
+    }
+}
+
+// Squared distance of the k-th nearest photon within maxRadius, or maxRadius^2 with fewer photons
+template <uint K>
+inline float PhotonMapKNN(constant PhotonKDNode* nodes, uint count, float3 p, float maxRadius) {
+
+    // Max-heap of the K smallest squared distances
+    float heap[K]; uint found = 0;
+    float radius2 = maxRadius * maxRadius;
+
+    uint stack[48]; uint top = 0;
+    stack[top++] = 0;
+
+    while (top > 0) {
+
+        uint i = stack[--top];
+        if (i >= count) { continue; }
+
+        constant auto& node = nodes[i];
+        float3 position = node.position;
+        uint axis = node.photonAndAxis >> 30;
+
+        float d2 = distance_squared(position, p);
+
+        if (d2 < radius2) {
+
+            uint k;
+            if (found < K) {
+                k = found++;
+                while (k > 0 && heap[(k - 1) / 2] < d2) { heap[k] = heap[(k - 1) / 2]; k = (k - 1) / 2; }
+                heap[k] = d2;
+            } else {
+                // Replace the farthest and sift down
+                k = 0;
+                while (true) {
+                    uint c = 2 * k + 1;
+                    if (c >= K) { break; }
+                    if (c + 1 < K && heap[c + 1] > heap[c]) { c += 1; }
+                    if (heap[c] <= d2) { break; }
+                    heap[k] = heap[c]; k = c;
+                }
+                heap[k] = d2;
+            }
+
+            if (found == K) { radius2 = heap[0]; }
+        }
+
+        float d = p[axis] - position[axis];
+        uint near = d < 0 ? 2 * i + 1 : 2 * i + 2;
+
+        if (d * d < radius2) { stack[top++] = 4 * i + 3 - near; }
+        stack[top++] = near;
+    }
+
+    return radius2;
+}
+
+#else
+
+#include <vector>
+#include <algorithm>
+#include <dispatch/dispatch.h>
+
+struct PhotonMap {
+
+    std::vector<uint32_t> order;
+
+    // Builds the tree of the photon positions into nodes[0 .. count)
+    void build(const PhotonPacked* photons, uint32_t count, PhotonKDNode* nodes) {
+
+        order.resize(count);
+        for (uint32_t i = 0; i < count; ++i) { order[i] = i; }
+
+        if (count == 0) { return; }
+        make(photons, order.data(), count, 0, nodes);
+    }
+
+private:
+
+    // Size of the left subtree of a complete binary tree with n nodes
+    static uint32_t leftSize(uint32_t n) {
+        uint32_t p = 1;
+        while (p * 2 <= n) { p *= 2; } // nodes on the last level if it were full
+        return (p / 2 - 1) + std::min(n - p + 1, p / 2);
+    }
+
+    void make(const PhotonPacked* photons, uint32_t* items, uint32_t n, uint32_t node, PhotonKDNode* nodes) {
+
+        if (n == 1) {
+            let& p = photons[items[0]].position;
+            nodes[node] = { p, items[0] };
+            return;
+        }
+
+        float3 mini = simd_make_float3(FLT_MAX), maxi = simd_make_float3(-FLT_MAX);
+        for (uint32_t i = 0; i < n; ++i) {
+            let& p = photons[items[i]].position;
+            let v = simd_make_float3(p.x, p.y, p.z);
+            mini = simd_min(mini, v); maxi = simd_max(maxi, v);
+        }
+
+        let extent = maxi - mini;
+        uint32_t axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+        let m = leftSize(n);
+        std::nth_element(items, items + m, items + n, [&](uint32_t a, uint32_t b) {
+            let& pa = photons[a].position; let& pb = photons[b].position;
+            return (&pa.x)[axis] < (&pb.x)[axis];
+        });
+
+        nodes[node] = { photons[items[m]].position, items[m] | (axis << 30) };
+
+        // Split the big subtrees across threads
+        if (n > 65536) {
+            dispatch_apply(2, dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^(size_t side) {
+                if (side == 0) {
+                    make(photons, items, m, 2 * node + 1, nodes);
+                } else if (n - m - 1 > 0) {
+                    make(photons, items + m + 1, n - m - 1, 2 * node + 2, nodes);
+                }
+            });
+        } else {
+            make(photons, items, m, 2 * node + 1, nodes);
+            if (n - m - 1 > 0) { make(photons, items + m + 1, n - m - 1, 2 * node + 2, nodes); }
+        }
+    }
+};
+
+#endif
+
+#endif /* PhotonMap_h */
@@ -0,0 +1,66 @@
+#ifndef PrimaryCache_h
+#define PrimaryCache_h
+
+#include "Common.hh"
+#include "Packing.hh"
+
+// Sub-pixel jitter patterns cached per pixel, the first frames after a reset trace and fill
+// them, the later ones cycle through them without tracing camera rays
+#define PRIMARY_PATTERNS 4
+// The cache only warms up the image, from this frame on the camera rays take fresh jitter
+// again so the pixel filter converges, the fixed patterns weigh less with every frame
+#define PRIMARY_CACHE_FRAMES 64
+// Pattern of the frames that neither read nor fill the cache
+#define PRIMARY_FRESH PRIMARY_PATTERNS
+
+// First vertex of a camera path, 32 bytes
+struct PrimaryHit {
+    float2 uv;
+    PackedFloat3 position;
+    uint32_t geometric; // octahedral normals
+    uint32_t shading;
+    uint32_t material;  // UINT32_MAX where the camera ray escaped
+};
+
+#ifdef __METAL_VERSION__
+
+#include "HitRecord.hh"
+
+// A lens moves the ray origin every frame, which a cached hit doesn't follow
+inline uint PrimaryPattern(uint frame, float lenRadius) {
+    if (lenRadius > 0 || frame >= PRIMARY_CACHE_FRAMES) { return PRIMARY_FRESH; }
+    return frame % PRIMARY_PATTERNS;
+}
+
+// Fixed offset of a pattern inside the pixel, an R2 sequence rotated per pixel
+inline float2 PrimaryJitter(uint2 pixel, uint pattern) {
+    uint h = pixel.x * 0x8da6b343u ^ pixel.y * 0xd8163841u;
+    h ^= h >> 15; h *= 0x2c1b3c6du; h ^= h >> 12;
+    auto rotation = float2(h & 0xFFFF, h >> 16) / 65536.0;
+    return fract(rotation + float(pattern + 1) * float2(0.7548776662, 0.5698402910));
+}
+
+inline PrimaryHit PrimaryHitPack(bool hitted, const thread HitRecord& hitRecord) {
+    if (!hitted) { return { 0, float3(0), 0, 0, UINT_MAX }; }
+    return { hitRecord.uv, hitRecord.p, PackUnitVector(hitRecord.gn), PackUnitVector(hitRecord.sn), hitRecord.material };
+}
+
+// Fills what the first vertex of a path reads, false for a ray that escaped
+inline bool PrimaryHitUnpack(const device PrimaryHit& cached, const thread Ray& ray, thread HitRecord& hitRecord) {
+    if (cached.material == UINT_MAX) { return false; }
+
+    hitRecord.p = cached.position;
+    hitRecord.t = distance(ray.origin, hitRecord.p);
+    hitRecord.gn = UnpackUnitVector(cached.geometric);
+    hitRecord.sn = UnpackUnitVector(cached.shading);
+    hitRecord.f = dot(ray.direction, hitRecord.gn) <= 0;
+    hitRecord.uv = cached.uv;
+    hitRecord.material = cached.material;
+    hitRecord.light = UINT_MAX;
+    hitRecord.PDF = 0;
+    return true;
+}
+
+#endif
+
+#endif /* PrimaryCache_h */
@@ -67,4 +67,26 @@ struct RandomSampler {
 
 };
 
+// Reads a fixed vector of primary samples, so a path can be traced again or mutated
+struct PrimarySampler {
+    thread float* u;
+    uint count;
+    uint dim = 0;
+    
+    float random() {
+        return sample1D();
+    }
+    
+    inline float sample1D() {
+        return u[min(dim++, count - 1)];
+    }
+    
+    float2 sample2D() {
+        auto a = sample1D();
+        auto b = sample1D();
+        
+        return float2(a, b);
+    }
+};
+
 #endif /* RandomSampler_h */
@@ -0,0 +1,61 @@
+#ifndef ReSTIR_h
+#define ReSTIR_h
+
+#include "Common.hh"
+#include "Packing.hh"
+
+// Light candidates drawn from the light BVH for every pixel and frame
+#define RESTIR_CANDIDATES 32
+
+// Cap of the history a temporal neighbour brings, in multiples of the candidates of this frame,
+// lowered while the camera moves so the reprojected history can't lag behind
+#define RESTIR_TEMPORAL_CAP 20
+#define RESTIR_MOVING_CAP 4
+
+#define RESTIR_SPATIAL_NEIGHBOURS 5
+#define RESTIR_SPATIAL_RADIUS 30
+
+// What the camera ray of a pixel found, kept for the neighbours of this and the next frame
+struct ReSTIRSurface {
+    float2 uv;
+    PackedFloat3 position;
+    uint32_t normal;       // octahedral shading normal
+    uint32_t incoming;     // octahedral camera ray direction
+    uint32_t material;     // UINT32_MAX where the camera ray escaped
+    float depth;
+};
+
+// Weighted reservoir of one light sample, Bitterli et al., Spatiotemporal Reservoir Resampling
+// for Real-Time Ray Tracing with Dynamic Direct Lighting
+struct ReSTIRReservoir {
+    float2 u;      // point on the light
+    uint32_t light;
+    float wSum;
+    float W;       // unbiased contribution weight
+    uint32_t M;
+};
+
+#ifdef __METAL_VERSION__
+
+inline void ReSTIRReset(thread ReSTIRReservoir& r) {
+    r.u = 0; r.light = UINT_MAX;
+    r.wSum = 0; r.W = 0; r.M = 0;
+}
+
+inline bool ReSTIRUpdate(thread ReSTIRReservoir& r, uint32_t light, float2 u, float w, uint32_t M, float random) {
+    r.wSum += w; r.M += M;
+    if (w <= 0 || random * r.wSum > w) { return false; }
+    r.light = light; r.u = u;
+    return true;
+}
+
+// Surfaces close enough in depth and orientation to share light samples
+inline bool ReSTIRSimilar(const thread ReSTIRSurface& a, const thread ReSTIRSurface& b) {
+    if (a.material == UINT_MAX || b.material == UINT_MAX) { return false; }
+    if (abs(a.depth - b.depth) > 0.1 * a.depth) { return false; }
+    return dot(UnpackUnitVector(a.normal), UnpackUnitVector(b.normal)) > 0.9;
+}
+
+#endif
+
+#endif /* ReSTIR_h */
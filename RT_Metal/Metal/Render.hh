@@ -5,7 +5,9 @@
 #include "Random.hh"
 #include "Camera.hh"
 
-//#include "SobolSampler.hh"
+#include "SobolSampler.hh"
+#include "HaltonSampler.hh"
+#include "BlueNoiseSampler.hh"
 #include "RandomSampler.hh"
 
 #include "BVH.hh"
@@ -16,6 +18,8 @@
 #include "Sphere.hh"
 
 #include "Light.hh"
+#include "LightBVH.hh"
+#include "Distribution.hh"
 #include "Spectrum.hh"
 
 #include "Medium.hh"
@@ -28,7 +32,15 @@ struct PackageEnv {
     constant Material*  materials [[id(2)]];
     
     constant GridDensityInfo*   densityInfo [[id(3)]];
-    constant float*            densityArray [[id(4)]];
+    constant uchar*            densityArray [[id(4)]];
+    constant float*            majorantGrid [[id(9)]];
+    constant DensityBrick*    densityBricks [[id(10)]];
+    
+    constant uint16_t*   haltonPermutations [[id(5)]];
+    constant uchar2*         blueNoiseTiles [[id(6)]];
+    
+    constant Distribution2D*     envDistribution [[id(7)]];
+    constant float*                      envData [[id(8)]];
 };
 
 struct PackagePBR {
@@ -41,12 +53,61 @@ struct PackagePBR {
 
 inline float2 SampleSphericalMap(float3 v)
 {
-    float2 uv = float2(atan2(v.z, v.x), asin(v.y));
-    float2 invAtan = float2(0.1591, 0.3183);
+    float2 uv = float2(atan2(v.z, v.x), asin(clamp(v.y, -1.0, 1.0)));
+    float2 invAtan = float2(0.5 * M_1_PI_F, M_1_PI_F);
     uv *= invAtan; uv += 0.5;
     return uv;
 }
 
+// Inverse of SampleSphericalMap
+inline float3 SphericalMapDirection(float2 uv, thread float& cosLatitude)
+{
+    float phi = (uv.x - 0.5) * 2 * M_PI_F;
+    float latitude = (uv.y - 0.5) * M_PI_F;
+    
+    cosLatitude = cos(latitude);
+    return float3(cosLatitude * cos(phi), sin(latitude), cosLatitude * sin(phi));
+}
+
+// The HDR map as a light, sampled through the host-built luminance * cos(latitude) distribution
+struct InfiniteLight {
+    constant PackageEnv& packageEnv;
+    
+    bool valid() {
+        return packageEnv.envDistribution->integral > 0;
+    }
+    
+    float3 Le(float3 dir) {
+        float2 uv = SampleSphericalMap(normalize(dir));
+        return packageEnv.texHDR.sample(textureSampler, uv).rgb;
+    }
+    
+    float3 Sample_Li(const thread float2& u, thread float3& wi, thread float& pdf) {
+        
+        float mapPDF;
+        float2 uv = packageEnv.envDistribution->sample(packageEnv.envData, u, mapPDF);
+        
+        float cosLatitude;
+        wi = SphericalMapDirection(uv, cosLatitude);
+        
+        // dw = cos(latitude) * dlatitude * dphi = 2 * pi^2 * cos(latitude) * du * dv
+        if (mapPDF == 0 || cosLatitude <= 0) { pdf = 0; return 0; }
+        pdf = mapPDF / (2 * M_PI_F * M_PI_F * cosLatitude);
+        
+        return packageEnv.texHDR.sample(textureSampler, uv).rgb;
+    }
+    
+    float PDF_Li(float3 wi) {
+        
+        float2 uv = SampleSphericalMap(normalize(wi));
+        
+        float cosLatitude = cos((uv.y - 0.5) * M_PI_F);
+        if (cosLatitude <= 0) { return 0; }
+        
+        return packageEnv.envDistribution->PDF(packageEnv.envData, uv) / (2 * M_PI_F * M_PI_F * cosLatitude);
+    }
+};
+
 inline float3 LessThan(float3 f, float value)
 {
     return float3(
@@ -127,8 +188,29 @@ struct Primitive {
     constant TriangleVertex*  triList [[id(3)]];
     constant uint32_t*        idxList [[id(4)]];
     constant BVH*             bvhList [[id(5)]];
+    
+    constant Light*         lightList [[id(6)]];
+    constant AliasBin*     aliasTable [[id(7)]];
+    uint32_t               lightCount [[id(8)]];
+    constant LightBVHNode*  lightTree [[id(9)]];
 };
 
+// O(1) pick of a light proportional to its emitted power, UINT_MAX with a pmf of zero without lights
+inline uint SampleLight(constant Primitive& primitives, float u, thread float& pmf) {
+    
+    auto count = primitives.lightCount;
+    if (count == 0) { pmf = 0; return UINT_MAX; }
+    
+    float x = u * count;
+    uint i = min(uint(x), count - 1);
+    
+    constant auto& bin = primitives.aliasTable[i];
+    uint index = (x - i) < bin.q ? i : bin.alias;
+    
+    pmf = primitives.lightList[index].pmf;
+    return index;
+}
+
 struct Scene {
     constant Primitive& primitives;
     
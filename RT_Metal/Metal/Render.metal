@@ -1,4 +1,7 @@
 #include "Render.hh"
+#include "PathGuiding.hh"
+#include "ReSTIR.hh"
+#include "PrimaryCache.hh"
 
 struct RasterizerData {
     float4 position [[position]];
@@ -75,6 +78,220 @@ fragmentShader(RasterizerData input [[stage_in]],
     return tex_color;
 }
 
+// The preview the camera paths render at a fraction of the resolution while the camera moves, brought to
+// the full one. The four nearest preview pixels are blended bilinearly, each weighed by how close its depth
+// is to the nearest one, so edges stay sharp and the environment doesn't bleed onto geometry.
+kernel void
+kernelPreviewUpsample(texture2d<float, access::read>       preview [[texture(0)]],
+                      texture2d<half, access::read>        zNormal [[texture(1)]],
+                      texture2d<float, access::write>   outTexture [[texture(2)]],
+                      
+                      uint2 thread_pos [[thread_position_in_grid]])
+{
+    #ifndef DEVICE_SUPPORTS_NON_UNIFORM_TREADGROUPS
+    if (thread_pos.x >= outTexture.get_width() || thread_pos.y >= outTexture.get_height()) {
+        return;
+    }
+    #endif
+    
+    auto size = int2(preview.get_width(), preview.get_height());
+    auto scale = float2(outTexture.get_width(), outTexture.get_height()) / float2(size);
+    
+    auto p = (float2(thread_pos) + 0.5) / scale - 0.5;
+    auto base = int2(floor(p));
+    auto f = p - float2(base);
+    
+    auto nearest = uint2(clamp(int2(round(p)), int2(0), size - 1));
+    float depth = zNormal.read(nearest).r;
+    
+    float3 color = 0;
+    float total = 0;
+    
+    for (int i = 0; i < 4; ++i) {
+        auto offset = int2(i & 1, i >> 1);
+        auto q = uint2(clamp(base + offset, int2(0), size - 1));
+        
+        auto w = (offset.x ? f.x : 1 - f.x) * (offset.y ? f.y : 1 - f.y);
+        float d = zNormal.read(q).r;
+        // Misses have zero depth, they only blend with each other
+        w *= exp(-abs(d - depth) / (0.05 * max(depth, 1e-4f)));
+        
+        color += w * preview.read(q).rgb;
+        total += w;
+    }
+    
+    color = total > 0 ? color / total : preview.read(nearest).rgb;
+    outTexture.write(float4(color, 1.0), thread_pos);
+}
+
+// Transmittance of a shadow ray. Boundaries of _NIL_ materials are crossed, with the media
+// behind them attenuating the ray, any other surface blocks it.
+template <typename XSampler>
+Spectrum Transmittance(const thread float3& origin, const thread float3& direction, float distance,
+                       MediumType medium, thread XSampler& xsampler,
+                       
+                       thread Scene& scene,
+                       constant PackageEnv& packageEnv)
+{
+    Spectrum Tr = 1;
+    
+    auto ray = Ray(origin, direction);
+    ray.medium = medium;
+    
+    // A medium is entered and departed through two boundaries
+    for (int crossing = 0; crossing < 8; ++crossing) {
+        
+        HitRecord hitRecord;
+        bool hitted = scene.hit(ray, hitRecord, distance);
+        
+        if (hitted && packageEnv.materials[hitRecord.material].type != MaterialType::_NIL_) { return 0; }
+        
+        if (ray.medium == MediumType::Homogeneous) {
+            
+            if (!hitted) { hitRecord.t = distance; }
+            auto homo = HomogeneousMedium(0.02, 0.08, 0.5);
+            Tr *= homo.Tr(ray, hitRecord);
+        }
+        else if (ray.medium == MediumType::GridDensity && hitted) {
+            
+            GridDensityMedium dMedium { packageEnv.densityInfo, packageEnv.densityBricks,
+                                        packageEnv.densityArray, packageEnv.majorantGrid };
+            Tr *= dMedium.Tr(hitRecord._r, hitRecord, xsampler);
+        }
+        
+        if (!hitted || all(Tr <= 0)) { return Tr; }
+        
+        distance -= hitRecord.t;
+        
+        if (dot(ray.direction, hitRecord.gn) < 0) { // enter
+            ray = Ray(offset_ray(hitRecord.p, -hitRecord.gn), ray.direction);
+            ray.medium = packageEnv.materials[hitRecord.material].medium;
+        }
+        else { // depart
+            ray = Ray(offset_ray(hitRecord.p, hitRecord.gn), ray.direction);
+            ray.medium = MediumType::_NIL_;
+        }
+    }
+    
+    return Tr;
+}
+
+// Next event estimation: one light picked from the light BVH by importance, MIS-weighted against the BXDF,
+// or against its mixture with the guiding quadtree
+template <typename XSampler>
+Spectrum sampleLights(const thread Ray& ray, const thread HitRecord& hitRecord,
+                      const thread float3x3& wts, const thread float3& _origin,
+                      const thread float2& uu, thread XSampler& xsampler,
+                      
+                      thread Scene& scene,
+                      constant PackageEnv& packageEnv,
+                      constant Primitive&  primitives,
+                      const thread GuideSampler* guide = nullptr)
+{
+    if (primitives.lightCount == 0) { return 0; }
+    
+    float lightPMF;
+    auto lightIndex = SampleLightTree(primitives.lightTree, _origin, hitRecord.sn, xsampler.sample1D(), lightPMF);
+    if (lightIndex == UINT_MAX || lightPMF <= 0) { return 0; }
+    constant auto& light = primitives.lightList[lightIndex];
+    
+    LightSampleRecord lsr;
+    primitives.squareList[light.pIndex].sample(uu, _origin, lsr);
+    
+    auto _dir = lsr.p - _origin;
+    auto _nor = normalize(_dir);
+    
+    const auto _dis = length(_dir);
+    
+    auto Tr = Transmittance(_origin, _nor, _dis, ray.medium, xsampler, scene, packageEnv);
+    if ( all(Tr <= 0) ) { return 0; }
+    
+    auto wo = wts * (-ray.direction);
+    auto wi = wts * _nor; float bxPDF;
+    
+    float3 weight = Tr * packageEnv.materials[hitRecord.material].F(wo, wi, hitRecord.uv, bxPDF, uu);
+    if (guide != nullptr) { bxPDF = guide->mix(bxPDF, _nor); }
+    
+    auto cosOnLight = abs( dot(lsr.n, -_nor) );
+    
+    auto Li = packageEnv.materials[lsr.material].textureInfo.albedo;
+    weight *= Li * cosOnLight;
+    
+    auto dist2 = _dis * _dis;
+    auto liPDF = lightPMF * dist2 * lsr.areaPDF / cosOnLight;
+    
+    weight *= PowerHeuristic(1, liPDF, 1, bxPDF);
+    return weight / liPDF;
+}
+
+// Next event estimation towards the environment, MIS-weighted against the BXDF
+template <typename XSampler>
+Spectrum sampleEnvironment(const thread Ray& ray, const thread HitRecord& hitRecord,
+                           const thread float3x3& wts, const thread float3& _origin,
+                           const thread float2& uu, thread XSampler& xsampler,
+                           
+                           thread Scene& scene,
+                           constant PackageEnv& packageEnv,
+                           const thread GuideSampler* guide = nullptr)
+{
+    InfiniteLight env { packageEnv };
+    if (!env.valid()) { return 0; }
+    
+    float3 _nor; float liPDF;
+    auto Li = env.Sample_Li(xsampler.sample2D(), _nor, liPDF);
+    
+    if (liPDF <= 0) { return 0; }
+    
+    auto Tr = Transmittance(_origin, _nor, FLT_MAX, ray.medium, xsampler, scene, packageEnv);
+    if ( all(Tr <= 0) ) { return 0; }
+    
+    auto wo = wts * (-ray.direction);
+    auto wi = wts * _nor; float bxPDF;
+    
+    float3 weight = Tr * packageEnv.materials[hitRecord.material].F(wo, wi, hitRecord.uv, bxPDF, uu);
+    if (guide != nullptr) { bxPDF = guide->mix(bxPDF, _nor); }
+    
+    weight *= Li * PowerHeuristic(1, liPDF, 1, bxPDF);
+    
+    return weight / liPDF;
+}
+
+// Next event estimation from a scattering event inside a medium, MIS-weighted against the phase function
+template <typename XSampler>
+Spectrum sampleLightsMedium(const thread float3& wo, const thread MediumInteraction& mi,
+                            MediumType medium, thread XSampler& xsampler,
+                            
+                            thread Scene& scene,
+                            constant PackageEnv& packageEnv,
+                            constant Primitive&  primitives)
+{
+    if (primitives.lightCount == 0) { return 0; }
+    
+    float lightPMF;
+    auto lightIndex = SampleLightTree(primitives.lightTree, mi.p, float3(0), xsampler.sample1D(), lightPMF);
+    if (lightIndex == UINT_MAX || lightPMF <= 0) { return 0; }
+    constant auto& light = primitives.lightList[lightIndex];
+    
+    LightSampleRecord lsr;
+    primitives.squareList[light.pIndex].sample(xsampler.sample2D(), mi.p, lsr);
+    
+    auto _dir = lsr.p - mi.p;
+    auto _nor = normalize(_dir);
+    const auto _dis = length(_dir);
+    
+    auto Tr = Transmittance(mi.p, _nor, _dis, medium, xsampler, scene, packageEnv);
+    if ( all(Tr <= 0) ) { return 0; }
+    
+    auto phase = HenyeyGreenstein(mi.phaseG).p(wo, _nor);
+    
+    auto cosOnLight = abs( dot(lsr.n, -_nor) );
+    auto Li = packageEnv.materials[lsr.material].textureInfo.albedo;
+    
+    auto liPDF = lightPMF * _dis * _dis * lsr.areaPDF / cosOnLight;
+    
+    return Tr * Li * cosOnLight * phase * PowerHeuristic(1, liPDF, 1, phase) / liPDF;
+}
+
 template <typename XSampler>
 Spectrum traceVolume(float depth, thread Ray& ray, thread XSampler& xsampler,
                 
@@ -91,6 +308,10 @@ Spectrum traceVolume(float depth, thread Ray& ray, thread XSampler& xsampler,
     
     Scene scene { primitives };
     
+    // Density of the direction the last scattering event sampled, phase function or BXDF, kept across
+    // _NIL_ boundaries so an emitter found behind them is weighed against the light sampling that reaches it
+    float misPDF = 0; float3 misOrigin, misNormal;
+    
 //    bool edge_hitted = false;
 //    if ( edge_hitted ) { return float3(10); }
     
@@ -108,7 +329,17 @@ Spectrum traceVolume(float depth, thread Ray& ray, thread XSampler& xsampler,
         if ( packageEnv.materials[hitRecord.material].type == MaterialType::Diffuse ) {
             auto le = packageEnv.materials[hitRecord.material].textureInfo.albedo;
             auto w = dot(-ray.direction, -hitRecord.gn);
-            return ratio * le * abs(w);
+            auto radiance = ratio * le * abs(w);
+            
+            if (misPDF > 0 && hitRecord.light < primitives.lightCount) {
+                auto bitTrail = primitives.lightList[hitRecord.light].bitTrail;
+                auto lightPMF = LightTreePMF(primitives.lightTree, bitTrail, misOrigin, misNormal);
+                auto dist2 = distance_squared(hitRecord.p, misOrigin);
+                auto lightPDF = lightPMF * hitRecord.PDF * dist2 / abs(w);
+                
+                radiance *= PowerHeuristic(1, misPDF, 1, lightPDF);
+            }
+            return color + radiance;
         }
         
         MediumInteraction mi;
@@ -120,7 +351,8 @@ Spectrum traceVolume(float depth, thread Ray& ray, thread XSampler& xsampler,
         }
         else if (ray.medium == MediumType::GridDensity) {
             
-            GridDensityMedium dMedium { packageEnv.densityInfo, packageEnv.densityArray };
+            GridDensityMedium dMedium { packageEnv.densityInfo, packageEnv.densityBricks,
+                                        packageEnv.densityArray, packageEnv.majorantGrid };
             ratio *= dMedium.Sample(hitRecord._r, hitRecord, &mi, xsampler);
         }
         
@@ -130,7 +362,12 @@ Spectrum traceVolume(float depth, thread Ray& ray, thread XSampler& xsampler,
         if (mi.homogen != nullptr || mi.density != nullptr) {
 
             float3 wi, wo = -ray.direction;
-            HenyeyGreenstein(mi.phaseG).Sample_p(wo, wi, xsampler.sample2D());
+            
+            color += ratio * sampleLightsMedium(wo, mi, ray.medium, xsampler,
+                                                scene, packageEnv, primitives);
+            
+            misPDF = HenyeyGreenstein(mi.phaseG).Sample_p(wo, wi, xsampler.sample2D());
+            misOrigin = mi.p; misNormal = 0;
             
             ray.update(mi.p, wi);
             ray.medium = packageEnv.materials[hitRecord.material].medium;
@@ -167,50 +404,22 @@ Spectrum traceVolume(float depth, thread Ray& ray, thread XSampler& xsampler,
         
         if (!need_bsdf) { continue; }
         
-        LightSampleRecord lsr;
+        misPDF = 0;
+        
         float2 uu = xsampler.sample2D();
         
         const auto $origin = hitRecord.p;
         auto _origin = offset_ray(hitRecord.p, hitRecord.sn);
         //auto _origin = hitRecord.p + hitRecord.sn / 4096;
-        
-        if (xsampler.random() < 0.5) {
-            primitives.squareList[5].sample(uu, _origin, lsr);
-        } else {
-            primitives.squareList[6].sample(uu, _origin, lsr);
-        }
-
-        auto _dir = lsr.p - _origin;
-        auto _nor = normalize(_dir);
+        const auto _normal = hitRecord.sn;
         
         float3 nx, ny;
         CoordinateSystem(hitRecord.sn, nx, ny);
         float3x3 stw = { nx, ny, hitRecord.sn };
         float3x3 wts = transpose(stw);
         
-        const auto _tr = 1.0;
-        const auto _dis = length(_dir);
-        const auto _ray = Ray(_origin, _nor); HitRecord shr;
-        const auto blocked = scene.hit(_ray, shr, _dis, true);
-
-        if( !blocked ) { // Light Sampling
-
-            auto wo = wts * (-ray.direction);
-            auto wi = wts * (_ray.direction); float bxPDF;
-
-            float3 weight = packageEnv.materials[hitRecord.material].F(wo, wi, hitRecord.uv, bxPDF, uu);
-
-            auto cosOnLight = abs( dot(lsr.n, -_nor) );
-            
-            auto Li = packageEnv.materials[lsr.material].textureInfo.albedo;
-            weight *= Li * cosOnLight;
-
-            auto dist2 = _dis * _dis; //distance_squared(lsr.p, _origin);
-            auto liPDF = dist2 * lsr.areaPDF / cosOnLight;
-
-            weight *= PowerHeuristic(1, liPDF, 1, bxPDF);
-            color += _tr * ratio * weight / liPDF;
-        }
+        color += ratio * sampleLights(ray, hitRecord, wts, _origin, uu, xsampler,
+                                      scene, packageEnv, primitives);
 
         // BXDF Sampling
         float3 wi; float bxPDF;
@@ -223,6 +432,11 @@ Spectrum traceVolume(float depth, thread Ray& ray, thread XSampler& xsampler,
         
         if (bxPDF <= 0) {break;}
         
+        // Delta lobes can't be matched by light sampling
+        if (packageEnv.materials[hitRecord.material].PDF(wo, wi, uu) > 0) {
+            misPDF = bxPDF; misOrigin = _origin; misNormal = _normal;
+        }
+        
         if (wi.z < 0) { // Transmission
             
             wi = stw * wi;
@@ -253,7 +467,8 @@ Spectrum traceVolume(float depth, thread Ray& ray, thread XSampler& xsampler,
         
         hitted = scene.hit(ray, hitRecord, FLT_MAX);
         
-        if (hitted && packageEnv.materials[hitRecord.material].type == MaterialType::Diffuse) {
+        if (hitted && packageEnv.materials[hitRecord.material].type == MaterialType::Diffuse
+                   && hitRecord.light < primitives.lightCount) {
                 
             auto Li = packageEnv.materials[hitRecord.material].textureInfo.albedo;
             auto cosOnLight = dot(-ray.direction, hitRecord.sn);
@@ -261,7 +476,9 @@ Spectrum traceVolume(float depth, thread Ray& ray, thread XSampler& xsampler,
             auto weight = scatRecord.attenuation * Li * cosOnLight;
             
             auto dist2 = distance_squared(hitRecord.p, ray.origin);
-            auto lightPDF =  hitRecord.PDF * dist2 / cosOnLight;
+            auto bitTrail = primitives.lightList[hitRecord.light].bitTrail;
+            auto lightPMF = LightTreePMF(primitives.lightTree, bitTrail, _origin, _normal);
+            auto lightPDF = lightPMF * hitRecord.PDF * dist2 / cosOnLight;
             
             weight *= PowerHeuristic(1, scatRecord.bxPDF, 1, lightPDF);
             color += ratio * weight / scatRecord.bxPDF;
@@ -274,15 +491,15 @@ Spectrum traceVolume(float depth, thread Ray& ray, thread XSampler& xsampler,
     return color;
 }
 
+// Continues from the first hit of ray, already found
 template <typename XSampler>
-Spectrum traceMIS(float depth, thread Ray& ray, thread XSampler& xsampler,
+Spectrum traceMIS(float depth, thread Ray& ray, thread HitRecord& hitRecord, bool hitted, thread XSampler& xsampler,
                 
                      constant PackageEnv& packageEnv,
                      constant PackagePBR& packagePBR,
 
                      constant Primitive&  primitives)
 {
-    HitRecord hitRecord;
     BxRecord scatRecord;
     
     Spectrum ratio = Spectrum(1.0);
@@ -293,15 +510,18 @@ Spectrum traceMIS(float depth, thread Ray& ray, thread XSampler& xsampler,
 //    bool edge_hitted = false;
 //    if ( edge_hitted ) { return float3(10); }
     
-    bool hitted = scene.hit(ray, hitRecord, FLT_MAX);
+    InfiniteLight env { packageEnv };
+    // Camera rays and delta BXDF samples can't be matched by light sampling
+    bool misBounce = false;
     
     do { // each ray
         
         if ( !hitted ) {
-            float3 sphereVector = ray.direction;
-            float2 uv = SampleSphericalMap(normalize(sphereVector));
-            auto ambient = packageEnv.texHDR.sample(textureSampler, uv);
-            color += ratio * ambient.rgb; break;
+            auto ambient = env.Le(ray.direction);
+            if (misBounce && env.valid()) {
+                ambient *= PowerHeuristic(1, scatRecord.bxPDF, 1, env.PDF_Li(ray.direction));
+            }
+            color += ratio * ambient; break;
         }
         
         if ( packageEnv.materials[hitRecord.material].type == MaterialType::Diffuse ) {
@@ -310,50 +530,22 @@ Spectrum traceMIS(float depth, thread Ray& ray, thread XSampler& xsampler,
             return ratio * le * abs(w);
         }
         
-        LightSampleRecord lsr;
         float2 uu = xsampler.sample2D();
         
         const auto $origin = hitRecord.p;
         auto _origin = offset_ray(hitRecord.p, hitRecord.sn);
         //auto _origin = hitRecord.p + hitRecord.sn / 4096;
-        
-        if (xsampler.random() < 0.5) {
-            primitives.squareList[5].sample(uu, _origin, lsr);
-        } else {
-            primitives.squareList[6].sample(uu, _origin, lsr);
-        }
-
-        auto _dir = lsr.p - _origin;
-        auto _nor = normalize(_dir);
+        const auto _normal = hitRecord.sn;
         
         float3 nx, ny;
         CoordinateSystem(hitRecord.sn, nx, ny);
         float3x3 stw = { nx, ny, hitRecord.sn };
         float3x3 wts = transpose(stw);
         
-        const auto _tr = 1.0;
-        const auto _dis = length(_dir);
-        const auto _ray = Ray(_origin, _nor); HitRecord shr;
-        const auto blocked = scene.hit(_ray, shr, _dis, true);
-
-        if( !blocked ) { // Light Sampling
-
-            auto wo = wts * (-ray.direction);
-            auto wi = wts * (_ray.direction); float bxPDF;
-
-            float3 weight = packageEnv.materials[hitRecord.material].F(wo, wi, hitRecord.uv, bxPDF, uu);
-
-            auto cosOnLight = abs( dot(lsr.n, -_nor) );
-            
-            auto Li = packageEnv.materials[lsr.material].textureInfo.albedo;
-            weight *= Li * cosOnLight;
-
-            auto dist2 = _dis * _dis; //distance_squared(lsr.p, _origin);
-            auto liPDF = dist2 * lsr.areaPDF / cosOnLight;
-
-            weight *= PowerHeuristic(1, liPDF, 1, bxPDF);
-            color += _tr * ratio * weight / liPDF;
-        }
+        color += ratio * sampleLights(ray, hitRecord, wts, _origin, uu, xsampler,
+                                      scene, packageEnv, primitives);
+        color += ratio * sampleEnvironment(ray, hitRecord, wts, _origin, uu, xsampler,
+                                           scene, packageEnv);
 
         // BXDF Sampling
         float3 wi; float bxPDF;
@@ -366,6 +558,8 @@ Spectrum traceMIS(float depth, thread Ray& ray, thread XSampler& xsampler,
         
         if (bxPDF <= 0) {break;}
         
+        misBounce = packageEnv.materials[hitRecord.material].PDF(wo, wi, uu) > 0;
+        
         if (wi.z < 0) { // Transmission
             
             wi = stw * wi;
@@ -387,7 +581,8 @@ Spectrum traceMIS(float depth, thread Ray& ray, thread XSampler& xsampler,
         
         hitted = scene.hit(ray, hitRecord, FLT_MAX);
         
-        if (hitted && packageEnv.materials[hitRecord.material].type == MaterialType::Diffuse) {
+        if (hitted && packageEnv.materials[hitRecord.material].type == MaterialType::Diffuse
+                   && hitRecord.light < primitives.lightCount) {
                 
             auto Li = packageEnv.materials[hitRecord.material].textureInfo.albedo;
             auto cosOnLight = dot(-ray.direction, hitRecord.sn);
@@ -395,7 +590,9 @@ Spectrum traceMIS(float depth, thread Ray& ray, thread XSampler& xsampler,
             auto weight = scatRecord.attenuation * Li * cosOnLight;
             
             auto dist2 = distance_squared(hitRecord.p, ray.origin);
-            auto lightPDF =  hitRecord.PDF * dist2 / cosOnLight;
+            auto bitTrail = primitives.lightList[hitRecord.light].bitTrail;
+            auto lightPMF = LightTreePMF(primitives.lightTree, bitTrail, _origin, _normal);
+            auto lightPDF = lightPMF * hitRecord.PDF * dist2 / cosOnLight;
             
             weight *= PowerHeuristic(1, scatRecord.bxPDF, 1, lightPDF);
             color += ratio * weight / scatRecord.bxPDF;
@@ -408,6 +605,22 @@ Spectrum traceMIS(float depth, thread Ray& ray, thread XSampler& xsampler,
     return color;
 }
 
+template <typename XSampler>
+Spectrum traceMIS(float depth, thread Ray& ray, thread XSampler& xsampler,
+                
+                     constant PackageEnv& packageEnv,
+                     constant PackagePBR& packagePBR,
+
+                     constant Primitive&  primitives)
+{
+    HitRecord hitRecord;
+    Scene scene { primitives };
+    
+    bool hitted = scene.hit(ray, hitRecord, FLT_MAX);
+    
+    return traceMIS(depth, ray, hitRecord, hitted, xsampler, packageEnv, packagePBR, primitives);
+}
+
 template <typename XSampler>
 Spectrum tracePath(float depth, thread Ray& ray, thread XSampler& xsampler,
                 
@@ -491,6 +704,210 @@ Spectrum tracePath(float depth, thread Ray& ray, thread XSampler& xsampler,
     return color;
 }
 
+// Path tracing with the BXDF mixed with the SD-tree of the spatial leaf at every non-delta vertex.
+// While the trees are trained every guided vertex leaves a record of the radiance its path found.
+template <typename XSampler>
+Spectrum traceGuided(thread Ray& ray, thread XSampler& xsampler, thread half4& zN, thread float3& position,
+                     
+                     constant GuideSpatialNode* guideSpatial,
+                     constant GuideQuadNode*    guideQuads,
+                     constant AABB&             sceneBox,
+                     
+                     device GuideRecord*  records,
+                     device atomic_uint*  recordCount,
+                     uint32_t             recordCapacity,
+                     bool                 training,
+                     
+                     constant PackageEnv& packageEnv,
+                     constant Primitive&  primitives)
+{
+    struct GuideVertex {
+        float3 position;
+        float3 before, after; // throughput around the scattering
+        float3 mark;          // color before the path left the vertex
+        float2 direction;
+        float bsdfPDF, guidePDF, mixPDF;
+    };
+    
+    GuideVertex vertices[GUIDE_PATH_DEPTH];
+    uint32_t vertexCount = 0;
+    
+    HitRecord hitRecord;
+    
+    Spectrum ratio = Spectrum(1.0);
+    Spectrum color = Spectrum(0.0);
+    
+    Scene scene { primitives };
+    
+    InfiniteLight env { packageEnv };
+    // Camera rays and delta BXDF samples can't be matched by light sampling
+    bool misBounce = false; float misPDF = 0;
+    
+    bool hitted = scene.hit(ray, hitRecord, FLT_MAX);
+    
+    if (hitted) {
+        zN.r = hitRecord.t / 1024;
+        zN.gba = half3(hitRecord.sn);
+        position = hitRecord.p;
+    }
+    
+    for (int bounce = 0; bounce < GUIDE_PATH_DEPTH; ++bounce) {
+        
+        if ( !hitted ) {
+            auto ambient = env.Le(ray.direction);
+            if (misBounce && env.valid()) {
+                ambient *= PowerHeuristic(1, misPDF, 1, env.PDF_Li(ray.direction));
+            }
+            color += ratio * ambient; break;
+        }
+        
+        constant auto& material = packageEnv.materials[hitRecord.material];
+        
+        if ( material.type == MaterialType::Diffuse ) {
+            // Only the camera ray gets here, later emitter hits are weighted below
+            auto le = material.textureInfo.albedo;
+            auto w = dot(-ray.direction, -hitRecord.gn);
+            color += ratio * le * abs(w); break;
+        }
+        
+        float2 uu = xsampler.sample2D();
+        
+        const auto $origin = hitRecord.p;
+        auto _origin = offset_ray(hitRecord.p, hitRecord.sn);
+        const auto _normal = hitRecord.sn;
+        
+        float3 nx, ny;
+        CoordinateSystem(hitRecord.sn, nx, ny);
+        float3x3 stw = { nx, ny, hitRecord.sn };
+        float3x3 wts = transpose(stw);
+        
+        GuideSampler guide { guideSpatial, guideQuads, sceneBox, hitRecord.p };
+        bool guided = !material.specular;
+        const thread GuideSampler* mixing = guided ? &guide : nullptr;
+        
+        color += ratio * sampleLights(ray, hitRecord, wts, _origin, uu, xsampler,
+                                      scene, packageEnv, primitives, mixing);
+        color += ratio * sampleEnvironment(ray, hitRecord, wts, _origin, uu, xsampler,
+                                           scene, packageEnv, mixing);
+        
+        // One sample of the mixture, its density is what the weights see
+        float3 wi, attenuation; float bxPDF, guidePDF = 0;
+        float3 wo = wts * (-ray.direction);
+        
+        if (guided && xsampler.random() >= guide.bsdfFraction) {
+            wi = wts * guide.sample(xsampler.sample2D(), guidePDF);
+            attenuation = material.F(wo, wi, hitRecord.uv, bxPDF, uu);
+        } else {
+            attenuation = material.S_F(wo, wi, hitRecord.uv, uu, bxPDF);
+            if (guided) { guidePDF = guide.pdf(stw * wi); }
+        }
+        
+        auto mixPDF = guided ? guide.bsdfFraction * bxPDF + (1 - guide.bsdfFraction) * guidePDF : bxPDF;
+        if (mixPDF <= 0) { break; }
+        
+        misBounce = material.PDF(wo, wi, uu) > 0;
+        misPDF = mixPDF;
+        
+        auto direction = stw * wi;
+        
+        if (wi.z < 0) { // Transmission
+            ray.update(offset_ray($origin, -hitRecord.sn), direction);
+        } else { // do not change medium
+            ray.update(_origin, direction);
+        }
+        
+        auto before = ratio;
+        ratio *= attenuation / mixPDF;
+        
+        // Before the roulette, so the radiance of the record carries its compensation
+        if (training && guided) {
+            vertices[vertexCount++] = { hitRecord.p, before, ratio, color,
+                                        GuideCylindrical(direction), bxPDF, guidePDF, mixPDF };
+        }
+        
+        { // Russian Roulette
+            float3 xyz; RGBToXYZ(ratio, xyz);
+            float p = xyz.y;
+            if (xsampler.random() > p) break;
+            // Add the energy we 'lose'
+            ratio *= 1.0f / p;
+        }
+        
+        hitted = scene.hit(ray, hitRecord, FLT_MAX);
+        
+        if (hitted && packageEnv.materials[hitRecord.material].type == MaterialType::Diffuse
+                   && hitRecord.light < primitives.lightCount) {
+            
+            auto Li = packageEnv.materials[hitRecord.material].textureInfo.albedo;
+            auto cosOnLight = abs(dot(-ray.direction, hitRecord.sn));
+            
+            auto dist2 = distance_squared(hitRecord.p, ray.origin);
+            auto bitTrail = primitives.lightList[hitRecord.light].bitTrail;
+            auto lightPMF = LightTreePMF(primitives.lightTree, bitTrail, _origin, _normal);
+            auto lightPDF = lightPMF * hitRecord.PDF * dist2 / cosOnLight;
+            
+            color += ratio * Li * cosOnLight * PowerHeuristic(1, mixPDF, 1, lightPDF);
+            break;
+        }
+    }
+    
+    if (vertexCount == 0) { return color; }
+    
+    auto first = atomic_fetch_add_explicit(recordCount, vertexCount, memory_order_relaxed);
+    
+    for (uint32_t i = 0; i < vertexCount && first + i < recordCapacity; ++i) {
+        
+        thread auto& v = vertices[i];
+        
+        // What arrived along the sampled direction is everything added after the vertex
+        auto found = max(color - v.mark, 0.0f);
+        auto Li = select(float3(0), found / v.after, v.after > 0);
+        auto fLi = select(float3(0), found / v.before, v.before > 0);
+        
+        auto luminance = float3(0.2126, 0.7152, 0.0722);
+        
+        records[first + i] = { v.position, dot(Li, luminance) / v.mixPDF, v.direction,
+                               dot(fLi, luminance), v.bsdfPDF, v.guidePDF };
+    }
+    
+    return color;
+}
+
+
+// The camera ray goes through a cached jitter pattern while the image warms up, its hit is traced
+// once after a reset then read back
+template <typename XSampler>
+Spectrum tracePixel(uint2 pixel, float2 size,
+                    constant Camera* camera, thread XSampler& xsampler,
+                    device PrimaryHit& primary, uint pattern, bool cached,
+                    
+                    constant PackageEnv& packageEnv,
+                    constant PackagePBR& packagePBR,
+                    constant Primitive&  primitives)
+{
+    auto jitter = xsampler.sample2D();
+    if (pattern != PRIMARY_FRESH) { jitter = PrimaryJitter(pixel, pattern); }
+    auto u = (pixel.x + jitter.x) / size.x;
+    auto v = (pixel.y + jitter.y) / size.y;
+    
+    auto ray = castRay(camera, u, v, &xsampler);
+    
+    HitRecord hitRecord;
+    bool hitted;
+    
+    if (cached) {
+        hitted = PrimaryHitUnpack(primary, ray, hitRecord);
+    } else {
+        Scene scene { primitives };
+        hitted = scene.hit(ray, hitRecord, FLT_MAX);
+        if (pattern != PRIMARY_FRESH) { primary = PrimaryHitPack(hitted, hitRecord); }
+    }
+    
+    return traceMIS(8, ray, hitRecord, hitted, xsampler,
+                    packageEnv,
+                    packagePBR,
+                    primitives);
+}
 
 kernel void
 kernelPathTracing(texture2d<float, access::read>       inTexture [[texture(0)]],
@@ -506,7 +923,9 @@ kernelPathTracing(texture2d<float, access::read>       inTexture [[texture(0)]],
              
                   constant Primitive&   primitives [[buffer(7)]],
                   constant PackageEnv&  packageEnv [[buffer(8)]],
-                  constant PackagePBR*  packagePBR [[buffer(9)]])
+                  constant PackagePBR*  packagePBR [[buffer(9)]],
+                  
+                  device PrimaryHit*  primaryCache [[buffer(10)]])
 {
     uint32_t rr = inRNG.read(thread_pos).r;
     uint32_t gg = inRNG.read(thread_pos).g;
@@ -520,19 +939,34 @@ kernelPathTracing(texture2d<float, access::read>       inTexture [[texture(0)]],
     
     auto frame = complex->frame_count;
         
-    auto u = float(thread_pos.x)/outTexture.get_width();
-    auto v = float(thread_pos.y)/outTexture.get_height();
+    float2 size = float2(outTexture.get_width(), outTexture.get_height());
+    float3 color;
     
-    float3 color; RandomSampler rs { &rng };
-    auto ray = castRay(camera, u, v, &rs);
+    auto pattern = PrimaryPattern(frame, camera->lenRadius);
+    auto cached = pattern != PRIMARY_FRESH && frame >= PRIMARY_PATTERNS;
+    device auto& primary = primaryCache[(pattern % PRIMARY_PATTERNS * outTexture.get_height() + thread_pos.y) * outTexture.get_width() + thread_pos.x];
     
-    //uint2 vsize = { inTexture.get_width(), inTexture.get_height()};
-    //auto ss = pbrt::SobolSampler(rng, frame, thread_pos, vsize);
-    
-    color = tracePath(8, ray, rs,
-                        packageEnv,
-                        packagePBR[1],
-                        primitives);
+    switch (complex->sampler) {
+        case SamplerType::Halton: {
+            HaltonSampler hs { &rng, packageEnv.haltonPermutations, thread_pos, frame };
+            color = tracePixel(thread_pos, size, camera, hs, primary, pattern, cached, packageEnv, packagePBR[1], primitives);
+            break;
+        }
+        case SamplerType::BlueNoise: {
+            BlueNoiseSampler bs { &rng, packageEnv.blueNoiseTiles, thread_pos, frame };
+            color = tracePixel(thread_pos, size, camera, bs, primary, pattern, cached, packageEnv, packagePBR[1], primitives);
+            break;
+        }
+        case SamplerType::Random: {
+            RandomSampler rs { &rng };
+            color = tracePixel(thread_pos, size, camera, rs, primary, pattern, cached, packageEnv, packagePBR[1], primitives);
+            break;
+        }
+        default: {
+            pbrt::SobolSampler ss { &rng, thread_pos, frame };
+            color = tracePixel(thread_pos, size, camera, ss, primary, pattern, cached, packageEnv, packagePBR[1], primitives);
+        }
+    }
     
     auto bad = isinf(color) || isnan(color);
     if( any(bad) ) { color = float3(0); }
@@ -556,3 +990,530 @@ kernelPathTracing(texture2d<float, access::read>       inTexture [[texture(0)]],
     
     outRNG.write(rng_cache, thread_pos);
 }
+
+template <typename XSampler>
+Spectrum guidedPixel(uint2 pixel, float2 size,
+                     constant Camera* camera, thread XSampler& xsampler, thread half4& zN, thread float3& position,
+                     
+                     constant GuideSpatialNode* guideSpatial,
+                     constant GuideQuadNode*    guideQuads,
+                     constant AABB&             sceneBox,
+                     
+                     device GuideRecord*  records,
+                     device atomic_uint*  recordCount,
+                     uint32_t             recordCapacity,
+                     bool                 training,
+                     
+                     constant PackageEnv& packageEnv,
+                     constant Primitive&  primitives)
+{
+    auto jitter = xsampler.sample2D();
+    auto u = (pixel.x + jitter.x) / size.x;
+    auto v = (pixel.y + jitter.y) / size.y;
+    
+    auto ray = castRay(camera, u, v, &xsampler);
+    
+    return traceGuided(ray, xsampler, zN, position, guideSpatial, guideQuads, sceneBox,
+                       records, recordCount, recordCapacity, training, packageEnv, primitives);
+}
+
+kernel void
+kernelPathGuiding(texture2d<float, access::read>        inTexture [[texture(0)]],
+                  texture2d<float, access::write>      outTexture [[texture(1)]],
+                  texture2d<float, access::write>      sourceSVGF [[texture(2)]],
+                  
+                  texture2d<half, access::write>          zNormal [[texture(3)]],
+                  texture2d<half, access::write>         motion2D [[texture(4)]],
+                  
+                  texture2d<uint32_t, access::read>         inRNG [[texture(5)]],
+                  texture2d<uint32_t, access::write>       outRNG [[texture(6)]],
+                  
+                  uint2 thread_pos                  [[thread_position_in_grid]],
+                  
+                  constant Camera*                camera [[buffer(0)]],
+                  constant Complex*              complex [[buffer(1)]],
+                  
+                  constant GuideSpatialNode* guideSpatial [[buffer(2)]],
+                  constant GuideQuadNode*      guideQuads [[buffer(3)]],
+                  device GuideRecord*             records [[buffer(4)]],
+                  device atomic_uint*         recordCount [[buffer(5)]],
+                  constant uint32_t&       recordCapacity [[buffer(6)]],
+                  
+                  constant Primitive&         primitives [[buffer(7)]],
+                  constant PackageEnv&        packageEnv [[buffer(8)]],
+                  
+                  constant AABB&                sceneBox [[buffer(10)]],
+                  constant Camera*        cameraPrevious [[buffer(11)]])
+{
+    #ifndef DEVICE_SUPPORTS_NON_UNIFORM_TREADGROUPS
+    if (thread_pos.x >= inRNG.get_width() || thread_pos.y >= inRNG.get_height()) {
+        return;
+    }
+    #endif
+    
+    auto rng_cache = inRNG.read(thread_pos);
+    pcg32_t rng = toRNG(rng_cache);
+    
+    auto frame = complex->frame_count;
+    bool training = complex->guideTraining && (thread_pos.x + thread_pos.y + frame) % GUIDE_RECORD_STRIDE == 0;
+    
+    float2 size = float2(outTexture.get_width(), outTexture.get_height());
+    
+    half4 zN = 0;
+    float3 position;
+    float3 color;
+    
+    switch (complex->sampler) {
+        case SamplerType::Halton: {
+            HaltonSampler hs { &rng, packageEnv.haltonPermutations, thread_pos, frame };
+            color = guidedPixel(thread_pos, size, camera, hs, zN, position, guideSpatial, guideQuads, sceneBox,
+                                records, recordCount, recordCapacity, training, packageEnv, primitives);
+            break;
+        }
+        case SamplerType::BlueNoise: {
+            BlueNoiseSampler bs { &rng, packageEnv.blueNoiseTiles, thread_pos, frame };
+            color = guidedPixel(thread_pos, size, camera, bs, zN, position, guideSpatial, guideQuads, sceneBox,
+                                records, recordCount, recordCapacity, training, packageEnv, primitives);
+            break;
+        }
+        case SamplerType::Random: {
+            RandomSampler rs { &rng };
+            color = guidedPixel(thread_pos, size, camera, rs, zN, position, guideSpatial, guideQuads, sceneBox,
+                                records, recordCount, recordCapacity, training, packageEnv, primitives);
+            break;
+        }
+        default: {
+            pbrt::SobolSampler ss { &rng, thread_pos, frame };
+            color = guidedPixel(thread_pos, size, camera, ss, zN, position, guideSpatial, guideQuads, sceneBox,
+                                records, recordCount, recordCapacity, training, packageEnv, primitives);
+        }
+    }
+    
+    if (any(isinf(color) || isnan(color))) { color = float3(0); }
+    
+    float3 cached = inTexture.read(thread_pos).rgb;
+    float3 result = (cached * frame + color) / (frame + 1);
+    
+    outTexture.write(float4(result, 1.0), thread_pos);
+    sourceSVGF.write(float4(result, 1.0), thread_pos);
+    
+    zNormal.write(zN, thread_pos);
+    
+    auto motion = zN.r > 0 ? CameraMotion(camera, cameraPrevious, position, size) : float2(0);
+    motion2D.write(half4(half2(motion), 0, 0), thread_pos);
+    
+    outRNG.write(exRNG(rng), thread_pos);
+}
+
+// Surfaces lit by resampled light samples, emitters and delta BXDFs are left to the paths
+inline bool ReSTIRLit(const thread ReSTIRSurface& s, constant PackageEnv& packageEnv)
+{
+    if (s.material == UINT_MAX) { return false; }
+    constant auto& material = packageEnv.materials[s.material];
+    return material.type != MaterialType::Diffuse && !material.specular;
+}
+
+// Unshadowed contribution of a point on a light to a surface, in area measure
+inline float3 ReSTIRContribution(const thread ReSTIRSurface& s, uint32_t light, float2 u,
+                                 thread float3& direction, thread float& distance, thread LightSampleRecord& lsr,
+                                 
+                                 constant PackageEnv& packageEnv,
+                                 constant Primitive&  primitives)
+{
+    if (light >= primitives.lightCount) { return 0; }
+    
+    auto normal = UnpackUnitVector(s.normal);
+    auto origin = offset_ray(s.position, normal);
+    
+    primitives.squareList[primitives.lightList[light].pIndex].sample(u, origin, lsr);
+    
+    auto d = lsr.p - origin;
+    distance = length(d);
+    if (distance <= 0) { return 0; }
+    direction = d / distance;
+    
+    float3 nx, ny;
+    CoordinateSystem(normal, nx, ny);
+    float3x3 stw = { nx, ny, normal };
+    float3x3 wts = transpose(stw);
+    
+    auto wo = wts * (-UnpackUnitVector(s.incoming));
+    auto wi = wts * direction;
+    
+    float2 uu = 0.5; float bxPDF;
+    auto f = packageEnv.materials[s.material].F(wo, wi, s.uv, bxPDF, uu);
+    
+    auto cosOnLight = abs(dot(lsr.n, -direction));
+    auto Le = packageEnv.materials[lsr.material].textureInfo.albedo;
+    
+    return f * Le * cosOnLight / (distance * distance);
+}
+
+// Target function of the resampling, the luminance of the unshadowed contribution
+inline float ReSTIRTarget(const thread ReSTIRSurface& s, uint32_t light, float2 u,
+                          constant PackageEnv& packageEnv, constant Primitive& primitives)
+{
+    float3 direction; float distance; LightSampleRecord lsr;
+    auto c = ReSTIRContribution(s, light, u, direction, distance, lsr, packageEnv, primitives);
+    return dot(c, float3(0.2126, 0.7152, 0.0722));
+}
+
+// Combines the reservoirs of surfaces[0 .. count), the first being the pixel's own. The result is
+// normalised by the samples of the surfaces that could have produced it, which keeps the unshadowed
+// estimate unbiased when neighbours see different lights.
+inline ReSTIRReservoir ReSTIRCombine(const thread ReSTIRSurface* surfaces, const thread ReSTIRReservoir* reservoirs,
+                                     uint count, thread RandomSampler& rs,
+                                     
+                                     constant PackageEnv& packageEnv,
+                                     constant Primitive&  primitives)
+{
+    ReSTIRReservoir out; ReSTIRReset(out);
+    float target = 0;
+    
+    for (uint i = 0; i < count; ++i) {
+        thread auto& r = reservoirs[i];
+        auto p = ReSTIRTarget(surfaces[0], r.light, r.u, packageEnv, primitives);
+        if (ReSTIRUpdate(out, r.light, r.u, p * r.W * r.M, r.M, rs.random())) { target = p; }
+    }
+    
+    uint32_t Z = 0;
+    for (uint i = 0; i < count; ++i) {
+        auto p = i == 0 ? target : ReSTIRTarget(surfaces[i], out.light, out.u, packageEnv, primitives);
+        if (p > 0) { Z += reservoirs[i].M; }
+    }
+    
+    out.W = (target > 0 && Z > 0) ? out.wSum / (Z * target) : 0;
+    return out;
+}
+
+// Candidates from the light BVH resampled by their unshadowed contribution, the pick is shadow tested,
+// then merged with the reservoir the previous frame kept where this surface was seen
+kernel void
+kernelReSTIRInitial(texture2d<uint32_t, access::read>         inRNG [[texture(0)]],
+                    texture2d<uint32_t, access::write>       outRNG [[texture(1)]],
+                    
+                    uint2 thread_pos                  [[thread_position_in_grid]],
+                    
+                    constant Camera*                  camera [[buffer(0)]],
+                    constant Complex*                complex [[buffer(1)]],
+                    constant Camera*          cameraPrevious [[buffer(2)]],
+                    
+                    device ReSTIRSurface*           surfaces [[buffer(3)]],
+                    constant ReSTIRSurface* previousSurfaces [[buffer(4)]],
+                    constant ReSTIRReservoir*        history [[buffer(5)]],
+                    device ReSTIRReservoir*       reservoirs [[buffer(6)]],
+                    
+                    constant Primitive&           primitives [[buffer(7)]],
+                    constant PackageEnv&          packageEnv [[buffer(8)]])
+{
+    #ifndef DEVICE_SUPPORTS_NON_UNIFORM_TREADGROUPS
+    if (thread_pos.x >= inRNG.get_width() || thread_pos.y >= inRNG.get_height()) {
+        return;
+    }
+    #endif
+    
+    auto rng_cache = inRNG.read(thread_pos);
+    pcg32_t rng = toRNG(rng_cache);
+    
+    // Uncorrelated between pixels, the neighbours reuse each other's picks
+    RandomSampler rs { &rng };
+    
+    uint2 size = uint2(inRNG.get_width(), inRNG.get_height());
+    auto idx = thread_pos.y * size.x + thread_pos.x;
+    
+    auto jitter = rs.sample2D();
+    auto ray = castRay(camera, (thread_pos.x + jitter.x) / size.x, (thread_pos.y + jitter.y) / size.y, &rs);
+    
+    Scene scene { primitives };
+    HitRecord hitRecord;
+    
+    ReSTIRSurface s;
+    s.uv = 0; s.position = float3(0); s.normal = 0; s.depth = 0;
+    s.incoming = PackUnitVector(ray.direction);
+    s.material = UINT_MAX;
+    
+    if (scene.hit(ray, hitRecord, FLT_MAX)) {
+        s.uv = hitRecord.uv;
+        s.position = hitRecord.p;
+        s.normal = PackUnitVector(hitRecord.sn);
+        s.material = hitRecord.material;
+        s.depth = hitRecord.t;
+    }
+    surfaces[idx] = s;
+    
+    ReSTIRReservoir r; ReSTIRReset(r);
+    
+    if (!ReSTIRLit(s, packageEnv) || primitives.lightCount == 0) {
+        reservoirs[idx] = r;
+        outRNG.write(exRNG(rng), thread_pos);
+        return;
+    }
+    
+    float3 position = s.position;
+    auto normal = UnpackUnitVector(s.normal);
+    
+    float target = 0;
+    
+    for (int i = 0; i < RESTIR_CANDIDATES; ++i) {
+        
+        float lightPMF;
+        auto light = SampleLightTree(primitives.lightTree, position, normal, rs.random(), lightPMF);
+        auto u = rs.sample2D();
+        
+        if (light == UINT_MAX || lightPMF <= 0) { r.M += 1; continue; }
+        
+        float3 direction; float distance; LightSampleRecord lsr;
+        auto c = ReSTIRContribution(s, light, u, direction, distance, lsr, packageEnv, primitives);
+        auto p = dot(c, float3(0.2126, 0.7152, 0.0722));
+        
+        if (ReSTIRUpdate(r, light, u, p / (lightPMF * lsr.areaPDF), 1, rs.random())) { target = p; }
+    }
+    
+    r.W = target > 0 ? r.wSum / (r.M * target) : 0;
+    
+    if (r.W > 0) {
+        float3 direction; float distance; LightSampleRecord lsr;
+        ReSTIRContribution(s, r.light, r.u, direction, distance, lsr, packageEnv, primitives);
+        
+        auto Tr = Transmittance(offset_ray(position, normal), direction, distance, MediumType::_NIL_, rs, scene, packageEnv);
+        if (all(Tr <= 0)) { r.W = 0; }
+    }
+    
+    ReSTIRSurface neighbours[2] = { s, s };
+    ReSTIRReservoir candidates[2] = { r, r };
+    uint count = 1;
+    
+    // The history follows the surface through the previous camera
+    auto uv = CameraProject(cameraPrevious, position);
+    
+    if (all(uv >= 0) && all(uv < 1)) {
+        
+        auto previous = uint2(uv * float2(size));
+        auto pidx = previous.y * size.x + previous.x;
+        
+        ReSTIRSurface ps = previousSurfaces[pidx];
+        
+        if (ReSTIRSimilar(s, ps)) {
+            ReSTIRReservoir q = history[pidx];
+            q.M = min(q.M, complex->restirTemporalCap * RESTIR_CANDIDATES);
+            
+            neighbours[1] = ps; candidates[1] = q;
+            count = 2;
+        }
+    }
+    
+    reservoirs[idx] = count > 1 ? ReSTIRCombine(neighbours, candidates, count, rs, packageEnv, primitives) : r;
+    
+    outRNG.write(exRNG(rng), thread_pos);
+}
+
+// Reservoirs of similar surfaces around the pixel, merged into its own
+kernel void
+kernelReSTIRSpatial(texture2d<uint32_t, access::read>         inRNG [[texture(0)]],
+                    texture2d<uint32_t, access::write>       outRNG [[texture(1)]],
+                    
+                    uint2 thread_pos                  [[thread_position_in_grid]],
+                    
+                    constant ReSTIRSurface*         surfaces [[buffer(3)]],
+                    constant ReSTIRReservoir*  reservoirsIn [[buffer(5)]],
+                    device ReSTIRReservoir*   reservoirsOut [[buffer(6)]],
+                    
+                    constant Primitive&           primitives [[buffer(7)]],
+                    constant PackageEnv&          packageEnv [[buffer(8)]])
+{
+    #ifndef DEVICE_SUPPORTS_NON_UNIFORM_TREADGROUPS
+    if (thread_pos.x >= inRNG.get_width() || thread_pos.y >= inRNG.get_height()) {
+        return;
+    }
+    #endif
+    
+    uint2 size = uint2(inRNG.get_width(), inRNG.get_height());
+    auto idx = thread_pos.y * size.x + thread_pos.x;
+    
+    ReSTIRSurface s = surfaces[idx];
+    
+    if (!ReSTIRLit(s, packageEnv)) {
+        reservoirsOut[idx] = reservoirsIn[idx];
+        return;
+    }
+    
+    auto rng_cache = inRNG.read(thread_pos);
+    pcg32_t rng = toRNG(rng_cache);
+    RandomSampler rs { &rng };
+    
+    ReSTIRSurface neighbours[RESTIR_SPATIAL_NEIGHBOURS + 1];
+    ReSTIRReservoir candidates[RESTIR_SPATIAL_NEIGHBOURS + 1];
+    
+    neighbours[0] = s; candidates[0] = reservoirsIn[idx];
+    uint count = 1;
+    
+    for (int i = 0; i < RESTIR_SPATIAL_NEIGHBOURS; ++i) {
+        
+        auto u = rs.sample2D();
+        auto radius = RESTIR_SPATIAL_RADIUS * sqrt(u.x);
+        auto angle = 2 * M_PI_F * u.y;
+        
+        auto p = int2(thread_pos) + int2(radius * float2(cos(angle), sin(angle)));
+        if (any(p < 0) || any(p >= int2(size)) || all(uint2(p) == thread_pos)) { continue; }
+        
+        auto nidx = uint(p.y) * size.x + uint(p.x);
+        ReSTIRSurface ns = surfaces[nidx];
+        
+        if (!ReSTIRSimilar(s, ns) || !ReSTIRLit(ns, packageEnv)) { continue; }
+        
+        neighbours[count] = ns; candidates[count] = reservoirsIn[nidx];
+        count += 1;
+    }
+    
+    reservoirsOut[idx] = ReSTIRCombine(neighbours, candidates, count, rs, packageEnv, primitives);
+    
+    outRNG.write(exRNG(rng), thread_pos);
+}
+
+// Direct light of the camera hit from its reservoir, everything else from a path leaving it
+template <typename XSampler>
+Spectrum shadeReSTIR(const thread ReSTIRSurface& s, const thread ReSTIRReservoir& r,
+                     thread XSampler& xsampler, thread half4& zN,
+                     
+                     constant PackageEnv& packageEnv,
+                     constant PackagePBR& packagePBR,
+                     constant Primitive&  primitives)
+{
+    auto incoming = UnpackUnitVector(s.incoming);
+    
+    if (s.material == UINT_MAX) {
+        InfiniteLight env { packageEnv };
+        return env.Le(incoming);
+    }
+    
+    auto normal = UnpackUnitVector(s.normal);
+    
+    zN.r = s.depth / 1024;
+    zN.gba = half3(normal);
+    
+    constant auto& material = packageEnv.materials[s.material];
+    
+    if (material.type == MaterialType::Diffuse) {
+        return material.textureInfo.albedo * abs(dot(-incoming, normal));
+    }
+    
+    Scene scene { primitives };
+    Spectrum color = 0;
+    
+    float3 position = s.position;
+    auto lit = ReSTIRLit(s, packageEnv);
+    
+    if (lit && r.W > 0) {
+        float3 direction; float distance; LightSampleRecord lsr;
+        auto c = ReSTIRContribution(s, r.light, r.u, direction, distance, lsr, packageEnv, primitives);
+        
+        auto Tr = Transmittance(offset_ray(position, normal), direction, distance, MediumType::_NIL_, xsampler, scene, packageEnv);
+        color += Tr * c * r.W;
+    }
+    
+    float3 nx, ny;
+    CoordinateSystem(normal, nx, ny);
+    float3x3 stw = { nx, ny, normal };
+    float3x3 wts = transpose(stw);
+    
+    float3 wi; float bxPDF;
+    float3 wo = wts * (-incoming);
+    
+    auto uu = xsampler.sample2D();
+    auto attenuation = material.S_F(wo, wi, s.uv, uu, bxPDF);
+    if (bxPDF <= 0) { return color; }
+    
+    auto origin = wi.z < 0 ? offset_ray(position, -normal) : offset_ray(position, normal);
+    auto ray = Ray(origin, stw * wi);
+    
+    // Lights reached from a lit surface are already in its reservoir
+    if (lit) {
+        HitRecord hitRecord;
+        if (scene.hit(ray, hitRecord, FLT_MAX) && packageEnv.materials[hitRecord.material].type == MaterialType::Diffuse
+                                               && hitRecord.light < primitives.lightCount) {
+            return color;
+        }
+    }
+    
+    return color + attenuation / bxPDF * traceMIS(7, ray, xsampler, packageEnv, packagePBR, primitives);
+}
+
+kernel void
+kernelReSTIRShade(texture2d<float, access::read>        inTexture [[texture(0)]],
+                  texture2d<float, access::write>      outTexture [[texture(1)]],
+                  texture2d<float, access::write>      sourceSVGF [[texture(2)]],
+                  
+                  texture2d<half, access::write>          zNormal [[texture(3)]],
+                  texture2d<half, access::write>         motion2D [[texture(4)]],
+                  
+                  texture2d<uint32_t, access::read>         inRNG [[texture(5)]],
+                  texture2d<uint32_t, access::write>       outRNG [[texture(6)]],
+                  
+                  uint2 thread_pos                  [[thread_position_in_grid]],
+                  
+                  constant Camera*                camera [[buffer(0)]],
+                  constant Complex*              complex [[buffer(1)]],
+                  constant Camera*        cameraPrevious [[buffer(2)]],
+                  constant ReSTIRSurface*       surfaces [[buffer(3)]],
+                  constant ReSTIRReservoir*   reservoirs [[buffer(6)]],
+                  
+                  constant Primitive&         primitives [[buffer(7)]],
+                  constant PackageEnv&        packageEnv [[buffer(8)]],
+                  constant PackagePBR*        packagePBR [[buffer(9)]])
+{
+    #ifndef DEVICE_SUPPORTS_NON_UNIFORM_TREADGROUPS
+    if (thread_pos.x >= inRNG.get_width() || thread_pos.y >= inRNG.get_height()) {
+        return;
+    }
+    #endif
+    
+    auto rng_cache = inRNG.read(thread_pos);
+    pcg32_t rng = toRNG(rng_cache);
+    
+    auto frame = complex->frame_count;
+    auto idx = thread_pos.y * inRNG.get_width() + thread_pos.x;
+    
+    ReSTIRSurface s = surfaces[idx];
+    ReSTIRReservoir r = reservoirs[idx];
+    
+    half4 zN = 0;
+    float3 color;
+    
+    switch (complex->sampler) {
+        case SamplerType::Halton: {
+            HaltonSampler hs { &rng, packageEnv.haltonPermutations, thread_pos, frame };
+            color = shadeReSTIR(s, r, hs, zN, packageEnv, packagePBR[1], primitives);
+            break;
+        }
+        case SamplerType::BlueNoise: {
+            BlueNoiseSampler bs { &rng, packageEnv.blueNoiseTiles, thread_pos, frame };
+            color = shadeReSTIR(s, r, bs, zN, packageEnv, packagePBR[1], primitives);
+            break;
+        }
+        case SamplerType::Random: {
+            RandomSampler rs { &rng };
+            color = shadeReSTIR(s, r, rs, zN, packageEnv, packagePBR[1], primitives);
+            break;
+        }
+        default: {
+            pbrt::SobolSampler ss { &rng, thread_pos, frame };
+            color = shadeReSTIR(s, r, ss, zN, packageEnv, packagePBR[1], primitives);
+        }
+    }
+    
+    if (any(isinf(color) || isnan(color))) { color = float3(0); }
+    
+    float3 cached = inTexture.read(thread_pos).rgb;
+    float3 result = (cached * frame + color) / (frame + 1);
+    
+    outTexture.write(float4(result, 1.0), thread_pos);
+    sourceSVGF.write(float4(result, 1.0), thread_pos);
+    
+    zNormal.write(zN, thread_pos);
+    
+    auto size = float2(inRNG.get_width(), inRNG.get_height());
+    auto motion = s.material != UINT_MAX ? CameraMotion(camera, cameraPrevious, s.position, size) : float2(0);
+    motion2D.write(half4(half2(motion), 0, 0), thread_pos);
+    
+    outRNG.write(exRNG(rng), thread_pos);
+}
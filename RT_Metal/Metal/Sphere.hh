@@ -54,6 +54,7 @@ struct Sphere {
             hitRecord.checkFace(ray);
             sphereUV(hitRecord.gn, hitRecord.uv);
             hitRecord.material = material;
+            hitRecord.light = UINT_MAX;
             
             range_t.y = hitRecord.t;
             
@@ -68,6 +69,7 @@ struct Sphere {
             hitRecord.checkFace(ray);
             sphereUV(hitRecord.gn, hitRecord.uv);
             hitRecord.material = material;
+            hitRecord.light = UINT_MAX;
             
             range_t.y = hitRecord.t;
             
@@ -24,15 +24,17 @@ struct Square {
     float4x4 inverse_matrix;
     
     uint material;
+    uint light; // index in the light list, UINT_MAX if not emissive
     AABB boundingBOX;
     
 #ifdef __METAL_VERSION__
     
+    // One face; sample() always picks the face towards the receiver
     float area() constant {
         auto i = range_i[1] - range_i[0];
         auto j = range_j[1] - range_j[0];
         
-        return 2 * i * j;
+        return i * j;
     }
     
     float aeraPDF() constant { return 1 / area(); }
@@ -57,6 +59,13 @@ struct Square {
         lsr.material = material;
     }
     
+    // Emission leaves from either face, side picks one by sign
+    void sampleEmission(const thread float2& u, float side, thread LightSampleRecord& lsr) constant {
+        float3 pos = 0;
+        pos[axis_k] = value_k + copysign(1.0, side);
+        sample(u, pos, lsr);
+    }
+    
     bool hit_test(const thread Ray& ray, thread float2& range_t, thread HitRecord& hitRecord) constant {
         
 //        if( !boundingBOX.hit_t(ray, range_t, hitRecord.t) ) { return false; }
@@ -108,6 +117,7 @@ struct Square {
         range_t.y = t;
         hitRecord.PDF = aeraPDF();
         hitRecord.material = material;
+        hitRecord.light = light;
 
         return true;
     }
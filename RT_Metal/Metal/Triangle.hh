@@ -80,6 +80,7 @@ struct Triangle {
         
         hitRecord.checkFace(ray);
         hitRecord.material = 19;
+        hitRecord.light = UINT_MAX;
         
         return true;
     }
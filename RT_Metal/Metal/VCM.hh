@@ -0,0 +1,58 @@
+#ifndef VCM_h
+#define VCM_h
+
+#include "Common.hh"
+#include "Packing.hh"
+
+// Longest path, in edges from the camera to the light, any strategy may build
+#define VCM_MAX_PATH 8
+
+// Merge radius of iteration i is photonInitialRadius * i^((alpha-1)/2)
+#define VCM_ALPHA 0.75
+
+// Light vertex stored for connections and merging, beside its PhotonPacked record which holds
+// the position, the throughput, the incoming direction and the shading normal
+struct VCMVertex {
+    float2 uv;
+    uint32_t material;
+    uint32_t pathLength; // edges from the light
+
+    // Partial MIS weights of Georgiev et al., Light Transport Simulation with Vertex Connection and Merging
+    float dVCM, dVC, dVM;
+};
+
+#ifdef __METAL_VERSION__
+
+// Power heuristic
+inline float VCMMis(float x) {
+    return x * x;
+}
+
+struct VCMConstants {
+    bool merging; // without it, bidirectional path tracing
+    float radius;
+    float misVM;  // weight of merging against a connection
+    float misVC;  // weight of a connection against merging
+    float normVM; // density estimation over every light path of the iteration
+
+    VCMConstants(float initialRadius, uint32_t iteration, uint32_t lightPathCount, bool merging): merging(merging) {
+        radius = initialRadius * pow(float(iteration + 1), 0.5 * (VCM_ALPHA - 1));
+
+        float eta = M_PI_F * radius * radius * lightPathCount;
+        misVM = merging ? VCMMis(eta) : 0;
+        misVC = VCMMis(1.0 / eta);
+        normVM = 1.0 / eta;
+    }
+};
+
+// Sub-path state, shared by the light and the camera side
+struct VCMPath {
+    float3 throughput;
+    uint32_t pathLength;
+
+    float dVCM, dVC, dVM;
+};
+
+#endif
+
+#endif /* VCM_h */
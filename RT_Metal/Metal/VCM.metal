@@ -0,0 +1,502 @@
+#include "Render.hh"
+#include "Photon.hh"
+#include "VCM.hh"
+
+// Samples a direction at a surface and updates the partial MIS weights, false once the path ends
+inline bool VCMScatter(thread VCMPath& path, thread Ray& ray, const thread HitRecord& hitRecord,
+                       constant Material& material, float2 uu, const thread VCMConstants& vcm)
+{
+    float3 nx, ny;
+    CoordinateSystem(hitRecord.sn, nx, ny);
+    float3x3 stw = { nx, ny, hitRecord.sn };
+    float3x3 wts = transpose(stw);
+
+    float3 wi; float bxPDF = 0;
+    float3 wo = wts * (-ray.direction);
+
+    auto attenuation = material.S_F(wo, wi, hitRecord.uv, uu, bxPDF);
+    if (bxPDF <= 0 || all(attenuation <= 0)) { return false; }
+
+    float cosOut = abs(wi.z);
+
+    if (material.specular) {
+        // Only the path can sample a delta vertex, reverse and forward densities are equal
+        path.dVCM = 0;
+        path.dVC *= VCMMis(cosOut);
+        path.dVM *= VCMMis(cosOut);
+    } else {
+        float revPDF = material.PDF(wi, wo, uu);
+
+        path.dVC = VCMMis(cosOut / bxPDF) * (path.dVC * VCMMis(revPDF) + path.dVCM + vcm.misVM);
+        path.dVM = VCMMis(cosOut / bxPDF) * (path.dVM * VCMMis(revPDF) + path.dVCM * vcm.misVC + 1);
+        path.dVCM = VCMMis(1.0 / bxPDF);
+    }
+
+    path.throughput *= attenuation / bxPDF;
+
+    if (wi.z < 0) { // Transmission
+        ray.update(offset_ray(hitRecord.p, -hitRecord.sn), stw * wi);
+    } else {
+        ray.update(offset_ray(hitRecord.p, hitRecord.sn), stw * wi);
+    }
+    return true;
+}
+
+// Distance from the hit point to the ray origin, then the cosine there, enter the weights
+inline void VCMArrive(thread VCMPath& path, const thread Ray& ray, const thread HitRecord& hitRecord, bool scaleDistance)
+{
+    float cosIn = abs(dot(hitRecord.sn, -ray.direction));
+
+    if (scaleDistance) {
+        path.dVCM *= VCMMis(distance_squared(hitRecord.p, ray.origin));
+    }
+    path.dVCM /= VCMMis(cosIn);
+    path.dVC  /= VCMMis(cosIn);
+    path.dVM  /= VCMMis(cosIn);
+}
+
+// Both ends are pushed off their surfaces towards each other
+inline bool VCMVisible(thread Scene& scene, float3 from, float3 fromNormal, float3 to, float3 toNormal)
+{
+    auto dir = to - from;
+
+    auto origin = offset_ray(from, fromNormal * copysign(1.0, dot(dir, fromNormal)));
+    auto target = offset_ray(to, toNormal * copysign(1.0, dot(-dir, toNormal)));
+
+    auto distance = length(target - origin);
+    if (distance <= 0) { return false; }
+
+    HitRecord hitRecord;
+    return !scene.hit(Ray(origin, target - origin), hitRecord, distance, true);
+}
+
+// One light path per pixel. Every vertex on a non-specular surface is kept for the connections
+// of the camera path of the same pixel and for merging with every camera path.
+kernel void
+kernelVCMLightPaths(texture2d<uint32_t, access::read>       inRNG [[texture(0)]],
+                    texture2d<uint32_t, access::write>     outRNG [[texture(1)]],
+
+                    uint2 thread_pos       [[thread_position_in_grid]],
+                    uint2 grid_size               [[threads_per_grid]],
+
+                    constant Complex*            complex [[buffer(1)]],
+
+                    device PhotonPacked*    lightRecords [[buffer(2)]],
+                    device atomic_uint*     photonCounter [[buffer(3)]],
+                    constant uint&         photonCapacity [[buffer(4)]],
+                    device VCMVertex*      lightVertices [[buffer(5)]],
+                    device uint2*              pathRange [[buffer(6)]],
+
+                    constant Primitive&   primitives [[buffer(7)]],
+                    constant PackageEnv&  packageEnv [[buffer(8)]])
+{
+    #ifndef DEVICE_SUPPORTS_NON_UNIFORM_TREADGROUPS
+    if (thread_pos.x >= inRNG.get_width() || thread_pos.y >= inRNG.get_height()) {
+        return;
+    }
+    #endif
+
+    auto rng_cache = inRNG.read(thread_pos);
+    pcg32_t rng = toRNG(rng_cache);
+    RandomSampler rs { &rng };
+
+    size_t thread_idx = thread_pos.y * grid_size.x + thread_pos.x;
+    pathRange[thread_idx] = 0;
+
+    VCMConstants vcm { complex->photonInitialRadius, complex->frame_count, grid_size.x * grid_size.y,
+                       complex->integrator != Integrator::BDPT };
+    Scene scene { primitives };
+
+    float lightPMF;
+    auto lightIndex = SampleLight(primitives, rs.sample1D(), lightPMF);
+    if (lightPMF == 0) { outRNG.write(exRNG(rng), thread_pos); return; }
+    constant auto& light = primitives.lightList[lightIndex];
+
+    LightSampleRecord lsr;
+    float2 uu = rs.sample2D();
+    auto side = rs.random() - 0.5;
+    primitives.squareList[light.pIndex].sampleEmission(uu, side, lsr);
+
+    float3 nx, ny;
+    CoordinateSystem(lsr.n, nx, ny);
+    float3x3 stw = { nx, ny, lsr.n };
+
+    auto local = CosineSampleHemisphere(rs.sample2D());
+    float cosLight = local.z;
+
+    // Position by area, a face, then a cosine weighted direction
+    float directPdfA = lightPMF * lsr.areaPDF;
+    float emissionPdfW = directPdfA * 0.5 * cosLight / M_PI_F;
+
+    if (emissionPdfW > 0) {
+
+        // Emitted radiance is Le * cos, as the path tracer sees the lights
+        auto le = packageEnv.materials[lsr.material].textureInfo.albedo;
+
+        VCMPath path;
+        path.throughput = le * cosLight * cosLight / emissionPdfW;
+        path.pathLength = 1;
+        path.dVCM = VCMMis(directPdfA / emissionPdfW);
+        path.dVC = VCMMis(cosLight / emissionPdfW);
+        path.dVM = path.dVC * vcm.misVC;
+
+        PhotonPacked records[VCM_MAX_PATH];
+        VCMVertex vertices[VCM_MAX_PATH];
+        uint count = 0;
+
+        Ray ray = Ray(lsr.p, stw * local);
+
+        while (true) {
+
+            HitRecord hitRecord;
+            if (!scene.hit(ray, hitRecord, FLT_MAX)) { break; }
+
+            constant auto& material = packageEnv.materials[hitRecord.material];
+            if (material.type == MaterialType::Diffuse) { break; } // lights don't reflect
+
+            VCMArrive(path, ray, hitRecord, true);
+
+            if (!material.specular) {
+                records[count] = { hitRecord.p, PackSharedExponent(path.throughput),
+                                   PackUnitVector(ray.direction), PackUnitVector(hitRecord.sn) };
+                vertices[count] = { hitRecord.uv, hitRecord.material, path.pathLength,
+                                    path.dVCM, path.dVC, path.dVM };
+                count += 1;
+            }
+
+            // The camera needs at least one more edge to reach this path
+            if (path.pathLength + 2 > VCM_MAX_PATH) { break; }
+
+            if (!VCMScatter(path, ray, hitRecord, material, rs.sample2D(), vcm)) { break; }
+            path.pathLength += 1;
+        }
+
+        if (count > 0) {
+            // Vertices past the capacity are dropped, the host grows the buffers for the next frame
+            auto start = atomic_fetch_add_explicit(photonCounter + PHOTON_COUNT_DEPOSITS, count, memory_order_relaxed);
+
+            if (start < photonCapacity) {
+                count = min(count, photonCapacity - start);
+                for (uint i = 0; i < count; ++i) {
+                    lightRecords[start + i] = records[i];
+                    lightVertices[start + i] = vertices[i];
+                }
+                pathRange[thread_idx] = uint2(start, count);
+            }
+        }
+    }
+
+    outRNG.write(exRNG(rng), thread_pos);
+}
+
+// Camera path of one pixel, at every non-specular vertex: connection to a light, connections
+// to the light path of the pixel and merging with the light vertices of all pixels
+template <typename XSampler>
+Spectrum traceVCM(uint2 pixel, float2 size, uint pathIndex,
+                  constant Camera* camera, constant Complex* complex, thread XSampler& xsampler,
+                  thread half4& zN, thread float3& position,
+
+                  constant PhotonPacked*    lightRecords,
+                  constant VCMVertex*      lightVertices,
+                  constant uint2*              pathRange,
+                  constant uint32_t*           cellStart,
+                  constant PhotonCellEntry*   cellEntries,
+
+                  constant PackageEnv& packageEnv,
+                  constant Primitive&  primitives)
+{
+    VCMConstants vcm { complex->photonInitialRadius, complex->frame_count, uint(size.x * size.y),
+                       complex->integrator != Integrator::BDPT };
+    Scene scene { primitives };
+    InfiniteLight env { packageEnv };
+
+    auto jitter = xsampler.sample2D();
+    auto ray = castRay(camera, (pixel.x + jitter.x) / size.x, (pixel.y + jitter.y) / size.y, &xsampler);
+
+    // Light tracing to the camera is left out, so the camera end has no partial weight
+    VCMPath path;
+    path.throughput = 1;
+    path.pathLength = 1;
+    path.dVCM = 0; path.dVC = 0; path.dVM = 0;
+
+    Spectrum color = 0;
+    const auto range = pathRange[pathIndex];
+
+    while (true) {
+
+        HitRecord hitRecord;
+
+        // The environment is only found by the camera paths, it takes no part in the weights
+        if (!scene.hit(ray, hitRecord, FLT_MAX)) {
+            color += path.throughput * env.Le(ray.direction);
+            break;
+        }
+
+        if (path.pathLength == 1) {
+            zN.r = hitRecord.t / 1024;
+            zN.gba = half3(hitRecord.sn);
+            position = hitRecord.p;
+        }
+
+        constant auto& material = packageEnv.materials[hitRecord.material];
+
+        VCMArrive(path, ray, hitRecord, true);
+
+        if (material.type == MaterialType::Diffuse) {
+
+            float cosOnLight = abs(dot(-ray.direction, hitRecord.gn));
+            auto radiance = material.textureInfo.albedo * cosOnLight;
+
+            if (path.pathLength > 1 && hitRecord.light < primitives.lightCount) {
+
+                float directPdfA = primitives.lightList[hitRecord.light].pmf * hitRecord.PDF;
+                float emissionPdfW = directPdfA * 0.5 * cosOnLight / M_PI_F;
+
+                float wCamera = VCMMis(directPdfA) * path.dVCM + VCMMis(emissionPdfW) * path.dVC;
+                radiance /= 1 + wCamera;
+            }
+
+            color += path.throughput * radiance;
+            break;
+        }
+
+        if (path.pathLength >= VCM_MAX_PATH) { break; }
+
+        float2 uu = xsampler.sample2D();
+
+        if (!material.specular) {
+
+            float3 nx, ny;
+            CoordinateSystem(hitRecord.sn, nx, ny);
+            float3x3 stw = { nx, ny, hitRecord.sn };
+            float3x3 wts = transpose(stw);
+
+            float3 wo = wts * (-ray.direction);
+
+            // Connection to a light, the next event estimation of the path tracer with VCM weights
+            if (primitives.lightCount > 0) {
+
+                float lightPMF;
+                auto lightIndex = SampleLight(primitives, xsampler.sample1D(), lightPMF);
+                constant auto& light = primitives.lightList[lightIndex];
+
+                LightSampleRecord lsr;
+                primitives.squareList[light.pIndex].sample(xsampler.sample2D(), hitRecord.p, lsr);
+
+                auto _dir = lsr.p - hitRecord.p;
+                auto _dis = length(_dir);
+                auto _nor = _dir / _dis;
+
+                float cosAtLight = abs(dot(lsr.n, -_nor));
+
+                float3 wi = wts * _nor; float bxPDF = 0;
+                auto F = material.F(wo, wi, hitRecord.uv, bxPDF, uu);
+
+                if (cosAtLight > 0 && _dis > 0 && any(F > 0) && VCMVisible(scene, hitRecord.p, hitRecord.sn, lsr.p, lsr.n)) {
+
+                    float revPDF = material.PDF(wi, wo, uu);
+
+                    float directPdfW = lsr.areaPDF * _dis * _dis / cosAtLight;
+                    float emissionPdfW = lsr.areaPDF * 0.5 * cosAtLight / M_PI_F;
+
+                    float wLight = VCMMis(bxPDF / (lightPMF * directPdfW));
+                    float wCamera = VCMMis(emissionPdfW * abs(wi.z) / (directPdfW * cosAtLight))
+                                  * (vcm.misVM + path.dVCM + path.dVC * VCMMis(revPDF));
+
+                    auto Li = packageEnv.materials[lsr.material].textureInfo.albedo * cosAtLight;
+                    color += path.throughput * Li * F / (lightPMF * directPdfW * (wLight + 1 + wCamera));
+                }
+            }
+
+            // Connections to the light path of this pixel
+            for (uint i = range.x; i < range.x + range.y; ++i) {
+
+                const auto record = lightRecords[i];
+                const auto vertex = lightVertices[i];
+
+                if (vertex.pathLength + 1 + path.pathLength > VCM_MAX_PATH) { continue; }
+
+                float3 lightPosition = record.position;
+                auto _dir = lightPosition - hitRecord.p;
+                float dist2 = length_squared(_dir);
+                if (dist2 <= 0) { continue; }
+                auto _nor = _dir * rsqrt(dist2);
+
+                float3 cameraWi = wts * _nor; float cameraPDF = 0;
+                auto cameraF = material.F(wo, cameraWi, hitRecord.uv, cameraPDF, uu);
+                if (!any(cameraF > 0)) { continue; }
+
+                auto lightNormal = UnpackUnitVector(record.normal);
+                float3 lx, ly;
+                CoordinateSystem(lightNormal, lx, ly);
+                float3x3 lstw = { lx, ly, lightNormal };
+                float3x3 lwts = transpose(lstw);
+
+                float3 lightWo = lwts * (-UnpackUnitVector(record.direction));
+                float3 lightWi = lwts * (-_nor);
+
+                constant auto& lightMaterial = packageEnv.materials[vertex.material];
+                float lightPDF = 0;
+                auto lightF = lightMaterial.F(lightWo, lightWi, vertex.uv, lightPDF, uu);
+                if (!any(lightF > 0)) { continue; }
+
+                float cameraRevPDF = material.PDF(cameraWi, wo, uu);
+                float lightRevPDF = lightMaterial.PDF(lightWi, lightWo, uu);
+
+                float cameraPdfA = cameraPDF * abs(lightWi.z) / dist2;
+                float lightPdfA = lightPDF * abs(cameraWi.z) / dist2;
+
+                float wLight = VCMMis(cameraPdfA) * (vcm.misVM + vertex.dVCM + vertex.dVC * VCMMis(lightRevPDF));
+                float wCamera = VCMMis(lightPdfA) * (vcm.misVM + path.dVCM + path.dVC * VCMMis(cameraRevPDF));
+
+                if (!VCMVisible(scene, hitRecord.p, hitRecord.sn, lightPosition, lightNormal)) { continue; }
+
+                auto contribution = cameraF * lightF * UnpackSharedExponent(record.flux) / dist2;
+                color += path.throughput * contribution / (wLight + 1 + wCamera);
+            }
+
+            // Merging with the light vertices of every pixel through the photon hash grid
+            if (vcm.merging) {
+                float3 merged = 0;
+                float radius2 = vcm.radius * vcm.radius;
+
+                float3 BBoxMin = complex->photonBox.mini;
+                float HashScale = complex->photonHashScale;
+
+                uint3 RangeMin = uint3(max((hitRecord.p - vcm.radius - BBoxMin) * HashScale, 0.0));
+                uint3 RangeMax = uint3(max((hitRecord.p + vcm.radius - BBoxMin) * HashScale, 0.0));
+
+                for (uint iz = RangeMin.z; iz <= RangeMax.z; ++iz) {
+                    for (uint iy = RangeMin.y; iy <= RangeMax.y; ++iy) {
+                        for (uint ix = RangeMin.x; ix <= RangeMax.x; ++ix) {
+
+                            uint64_t key = PhotonCellKey(ix, iy, iz);
+                            uint hashed = PhotonCellHash(key);
+
+                            for (uint i = cellStart[hashed]; i < cellStart[hashed + 1]; ++i) {
+
+                                if (cellEntries[i].key != key) { continue; }
+                                uint index = cellEntries[i].index;
+
+                                float3 lightPosition = lightRecords[index].position;
+                                if (distance_squared(lightPosition, hitRecord.p) >= radius2) { continue; }
+
+                                const auto vertex = lightVertices[index];
+                                if (vertex.pathLength + path.pathLength > VCM_MAX_PATH) { continue; }
+
+                                float3 cameraWi = wts * (-UnpackUnitVector(lightRecords[index].direction));
+                                float cameraPDF = 0;
+                                auto cameraF = material.F(wo, cameraWi, hitRecord.uv, cameraPDF, uu);
+                                if (!any(cameraF > 0) || cameraWi.z == 0) { continue; }
+
+                                float cameraRevPDF = material.PDF(cameraWi, wo, uu);
+
+                                float wLight = vertex.dVCM * vcm.misVC + vertex.dVM * VCMMis(cameraPDF);
+                                float wCamera = path.dVCM * vcm.misVC + path.dVM * VCMMis(cameraRevPDF);
+
+                                // The density estimate takes the BXDF without its cosine
+                                merged += cameraF / abs(cameraWi.z) * UnpackSharedExponent(lightRecords[index].flux)
+                                        / (wLight + 1 + wCamera);
+                            }
+                        }
+                    }
+                }
+
+                color += path.throughput * merged * vcm.normVM;
+            }
+        }
+
+        if (!VCMScatter(path, ray, hitRecord, material, uu, vcm)) { break; }
+        path.pathLength += 1;
+    }
+
+    return color;
+}
+
+kernel void
+kernelVCMCameraPaths(texture2d<float, access::read>        inTexture [[texture(0)]],
+                     texture2d<float, access::write>      outTexture [[texture(1)]],
+                     texture2d<float, access::write>      sourceSVGF [[texture(2)]],
+
+                     texture2d<half, access::write>          zNormal [[texture(3)]],
+                     texture2d<half, access::write>         motion2D [[texture(4)]],
+
+                     texture2d<uint32_t, access::read>         inRNG [[texture(5)]],
+                     texture2d<uint32_t, access::write>       outRNG [[texture(6)]],
+
+                     uint2 thread_pos                  [[thread_position_in_grid]],
+                     uint2 grid_size                   [[threads_per_grid]],
+
+                     constant Camera*                camera [[buffer(0)]],
+                     constant Complex*              complex [[buffer(1)]],
+
+                     constant PhotonPacked*    lightRecords [[buffer(2)]],
+                     constant VCMVertex*      lightVertices [[buffer(3)]],
+                     constant uint2*              pathRange [[buffer(4)]],
+                     constant uint32_t*           cellStart [[buffer(5)]],
+                     constant PhotonCellEntry*  cellEntries [[buffer(6)]],
+
+                     constant Primitive&         primitives [[buffer(7)]],
+                     constant PackageEnv&        packageEnv [[buffer(8)]],
+
+                     constant Camera*        cameraPrevious [[buffer(11)]])
+{
+    #ifndef DEVICE_SUPPORTS_NON_UNIFORM_TREADGROUPS
+    if (thread_pos.x >= inRNG.get_width() || thread_pos.y >= inRNG.get_height()) {
+        return;
+    }
+    #endif
+
+    auto rng_cache = inRNG.read(thread_pos);
+    pcg32_t rng = toRNG(rng_cache);
+
+    auto frame = complex->frame_count;
+    auto idx = thread_pos.y * grid_size.x + thread_pos.x;
+
+    float2 size = float2(outTexture.get_width(), outTexture.get_height());
+
+    half4 zN = 0;
+    float3 position;
+    float3 color;
+
+    switch (complex->sampler) {
+        case SamplerType::Halton: {
+            HaltonSampler hs { &rng, packageEnv.haltonPermutations, thread_pos, frame };
+            color = traceVCM(thread_pos, size, idx, camera, complex, hs, zN, position,
+                             lightRecords, lightVertices, pathRange, cellStart, cellEntries, packageEnv, primitives);
+            break;
+        }
+        case SamplerType::BlueNoise: {
+            BlueNoiseSampler bs { &rng, packageEnv.blueNoiseTiles, thread_pos, frame };
+            color = traceVCM(thread_pos, size, idx, camera, complex, bs, zN, position,
+                             lightRecords, lightVertices, pathRange, cellStart, cellEntries, packageEnv, primitives);
+            break;
+        }
+        case SamplerType::Random: {
+            RandomSampler rs { &rng };
+            color = traceVCM(thread_pos, size, idx, camera, complex, rs, zN, position,
+                             lightRecords, lightVertices, pathRange, cellStart, cellEntries, packageEnv, primitives);
+            break;
+        }
+        default: {
+            pbrt::SobolSampler ss { &rng, thread_pos, frame };
+            color = traceVCM(thread_pos, size, idx, camera, complex, ss, zN, position,
+                             lightRecords, lightVertices, pathRange, cellStart, cellEntries, packageEnv, primitives);
+        }
+    }
+
+    if (any(isinf(color) || isnan(color))) { color = float3(0); }
+
+    float3 cached = inTexture.read(thread_pos).rgb;
+    float3 result = (cached * frame + color) / (frame + 1);
+
+    outTexture.write(float4(result, 1.0), thread_pos);
+    sourceSVGF.write(float4(result, 1.0), thread_pos);
+
+    zNormal.write(zN, thread_pos);
+
+    auto motion = zN.r > 0 ? CameraMotion(camera, cameraPrevious, position, size) : float2(0);
+    motion2D.write(half4(half2(motion), 0, 0), thread_pos);
+
+    outRNG.write(exRNG(rng), thread_pos);
+}
@@ -10,8 +10,18 @@
 
 #include "Medium.hh"
 #include "Tracer.hh"
+#include "VolumeCache.hh"
 
 #include "Photon.hh"
+#include "PhotonGrid.hh"
+#include "PhotonMap.hh"
+#include "VCM.hh"
+#include "GuideTree.hh"
+#include "ReSTIR.hh"
+#include "PrimaryCache.hh"
+#include "SVGF.hh"
+#include "HaltonSampler.hh"
+#include "BlueNoiseSampler.hh"
 
 typedef struct
 {
@@ -34,7 +44,15 @@ const VertexWithUV canvas[] =
 uint _width = 1920;
 uint _height = 1080;
 
-uint32_t photonHashN = PHOTON_HASHN;
+// What the integrators render into at a lower resolution while the camera moves, exchanged
+// with the full resolution targets for the frame
+struct PreviewTargets {
+    uint width, height;
+    id<MTLTexture> a, b, source, zNormal, motion, rng;
+};
+
+// Photon paths per row of a pass
+const uint32_t photonPassWidth = 512;
 
 // The main class performing the rendering.
 @implementation AAPLRenderer
@@ -42,6 +60,25 @@ uint32_t photonHashN = PHOTON_HASHN;
     MTKView* _view;
     BOOL _dragging;
     
+    // Moving frames render 1/4 or 1/16 of the pixels, the finest the measured frame times say
+    // fits in PreviewFrameTime, and are upsampled for display
+    PreviewTargets _preview[2];
+    id<MTLTexture> _previewTexture;
+    id<MTLComputePipelineState> _pipelineStatePreviewUpsample;
+    
+    uint32_t _previewScale;
+    BOOL _previewShown;
+    double _previewFrameTime;
+    double _previewTime[3];   // seconds of a moving frame at the scales 1, 2 and 4, smoothed
+    double _previewPixels[3]; // pixels of those frames
+    double _previewStart;
+    uint32_t _restirScale;
+    
+    double _benchmarkSeconds;
+    double _benchmarkStart;
+    BOOL _benchmarkDone;
+    id<MTLBuffer> _benchmarkBuffer;
+    
     id<MTLDevice> _device;
     id<MTLCommandQueue> _commandQueue;
     
@@ -58,12 +95,26 @@ uint32_t photonHashN = PHOTON_HASHN;
     id<MTLBuffer> _cube_list_buffer;
     
     id<MTLBuffer> _bvh_buffer;
+    id<MTLBuffer> _sceneBoxBuffer;
     id<MTLBuffer> _idx_buffer;
     id<MTLBuffer> _tri_buffer;
     
+    id<MTLBuffer> _light_list_buffer;
+    id<MTLBuffer> _alias_table_buffer;
+    id<MTLBuffer> _light_tree_buffer;
+    
+    id<MTLBuffer> _env_distribution_buffer;
+    id<MTLBuffer> _env_data_buffer;
+    
+    id<MTLBuffer> _majorantGridBuffer;
+    id<MTLBuffer> _densityBrickBuffer;
+    
     id<MTLBuffer> _densityInfoBuffer;
     id<MTLBuffer> _densityDataBuffer;
     
+    id<MTLBuffer> _haltonPermutationBuffer;
+    id<MTLBuffer> _blueNoiseTileBuffer;
+    
     id<MTLHeap> _heap;
    
     Camera _camera;
@@ -79,32 +130,79 @@ uint32_t photonHashN = PHOTON_HASHN;
     float launchTime;
     
     id<MTLComputePipelineState> _pipelineStatePathTracing;
+    
+    // First hits of the camera rays for every jitter pattern, refilled after pin or drag reset the frames
+    id<MTLBuffer> _primaryCacheBuffer;
     id<MTLRenderPipelineState> _pipelineStatePostprocessing;
     
-        id<MTLBuffer> _cameraRecordBuffer;
+        id<MTLBuffer> _cameraGatherBuffer;
+        id<MTLBuffer> _cameraShadeBuffer;
+        id<MTLBuffer> _cameraDirectBuffer;
         id<MTLBuffer> _cameraBoundsBuffer;
         id<MTLBuffer> _aremacBoundsBuffer;
         
         id<MTLBuffer> _photonRecordBuffer;
-        id<MTLBuffer> _photonHashedBuffer;
+        id<MTLBuffer> _photonCounterBuffer;
+        id<MTLBuffer> _photonCellStartBuffer;
+        id<MTLBuffer> _photonEntryBuffer;
      
-        id<MTLTexture>              _texturePhotonMark;
-        id<MTLTexture>              _texturePhotonCount;
-        MTLRenderPassDescriptor*    _renderPhotonCountPassDescriptor;
-        id<MTLRenderPipelineState>  _renderPhotonCountPipelineState;
-        id<MTLRenderPipelineState>  _renderPhotonScatePipelineState;
+        uint32_t _photonBudget;
+        uint32_t _photonPasses;
+        uint32_t _photonCapacity;
+        uint32_t _photonDeposits;
+        
+        id<MTLBuffer> _photonChainBuffer;
+        id<MTLBuffer> _photonChainStateBuffer;
+        id<MTLBuffer> _photonVisibilityBuffer;
+        uint64_t _photonUniformTotal;
+        uint64_t _photonUniformVisible;
+        
+        PhotonGrid _photonGrid;
+        PhotonMap _photonMap;
+        id<MTLBuffer> _photonTreeBuffer;
+        double _photonGridTime;
+        uint64_t _photonGridCount;
+        
+        double _refineTime;
+        double _refineBytes;
         
         id<MTLComputePipelineState> _pipelineStateCameraRecording;
         id<MTLComputePipelineState> _pipelineStateCameraReducing;
     
         id<MTLComputePipelineState> _pipelineStatePhotonParams;
         id<MTLComputePipelineState> _pipelineStatePhotonRadius;
+        id<MTLComputePipelineState> _pipelineStatePhotonVisibility;
         
         id<MTLComputePipelineState> _pipelineStatePhotonRecording;
-        id<MTLComputePipelineState> _pipelineStatePhotonHashing;
-        id<MTLComputePipelineState> _pipelineStatePhotonSumming;
         id<MTLComputePipelineState> _pipelineStatePhotonRefine;
     
+        id<MTLBuffer> _vcmVertexBuffer;
+        id<MTLBuffer> _vcmPathRangeBuffer;
+    
+        id<MTLComputePipelineState> _pipelineStateVCMLight;
+        id<MTLComputePipelineState> _pipelineStateVCMCamera;
+    
+        GuideTree _guideTree;
+        uint32_t _guideIteration;
+        uint32_t _guideFrames;
+        uint32_t _guideCapacity;
+    
+        id<MTLBuffer> _guideSpatialBuffer;
+        id<MTLBuffer> _guideQuadBuffer;
+        id<MTLBuffer> _guideRecordBuffer;
+    
+        id<MTLComputePipelineState> _pipelineStatePathGuiding;
+    
+        id<MTLBuffer> _cameraPreviousBuffer;
+        id<MTLBuffer> _restirSurfaceBuffer;
+        id<MTLBuffer> _restirPreviousSurfaceBuffer;
+        id<MTLBuffer> _restirReservoirBuffer;
+        id<MTLBuffer> _restirHistoryBuffer;
+    
+        id<MTLComputePipelineState> _pipelineStateReSTIRInitial;
+        id<MTLComputePipelineState> _pipelineStateReSTIRSpatial;
+        id<MTLComputePipelineState> _pipelineStateReSTIRShade;
+    
     MPSSVGF* objectSVGF;
     MPSSVGFDenoiser* denoiserSVGF;
     MPSSVGFDefaultTextureAllocator* textureAllocatorSVGF;
@@ -112,6 +210,21 @@ uint32_t photonHashN = PHOTON_HASHN;
         id<MTLTexture> _sourceSVGF, _zNormalSVGF, _motion2DSVGF;
         id<MTLTexture> _resultSVGF;
     
+    // The portable filter in place of MPSSVGFDenoiser, run on the CPU between a readback and an upload
+    // of the same command buffer, held at a shared event until it is done
+    bool _cpuSVGF;
+    SVGF _svgf;
+    
+        id<MTLBuffer> _svgfSourceBuffer, _svgfZNormalBuffer, _svgfMotionBuffer, _svgfResultBuffer;
+        id<MTLTexture> _svgfResultTexture;
+    
+        id<MTLSharedEvent> _svgfEvent;
+        MTLSharedEventListener* _svgfListener;
+        uint64_t _svgfEventValue;
+    
+        double _svgfTime;
+        uint32_t _svgfFrames;
+    
     id<MTLTexture> _textureA;
     id<MTLTexture> _textureB;
     id<MTLTexture> _textureCanvasRNG;
@@ -165,6 +278,9 @@ uint32_t photonHashN = PHOTON_HASHN;
         let _kernelPathTracing = [defaultLibrary newFunctionWithName:@"kernelPathTracing"];
         _pipelineStatePathTracing = [_device newComputePipelineStateWithFunction:_kernelPathTracing error:&ERROR];
         
+        let _kernelPreviewUpsample = [defaultLibrary newFunctionWithName:@"kernelPreviewUpsample"];
+        _pipelineStatePreviewUpsample = [_device newComputePipelineStateWithFunction:_kernelPreviewUpsample error:&ERROR];
+        
         let argumentEncoderPri = [_kernelPathTracing newArgumentEncoderWithBufferIndex:7];
         let argumentBufferLengthPri = argumentEncoderPri.encodedLength;
         _argumentBufferPri = [_device newBufferWithLength:argumentBufferLengthPri options:0];
@@ -199,6 +315,7 @@ uint32_t photonHashN = PHOTON_HASHN;
         _complex = (Complex*)(_complex_buffer.contents);
         _complex->frame_count = 0;
         _complex->running_time = 0;
+        _complex->sampler = SamplerType::Sobol;
         
         _complex->tex_size = float2 {static_cast<float>(_width), static_cast<float>(_height)};
         _complex->view_size = float2 {static_cast<float>(_width), static_cast<float>(_height)};
@@ -209,6 +326,9 @@ uint32_t photonHashN = PHOTON_HASHN;
         _camera_buffer = [_device newBufferWithBytes: &_camera
                                               length: sizeof(Camera)
                                              options: MTLResourceStorageModeShared];
+        _cameraPreviousBuffer = [_device newBufferWithBytes: &_camera
+                                                     length: sizeof(Camera)
+                                                    options: MTLResourceStorageModeShared];
         
         std::vector<Material> materials;
         
@@ -220,6 +340,36 @@ uint32_t photonHashN = PHOTON_HASHN;
         
         std::vector<Square> cornell_box;
         prepareCornellBox(cornell_box, materials);
+        
+        std::vector<Light> light_list;
+        std::vector<AliasBin> alias_table;
+        prepareLightList(cornell_box, materials, light_list, alias_table);
+        
+NSLog(@"Processing Light BVH");
+_time_s = [[NSDate date] timeIntervalSince1970];
+        std::vector<LightBVHNode> light_tree;
+        prepareLightTree(cornell_box, light_list, light_tree);
+_time_e = [[NSDate date] timeIntervalSince1970];
+NSLog(@"Done  %fs", _time_e - _time_s);
+        
+        // Metal has no empty buffers, without lights these hold one zeroed element the kernels never
+        // read, as the light count stays zero
+        let lightCount = (uint32_t)light_list.size();
+        if (lightCount == 0) {
+            NSLog(@"No lights in the scene");
+            light_list.resize(1); light_tree.resize(1); alias_table.resize(1);
+        }
+        
+        _light_tree_buffer = [_device newBufferWithBytes: light_tree.data()
+                                                  length: sizeof(LightBVHNode)*light_tree.size()
+                                                 options: _commonStorageMode];
+        _light_list_buffer = [_device newBufferWithBytes: light_list.data()
+                                                  length: sizeof(Light)*light_list.size()
+                                                 options: _commonStorageMode];
+        _alias_table_buffer = [_device newBufferWithBytes: alias_table.data()
+                                                   length: sizeof(AliasBin)*alias_table.size()
+                                                  options: _commonStorageMode];
+        
         _square_list_buffer = [_device newBufferWithBytes: cornell_box.data()
                                                    length: sizeof(Square)*cornell_box.size()
                                                   options: _commonStorageMode];
@@ -284,7 +434,69 @@ uint32_t photonHashN = PHOTON_HASHN;
         
         _textureCanvasRNG = [_device newTextureWithDescriptor:tdr];
         
-        tdr.width = photonHashN; tdr.height = photonHashN;
+        // Preview targets at half and a quarter of the width and height, and the full size they are shown at
+        _previewTexture = [_device newTextureWithDescriptor:td];
+        
+        let tds = [MTLTextureDescriptor texture2DDescriptorWithPixelFormat:MTLPixelFormatRGBA16Float
+                                                                     width:_width height:_height mipmapped:NO];
+        tds.storageMode = MTLStorageModePrivate;
+        tds.usage = MTLTextureUsageShaderRead | MTLTextureUsageShaderWrite;
+        
+        for (uint32_t i = 0; i < 2; ++i) {
+            auto& preview = _preview[i];
+            preview.width = _width >> (i + 1);
+            preview.height = _height >> (i + 1);
+            
+            td.width = tdr.width = tds.width = preview.width;
+            td.height = tdr.height = tds.height = preview.height;
+            td.mipmapLevelCount = mipCount - (i + 1);
+            
+            preview.a = [_device newTextureWithDescriptor:td];
+            preview.b = [_device newTextureWithDescriptor:td];
+            preview.rng = [_device newTextureWithDescriptor:tdr];
+            
+            tds.pixelFormat = MTLPixelFormatRGBA16Float;
+            preview.source = [_device newTextureWithDescriptor:tds];
+            preview.zNormal = [_device newTextureWithDescriptor:tds];
+            tds.pixelFormat = MTLPixelFormatRG16Float;
+            preview.motion = [_device newTextureWithDescriptor:tds];
+        }
+        
+        // Photon paths per pass, the PhotonBudget user default overrides the size of the hash table
+        _photonBudget = (uint32_t)[NSUserDefaults.standardUserDefaults integerForKey:@"PhotonBudget"];
+        if (_photonBudget == 0) { _photonBudget = PHOTON_HASH_CELLS; }
+        _photonBudget = (_photonBudget + photonPassWidth - 1) / photonPassWidth * photonPassWidth;
+        
+        // A path deposits about twice, batch up to 4 passes per frame within a 16th of the working set
+        uint64_t bytesPerPass = 2ull * _photonBudget * (sizeof(PhotonPacked) + sizeof(PhotonCellEntry));
+        _photonPasses = (uint32_t)std::clamp<uint64_t>(_device.recommendedMaxWorkingSetSize / 16 / bytesPerPass, 1, 4);
+        _photonCapacity = 2 * _photonBudget * _photonPasses;
+        
+        NSLog(@"Photon budget %u paths x %u passes per frame", _photonBudget, _photonPasses);
+        
+        // Hash grid unless the PhotonGather user default asks for the kd-tree, which copes
+        // better with very uneven photon density
+        let photonGather = [NSUserDefaults.standardUserDefaults stringForKey:@"PhotonGather"];
+        _complex->photonGather = [photonGather isEqualToString:@"KDTree"] ? PhotonGather::KDTree : PhotonGather::HashGrid;
+        _complex->photonTreeCount = 0;
+        
+        let integrator = [NSUserDefaults.standardUserDefaults stringForKey:@"Integrator"];
+        _complex->integrator = [integrator isEqualToString:@"VCM"] ? Integrator::VCM
+                             : [integrator isEqualToString:@"BDPT"] ? Integrator::BDPT
+                             : [integrator isEqualToString:@"PathTracing"] ? Integrator::PathTracing
+                             : [integrator isEqualToString:@"PathGuiding"] ? Integrator::PathGuiding
+                             : [integrator isEqualToString:@"ReSTIR"] ? Integrator::ReSTIR : Integrator::SPPM;
+        _complex->restirTemporalCap = RESTIR_TEMPORAL_CAP;
+        
+        // Equal-time comparison: after BenchmarkSeconds the image is written out with the frame count
+        _benchmarkSeconds = [NSUserDefaults.standardUserDefaults doubleForKey:@"BenchmarkSeconds"];
+        
+        // Frames aimed at while the camera moves, a 30th of a second unless PreviewFrameTime says otherwise
+        _previewFrameTime = [NSUserDefaults.standardUserDefaults doubleForKey:@"PreviewFrameTime"];
+        if (_previewFrameTime <= 0) { _previewFrameTime = 1.0 / 30; }
+        _previewScale = 1;
+        
+        tdr.width = photonPassWidth; tdr.height = _photonBudget / photonPassWidth;
         _texturePhotonRNG = [_device newTextureWithDescriptor:tdr];
         
 NSLog(@"Processing RNG");
@@ -342,6 +554,7 @@ _time_s = [[NSDate date] timeIntervalSince1970];
         
         fillRNG(_textureCanvasRNG);
         fillRNG(_texturePhotonRNG);
+        for (let& preview : _preview) { fillRNG(preview.rng); }
         
 _time_e = [[NSDate date] timeIntervalSince1970];
 NSLog(@"Done  %fs", _time_e - _time_s);
@@ -443,6 +656,87 @@ _time_s = [[NSDate date] timeIntervalSince1970];
                 return nil;
             }
         
+NSLog(@"Processing environment distribution");
+_time_s = [[NSDate date] timeIntervalSince1970];
+        {
+            // A low mip is enough to drive the sampling, radiance still comes from the full map
+            let level = MIN(3, _textureHDR.mipmapLevelCount - 1);
+            let nu = (uint32_t)MAX(1, _textureHDR.width >> level);
+            let nv = (uint32_t)MAX(1, _textureHDR.height >> level);
+            
+            // The loaders above hand over the .hdr as 8 bit on both platforms, so those formats are decoded too
+            let format = _textureHDR.pixelFormat;
+            let isHalf = format == MTLPixelFormatRGBA16Float;
+            let isFloat = format == MTLPixelFormatRGBA32Float;
+            let isBGRA = format == MTLPixelFormatBGRA8Unorm || format == MTLPixelFormatBGRA8Unorm_sRGB;
+            let isSRGB = format == MTLPixelFormatRGBA8Unorm_sRGB || format == MTLPixelFormatBGRA8Unorm_sRGB;
+            let isByte = isBGRA || isSRGB || format == MTLPixelFormatRGBA8Unorm;
+            let pixelSize = isHalf ? sizeof(__fp16) * 4 : isFloat ? sizeof(float) * 4 : sizeof(uint8_t) * 4;
+            
+            std::vector<float> luminance(nu * nv, 1.0);
+            
+            if (isByte) {
+                NSLog(@"Environment map is 8 bit, its distribution follows the clipped radiance");
+            } else if (!isHalf && !isFloat) {
+                NSLog(@"Environment map format %lu not decoded, sampled uniformly", (unsigned long)format);
+            }
+            
+            if (isHalf || isFloat || isByte) {
+                
+                let mipBuffer = [_device newBufferWithLength: pixelSize * nu * nv
+                                                     options: MTLResourceStorageModeShared];
+                
+                let commandBuffer = [_commandQueue commandBuffer];
+                let blit = [commandBuffer blitCommandEncoder];
+                
+                [blit copyFromTexture: _textureHDR
+                          sourceSlice: 0
+                          sourceLevel: level
+                         sourceOrigin: {0, 0, 0}
+                           sourceSize: {nu, nv, 1}
+                             toBuffer: mipBuffer
+                    destinationOffset: 0
+               destinationBytesPerRow: pixelSize * nu
+             destinationBytesPerImage: pixelSize * nu * nv];
+                [blit endEncoding];
+                
+                [commandBuffer commit];
+                [commandBuffer waitUntilCompleted];
+                
+                for (uint32_t i=0; i<nu*nv; i++) {
+                    float3 rgb;
+                    if (isHalf) {
+                        let pixel = (__fp16*)mipBuffer.contents + i * 4;
+                        rgb = float3{ pixel[0], pixel[1], pixel[2] };
+                    } else if (isFloat) {
+                        let pixel = (float*)mipBuffer.contents + i * 4;
+                        rgb = float3{ pixel[0], pixel[1], pixel[2] };
+                    } else {
+                        let pixel = (uint8_t*)mipBuffer.contents + i * 4;
+                        rgb = isBGRA ? float3{ pixel[2], pixel[1], pixel[0] } : float3{ pixel[0], pixel[1], pixel[2] };
+                        rgb /= 255;
+                        // The shaders read sRGB textures as linear
+                        for (int c=0; c<3 && isSRGB; c++) {
+                            rgb[c] = rgb[c] <= 0.04045 ? rgb[c] / 12.92 : powf((rgb[c] + 0.055) / 1.055, 2.4);
+                        }
+                    }
+                    luminance[i] = fmaxf(0, simd_dot(rgb, float3{0.2126, 0.7152, 0.0722}));
+                }
+            }
+            
+            std::vector<float> env_data;
+            let env_distribution = prepareEnvironmentDistribution(luminance, nu, nv, env_data);
+            
+            _env_distribution_buffer = [_device newBufferWithBytes: &env_distribution
+                                                            length: sizeof(Distribution2D)
+                                                           options: _commonStorageMode];
+            _env_data_buffer = [_device newBufferWithBytes: env_data.data()
+                                                    length: sizeof(float)*env_data.size()
+                                                   options: _commonStorageMode];
+        }
+_time_e = [[NSDate date] timeIntervalSince1970];
+NSLog(@"Done  %fs", _time_e - _time_s);
+        
         _vectorTexAll = {_textureHDR, _textureUVT};
         _vectorTexAll.insert(_vectorTexAll.end(), std::begin(_vectorTexPBR), std::end(_vectorTexPBR));
         
@@ -622,40 +916,164 @@ NSLog(@"Done  %fs", _time_e - _time_s);
                 _bvh_buffer = [_device newBufferWithBytes: bvh_list.data()
                                                    length: sizeof(BVH)*bvh_list.size()
                                                   options: _commonStorageMode];
+                
+                _sceneBoxBuffer = [_device newBufferWithBytes: &bvh_list[0].bBOX
+                                                       length: sizeof(AABB)
+                                                      options: _commonStorageMode];
         
 NSLog(@"Loading volume");
 _time_s = [[NSDate date] timeIntervalSince1970];
         
-                minipbrt::Loader loaderPBRT;
                 auto pathPBRT = [NSBundle.mainBundle pathForResource:@"cloud/cloud" ofType:@"pbrt"];
+                auto pathCache = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES).firstObject
+                                  stringByAppendingPathComponent:@"cloud.volume"];
+        
+                // Every file of the cloud folder, the density grid comes from an Include
+                std::vector<std::string> sourcePaths;
+                auto cloudFolder = [pathPBRT stringByDeletingLastPathComponent];
+                for (NSString* sub in [NSFileManager.defaultManager subpathsAtPath:cloudFolder]) {
+                    sourcePaths.push_back([[cloudFolder stringByAppendingPathComponent:sub] UTF8String]);
+                }
+                std::sort(sourcePaths.begin(), sourcePaths.end());
+        
+                const float sigma_a = 10, sigma_s = 90, g = 0.5;
+                const uint bits = 16;
+                let sourceKey = VolumeCacheKey(sourcePaths, sigma_a, sigma_s, g, bits);
         
-                if (loaderPBRT.load([pathPBRT UTF8String])) {
+                VolumeCache volumeCache;
+        
+                if (!volumeCache.open([pathCache UTF8String], sourceKey)) {
+                    
+                    minipbrt::Loader loaderPBRT;
+                    
+                    if (!loaderPBRT.load([pathPBRT UTF8String])) {
+                        // If parsing failed, the parser will have an error object.
+                        const minipbrt::Error* err = loaderPBRT.error();
+                        fprintf(stderr, "[%s, line %lld, column %lld] %s\n",
+                                err->filename(), err->line(), err->column(), err->message());
+                        // Don't delete err, it's still owned by the parser.
+                        return nil;
+                    }
+                    
                     minipbrt::Scene* scene = loaderPBRT.take_scene();
                     auto* medium = dynamic_cast<minipbrt::HeterogeneousMedium*>(scene->mediums[0]);
                     
-                    auto size_grid = sizeof(float) * medium->nx * medium->ny * medium->nz;
-                    auto info_grid = GridDensityInfo(10, 90, 0.5, medium->nx, medium->ny, medium->nz, medium->density);
+                    VolumeCacheHeader header {};
+                    header.sourceKey = sourceKey;
+                    header.info = GridDensityInfo(sigma_a, sigma_s, g, medium->nx, medium->ny, medium->nz, medium->density, bits);
+                    header.maxDensity = 1 / header.info.invMaxDensity;
+                    header.p0 = { medium->p0[0], medium->p0[1], medium->p0[2] };
+                    header.p1 = { medium->p1[0], medium->p1[1], medium->p1[2] };
+                    header.sampler = (uint32_t)SamplerType::Sobol;
                     
-                    _densityInfoBuffer = [_device newBufferWithBytes: &info_grid length: sizeof(info_grid) options: _commonStorageMode];
-                    _densityDataBuffer = [_device newBufferWithBytes: medium->density length: size_grid options: _commonStorageMode];
+                    if (scene->sampler != nullptr) {
+                        switch (scene->sampler->type()) {
+                            case minipbrt::SamplerType::Halton:
+                                header.sampler = (uint32_t)SamplerType::Halton; break;
+                            case minipbrt::SamplerType::ZeroTwoSequence:
+                            case minipbrt::SamplerType::LowDiscrepancy:
+                                header.sampler = (uint32_t)SamplerType::BlueNoise; break;
+                            case minipbrt::SamplerType::Random:
+                                header.sampler = (uint32_t)SamplerType::Random; break;
+                            default: break;
+                        }
+                    }
+                    
+                    std::vector<DensityBrick> brick_table;
+                    std::vector<uint8_t> brick_data;
+                    header.info.makeBricks(medium->density, brick_table, brick_data);
+                    let majorant_grid = header.info.majorantGrid(brick_table, brick_data);
                     
                     delete scene;
+                    
+                    [NSFileManager.defaultManager createDirectoryAtPath:[pathCache stringByDeletingLastPathComponent]
+                                            withIntermediateDirectories:YES attributes:nil error:nil];
+                    
+                    if (!WriteVolumeCache([pathCache UTF8String], header, majorant_grid, brick_table, brick_data)
+                        || !volumeCache.open([pathCache UTF8String], sourceKey)) {
+                        
+                        NSLog(@"Volume cache not written, using the parsed grid");
+                        
+                        _densityInfoBuffer = [_device newBufferWithBytes: &header.info length: sizeof(header.info) options: _commonStorageMode];
+                        _densityDataBuffer = [_device newBufferWithBytes: brick_data.data() length: MAX(brick_data.size(), 4) options: _commonStorageMode];
+                        _densityBrickBuffer = [_device newBufferWithBytes: brick_table.data()
+                                                                   length: sizeof(DensityBrick) * brick_table.size()
+                                                                  options: _commonStorageMode];
+                        _majorantGridBuffer = [_device newBufferWithBytes: majorant_grid.data()
+                                                                   length: sizeof(float) * majorant_grid.size()
+                                                                  options: _commonStorageMode];
+                        _complex->sampler = (SamplerType)header.sampler;
+                    }
                 }
-                else {
-                    // If parsing failed, the parser will have an error object.
-                    const minipbrt::Error* err = loaderPBRT.error();
-                    fprintf(stderr, "[%s, line %lld, column %lld] %s\n",
-                            err->filename(), err->line(), err->column(), err->message());
-                    // Don't delete err, it's still owned by the parser.
-                    return nil;
+        
+                if (volumeCache.mapping != nullptr) {
+                    
+                    let& header = volumeCache.header;
+                    
+                    // Each page aligned section is wrapped for the heap upload, and unmapped with its buffer
+                    auto sectionBuffer = [&](const VolumeCacheSection& section) -> id<MTLBuffer> {
+                        if (section.mapped() == 0) {
+                            return [_device newBufferWithLength: 4 options: _commonStorageMode];
+                        }
+                        return [_device newBufferWithBytesNoCopy: volumeCache.data(section)
+                                                          length: section.mapped()
+                                                         options: MTLResourceStorageModeShared
+                                                     deallocator: ^(void* pointer, NSUInteger length) { munmap(pointer, length); }];
+                    };
+                    
+                    _densityInfoBuffer = [_device newBufferWithBytes: &header.info length: sizeof(header.info) options: _commonStorageMode];
+                    _majorantGridBuffer = sectionBuffer(header.majorant);
+                    _densityBrickBuffer = sectionBuffer(header.table);
+                    _densityDataBuffer = sectionBuffer(header.bricks);
+                    _complex->sampler = (SamplerType)header.sampler;
+                    
+                    auto size_grid = sizeof(float) * header.info.nx * header.info.ny * header.info.nz;
+                    NSLog(@"Density bricks %.2fMB instead of %.2fMB, max density %f",
+                          header.bricks.length / 1048576.0, size_grid / 1048576.0, header.maxDensity);
+                    
+                    volumeCache.releaseHeader();
                 }
         
+_time_e = [[NSDate date] timeIntervalSince1970];
+NSLog(@"Done  %fs", _time_e - _time_s);
+        
+                let permutations = ComputeRadicalInversePermutations(arc4random());
+                _haltonPermutationBuffer = [_device newBufferWithBytes: permutations.data()
+                                                                length: sizeof(uint16_t) * permutations.size()
+                                                               options: _commonStorageMode];
+        
+NSLog(@"Processing blue noise");
+_time_s = [[NSDate date] timeIntervalSince1970];
+        
+                // Void-and-cluster is quadratic in the tile, so the tiles are only built once
+                let blueNoiseName = [NSString stringWithFormat:@"bluenoise_%d_%d_%08x.tiles", BLUE_NOISE_TILE, BLUE_NOISE_DIMENSIONS, BLUE_NOISE_SEED];
+                let pathBlueNoise = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES).firstObject
+                                     stringByAppendingPathComponent:blueNoiseName];
+                NSUInteger blueNoiseSize = BLUE_NOISE_TILE * BLUE_NOISE_TILE * BLUE_NOISE_DIMENSIONS * 2;
+        
+                NSData* blueNoiseTiles = [NSData dataWithContentsOfFile:pathBlueNoise];
+        
+                if (blueNoiseTiles.length != blueNoiseSize) {
+                    let tiles = BuildBlueNoiseTiles(BLUE_NOISE_SEED);
+                    blueNoiseTiles = [NSData dataWithBytes:tiles.data() length:tiles.size()];
+                    
+                    if (![blueNoiseTiles writeToFile:pathBlueNoise atomically:YES]) {
+                        NSLog(@"Blue noise cache not written");
+                    }
+                }
+        
+                _blueNoiseTileBuffer = [_device newBufferWithBytes: blueNoiseTiles.bytes
+                                                            length: blueNoiseTiles.length
+                                                           options: _commonStorageMode];
+        
 _time_e = [[NSDate date] timeIntervalSince1970];
 NSLog(@"Done  %fs", _time_e - _time_s);
         
         _vectorBufferAll = { _cube_list_buffer, _square_list_buffer, _sphere_list_buffer,
                                 _bvh_buffer, _idx_buffer, _tri_buffer, _material_buffer,
-                                _densityInfoBuffer, _densityDataBuffer };
+                                _densityInfoBuffer, _densityDataBuffer, _haltonPermutationBuffer, _blueNoiseTileBuffer,
+                                _light_list_buffer, _alias_table_buffer, _light_tree_buffer,
+                                _env_distribution_buffer, _env_data_buffer, _majorantGridBuffer, _densityBrickBuffer };
         
         [self createHeap];
         [self copyToHeap];
@@ -673,6 +1091,19 @@ NSLog(@"Done  %fs", _time_e - _time_s);
         _densityInfoBuffer = _vectorBufferAll[7];
         _densityDataBuffer = _vectorBufferAll[8];
         
+        _haltonPermutationBuffer = _vectorBufferAll[9];
+        _blueNoiseTileBuffer = _vectorBufferAll[10];
+        
+        _light_list_buffer = _vectorBufferAll[11];
+        _alias_table_buffer = _vectorBufferAll[12];
+        _light_tree_buffer = _vectorBufferAll[13];
+        
+        _env_distribution_buffer = _vectorBufferAll[14];
+        _env_data_buffer = _vectorBufferAll[15];
+        
+        _majorantGridBuffer = _vectorBufferAll[16];
+        _densityBrickBuffer = _vectorBufferAll[17];
+        
         _vectorBufferAll.clear();
         
         std::copy(_vectorTexPBR.begin(), _vectorTexPBR.end(), _vectorTexAll.begin()+2);
@@ -708,6 +1139,14 @@ NSLog(@"Done  %fs", _time_e - _time_s);
         
         [argumentEncoderEnv setBuffer:_densityInfoBuffer offset:0 atIndex:3];
         [argumentEncoderEnv setBuffer:_densityDataBuffer offset:0 atIndex:4];
+        [argumentEncoderEnv setBuffer:_majorantGridBuffer offset:0 atIndex:9];
+        [argumentEncoderEnv setBuffer:_densityBrickBuffer offset:0 atIndex:10];
+        
+        [argumentEncoderEnv setBuffer:_haltonPermutationBuffer offset:0 atIndex:5];
+        [argumentEncoderEnv setBuffer:_blueNoiseTileBuffer offset:0 atIndex:6];
+        
+        [argumentEncoderEnv setBuffer:_env_distribution_buffer offset:0 atIndex:7];
+        [argumentEncoderEnv setBuffer:_env_data_buffer offset:0 atIndex:8];
         
         [argumentEncoderPri setArgumentBuffer:_argumentBufferPri offset:0];
         
@@ -719,6 +1158,11 @@ NSLog(@"Done  %fs", _time_e - _time_s);
         [argumentEncoderPri setBuffer:_idx_buffer offset:0 atIndex:4];
         [argumentEncoderPri setBuffer:_bvh_buffer offset:0 atIndex:5];
         
+        [argumentEncoderPri setBuffer:_light_list_buffer offset:0 atIndex:6];
+        [argumentEncoderPri setBuffer:_alias_table_buffer offset:0 atIndex:7];
+        *(uint32_t*)[argumentEncoderPri constantDataAtIndex:8] = lightCount;
+        [argumentEncoderPri setBuffer:_light_tree_buffer offset:0 atIndex:9];
+        
         launchTime = [[NSDate date] timeIntervalSince1970];
         // Add a completion handler and commit the command buffer.
         [commandBuffer addCompletedHandler:^(id<MTLCommandBuffer> cb) {
@@ -737,79 +1181,131 @@ NSLog(@"Done  %fs", _time_e - _time_s);
             _pipelineStatePhotonParams = [_device newComputePipelineStateWithFunction:_kernelPhotonParams error:&ERROR];
             let _kernelPhotonRadius = [defaultLibrary newFunctionWithName:@"kernelPhotonRadius"];
             _pipelineStatePhotonRadius = [_device newComputePipelineStateWithFunction:_kernelPhotonRadius error:&ERROR];
+            let _kernelPhotonVisibility = [defaultLibrary newFunctionWithName:@"kernelPhotonVisibility"];
+            _pipelineStatePhotonVisibility = [_device newComputePipelineStateWithFunction:_kernelPhotonVisibility error:&ERROR];
             
             let _kernelPhotonRecording = [defaultLibrary newFunctionWithName:@"kernelPhotonRecording"];
             _pipelineStatePhotonRecording = [_device newComputePipelineStateWithFunction:_kernelPhotonRecording error:&ERROR];
             
-            let _kernelPhotonHashing = [defaultLibrary newFunctionWithName:@"kernelPhotonHashing"];
-            _pipelineStatePhotonHashing = [_device newComputePipelineStateWithFunction:_kernelPhotonHashing error:&ERROR];
-        
-            let _kernelPhotonSumming = [defaultLibrary newFunctionWithName:@"kernelPhotonSumming"];
-            _pipelineStatePhotonSumming = [_device newComputePipelineStateWithFunction:_kernelPhotonSumming error:&ERROR];
-        
             let _kernelPhotonRefine = [defaultLibrary newFunctionWithName:@"kernelPhotonRefine"];
             _pipelineStatePhotonRefine = [_device newComputePipelineStateWithFunction:_kernelPhotonRefine error:&ERROR];
         
-            _cameraRecordBuffer = [_device newBufferWithLength:sizeof(CameraRecord) * _width * _height
+            _cameraGatherBuffer = [_device newBufferWithLength:sizeof(CameraGather) * _width * _height
                                                        options:_commonStorageMode];
-            [_cameraRecordBuffer setLabel:@"_cameraRecordBuffer"];
+            [_cameraGatherBuffer setLabel:@"_cameraGatherBuffer"];
+        
+            _cameraShadeBuffer = [_device newBufferWithLength:sizeof(CameraShade) * _width * _height
+                                                      options:_commonStorageMode];
+            [_cameraShadeBuffer setLabel:@"_cameraShadeBuffer"];
+        
+            _cameraDirectBuffer = [_device newBufferWithLength:sizeof(simd_float4) * _width * _height
+                                                       options:_commonStorageMode];
+            [_cameraDirectBuffer setLabel:@"_cameraDirectBuffer"];
         
             _cameraBoundsBuffer = [_device newBufferWithLength:sizeof(AABB) * _width * _height
                                                        options:_commonStorageMode];
             _aremacBoundsBuffer = [_device newBufferWithLength:sizeof(AABB) * 4096
                                                        options:_commonStorageMode];
         
-            _photonRecordBuffer = [_device newBufferWithLength:sizeof(PhotonRecord) * photonHashN * photonHashN
+            _photonRecordBuffer = [_device newBufferWithLength:sizeof(PhotonPacked) * _photonCapacity
                                                        options:_commonStorageMode];
             [_photonRecordBuffer setLabel:@"_photonRecordBuffer"];
         
-            _photonHashedBuffer = [_device newBufferWithLength:sizeof(float4) * photonHashN * photonHashN
+            _photonCounterBuffer = [_device newBufferWithLength:sizeof(uint32_t) * PHOTON_COUNTERS
+                                                        options:_commonStorageMode];
+            [_photonCounterBuffer setLabel:@"_photonCounterBuffer"];
+        
+            // Hash grid filled on the host every frame, one more start than cells for the last end
+            _photonCellStartBuffer = [_device newBufferWithLength:sizeof(uint32_t) * (PHOTON_HASH_CELLS + 1)
+                                                          options:_commonStorageMode];
+            [_photonCellStartBuffer setLabel:@"_photonCellStartBuffer"];
+        
+            _photonEntryBuffer = [_device newBufferWithLength:sizeof(PhotonCellEntry) * _photonCapacity
+                                                      options:_commonStorageMode];
+            [_photonEntryBuffer setLabel:@"_photonEntryBuffer"];
+        
+            _photonTreeBuffer = [_device newBufferWithLength:sizeof(PhotonKDNode) * _photonCapacity
+                                                     options:_commonStorageMode];
+            [_photonTreeBuffer setLabel:@"_photonTreeBuffer"];
+        
+            // One Markov chain per photon thread, reset on the first frame
+            _photonChainBuffer = [_device newBufferWithLength:sizeof(PhotonChain) * _photonBudget
+                                                      options:_commonStorageMode];
+            [_photonChainBuffer setLabel:@"_photonChainBuffer"];
+        
+            _photonChainStateBuffer = [_device newBufferWithLength:sizeof(float) * PHOTON_DIMS * _photonBudget
+                                                           options:_commonStorageMode];
+            [_photonChainStateBuffer setLabel:@"_photonChainStateBuffer"];
+        
+            // A bit per visibility cell, set where a camera record can gather
+            _photonVisibilityBuffer = [_device newBufferWithLength:sizeof(uint32_t) * PHOTON_VISIBLE_BITS / 32
+                                                           options:_commonStorageMode];
+            [_photonVisibilityBuffer setLabel:@"_photonVisibilityBuffer"];
+        
+            let _kernelVCMLight = [defaultLibrary newFunctionWithName:@"kernelVCMLightPaths"];
+            _pipelineStateVCMLight = [_device newComputePipelineStateWithFunction:_kernelVCMLight error:&ERROR];
+            let _kernelVCMCamera = [defaultLibrary newFunctionWithName:@"kernelVCMCameraPaths"];
+            _pipelineStateVCMCamera = [_device newComputePipelineStateWithFunction:_kernelVCMCamera error:&ERROR];
+        
+            // MIS state of the light vertices, beside the photon records they share
+            _vcmVertexBuffer = [_device newBufferWithLength:sizeof(VCMVertex) * _photonCapacity
+                                                    options:_commonStorageMode];
+            [_vcmVertexBuffer setLabel:@"_vcmVertexBuffer"];
+        
+            // First vertex and count of the light path of every pixel
+            _vcmPathRangeBuffer = [_device newBufferWithLength:sizeof(simd_uint2) * _width * _height
                                                        options:_commonStorageMode];
-            [_photonHashedBuffer setLabel:@"_photonHashedBuffer"];
-        
-            // Set up a texture for rendering to and sampling from
-            auto photonMarkDescription = [[MTLTextureDescriptor alloc] init];
-            photonMarkDescription.textureType = MTLTextureType2D;
-            photonMarkDescription.width = photonHashN;
-            photonMarkDescription.height = photonHashN;
-            photonMarkDescription.usage = MTLTextureUsageRenderTarget | MTLTextureUsageShaderRead;
-            
-            photonMarkDescription.pixelFormat = MTLPixelFormatRGBA32Float;
-            _texturePhotonMark = [_device newTextureWithDescriptor:photonMarkDescription];
-        
-            photonMarkDescription.pixelFormat = MTLPixelFormatR32Float;
-            _texturePhotonCount = [_device newTextureWithDescriptor:photonMarkDescription];
-        
-            _renderPhotonCountPassDescriptor = [[MTLRenderPassDescriptor alloc] init];
-            _renderPhotonCountPassDescriptor.colorAttachments[0].texture = _texturePhotonMark;
-            _renderPhotonCountPassDescriptor.colorAttachments[0].loadAction = MTLLoadActionClear;
-            _renderPhotonCountPassDescriptor.colorAttachments[0].clearColor = MTLClearColorMake(-1, -1, -1, -1);
-            _renderPhotonCountPassDescriptor.colorAttachments[0].storeAction = MTLStoreActionStore;
-            _renderPhotonCountPassDescriptor.colorAttachments[1].texture = _texturePhotonCount;
-            _renderPhotonCountPassDescriptor.colorAttachments[1].loadAction = MTLLoadActionClear;
-            _renderPhotonCountPassDescriptor.colorAttachments[1].clearColor = MTLClearColorMake(0, 0, 0, 0);
-            _renderPhotonCountPassDescriptor.colorAttachments[1].storeAction = MTLStoreActionStore;
-
-            auto photonMarkPipelineDescriptor = [[MTLRenderPipelineDescriptor alloc] init];
-        
-            photonMarkPipelineDescriptor.label = @"Photon Count Pipeline";
-            photonMarkPipelineDescriptor.sampleCount = 1;
-            photonMarkPipelineDescriptor.vertexFunction = [defaultLibrary newFunctionWithName:@"PhotonMarkVS"];
-            photonMarkPipelineDescriptor.fragmentFunction = [defaultLibrary newFunctionWithName:@"PhotonMarkFS"];
-            photonMarkPipelineDescriptor.colorAttachments[0].pixelFormat = _texturePhotonMark.pixelFormat;
-            photonMarkPipelineDescriptor.colorAttachments[1].pixelFormat = _texturePhotonCount.pixelFormat;
-            
-            photonMarkPipelineDescriptor.colorAttachments[0].blendingEnabled = false;
-            
-            photonMarkPipelineDescriptor.colorAttachments[1].blendingEnabled = true;
-            photonMarkPipelineDescriptor.colorAttachments[1].rgbBlendOperation = MTLBlendOperationAdd;
-            photonMarkPipelineDescriptor.colorAttachments[1].alphaBlendOperation = MTLBlendOperationAdd;
-            photonMarkPipelineDescriptor.colorAttachments[1].sourceRGBBlendFactor = MTLBlendFactorOne;
-            photonMarkPipelineDescriptor.colorAttachments[1].sourceAlphaBlendFactor = MTLBlendFactorOne;
-            photonMarkPipelineDescriptor.colorAttachments[1].destinationRGBBlendFactor = MTLBlendFactorOne;
-            photonMarkPipelineDescriptor.colorAttachments[1].destinationAlphaBlendFactor = MTLBlendFactorOne;
-        
-            _renderPhotonCountPipelineState = [_device newRenderPipelineStateWithDescriptor:photonMarkPipelineDescriptor error:&ERROR];
+            [_vcmPathRangeBuffer setLabel:@"_vcmPathRangeBuffer"];
+        
+            if (_complex->integrator == Integrator::PathTracing || _complex->integrator == Integrator::SPPM) {
+                _primaryCacheBuffer = [_device newBufferWithLength:sizeof(PrimaryHit) * _width * _height * PRIMARY_PATTERNS
+                                                           options:MTLResourceStorageModePrivate];
+                [_primaryCacheBuffer setLabel:@"_primaryCacheBuffer"];
+            }
+        
+            if (_complex->integrator == Integrator::PathGuiding) {
+                
+                let _kernelPathGuiding = [defaultLibrary newFunctionWithName:@"kernelPathGuiding"];
+                _pipelineStatePathGuiding = [_device newComputePipelineStateWithFunction:_kernelPathGuiding error:&ERROR];
+                
+                // A quarter of the pixels record up to GUIDE_PATH_DEPTH vertices each while training,
+                // most paths end early so this starts lower and grows when a frame overflows
+                _guideCapacity = _width * _height;
+                _guideRecordBuffer = [_device newBufferWithLength:sizeof(GuideRecord) * _guideCapacity
+                                                          options:_commonStorageMode];
+                [_guideRecordBuffer setLabel:@"_guideRecordBuffer"];
+            }
+        
+            if (_complex->integrator == Integrator::ReSTIR) {
+                
+                let _kernelReSTIRInitial = [defaultLibrary newFunctionWithName:@"kernelReSTIRInitial"];
+                _pipelineStateReSTIRInitial = [_device newComputePipelineStateWithFunction:_kernelReSTIRInitial error:&ERROR];
+                let _kernelReSTIRSpatial = [defaultLibrary newFunctionWithName:@"kernelReSTIRSpatial"];
+                _pipelineStateReSTIRSpatial = [_device newComputePipelineStateWithFunction:_kernelReSTIRSpatial error:&ERROR];
+                let _kernelReSTIRShade = [defaultLibrary newFunctionWithName:@"kernelReSTIRShade"];
+                _pipelineStateReSTIRShade = [_device newComputePipelineStateWithFunction:_kernelReSTIRShade error:&ERROR];
+                
+                // Camera hits of this frame and the last, for the reprojected history
+                _restirSurfaceBuffer = [_device newBufferWithLength:sizeof(ReSTIRSurface) * _width * _height
+                                                            options:MTLResourceStorageModePrivate];
+                _restirPreviousSurfaceBuffer = [_device newBufferWithLength:sizeof(ReSTIRSurface) * _width * _height
+                                                                    options:MTLResourceStorageModePrivate];
+                
+                // Temporal result, then the final reservoirs which are the history of the next frame
+                _restirReservoirBuffer = [_device newBufferWithLength:sizeof(ReSTIRReservoir) * _width * _height
+                                                              options:MTLResourceStorageModePrivate];
+                _restirHistoryBuffer = [_device newBufferWithLength:sizeof(ReSTIRReservoir) * _width * _height
+                                                            options:MTLResourceStorageModePrivate];
+                
+                let clearBuffer = [_commandQueue commandBuffer];
+                let blit = [clearBuffer blitCommandEncoder];
+                for (id<MTLBuffer> buffer in @[_restirSurfaceBuffer, _restirPreviousSurfaceBuffer,
+                                               _restirReservoirBuffer, _restirHistoryBuffer]) {
+                    [blit fillBuffer:buffer range:NSMakeRange(0, buffer.length) value:0];
+                }
+                [blit endEncoding];
+                [clearBuffer commit];
+            }
     }
     
     //CAMetalLayer *c = (CAMetalLayer*)view.layer;
@@ -837,10 +1333,41 @@ NSLog(@"Done  %fs", _time_e - _time_s);
     _sourceSVGF = [textureAllocatorSVGF textureWithPixelFormat:MTLPixelFormatRGBA16Float width:_width height:_height];
     _zNormalSVGF = [textureAllocatorSVGF textureWithPixelFormat:MTLPixelFormatRGBA16Float width:_width height:_height];
     _motion2DSVGF = [textureAllocatorSVGF textureWithPixelFormat:MTLPixelFormatRG16Float width:_width height:_height];
+    
+    // The Denoiser user default CPU filters with the portable SVGF instead
+    let denoiser = [NSUserDefaults.standardUserDefaults stringForKey:@"Denoiser"];
+    _cpuSVGF = [denoiser isEqualToString:@"CPU"];
+    
+    if (!_cpuSVGF) { return; }
+    
+    _svgf.resize(_width, _height);
+    
+    let pixels = _width * _height;
+    _svgfSourceBuffer = [device newBufferWithLength:pixels * 4 * sizeof(uint16_t) options:MTLResourceStorageModeShared];
+    _svgfZNormalBuffer = [device newBufferWithLength:pixels * 4 * sizeof(uint16_t) options:MTLResourceStorageModeShared];
+    _svgfMotionBuffer = [device newBufferWithLength:pixels * 2 * sizeof(uint16_t) options:MTLResourceStorageModeShared];
+    _svgfResultBuffer = [device newBufferWithLength:pixels * 4 * sizeof(uint16_t) options:MTLResourceStorageModeShared];
+    
+    let td = [MTLTextureDescriptor texture2DDescriptorWithPixelFormat:MTLPixelFormatRGBA16Float
+                                                                width:_width height:_height mipmapped:NO];
+    td.storageMode = MTLStorageModePrivate;
+    td.usage = MTLTextureUsageShaderRead;
+    _svgfResultTexture = [device newTextureWithDescriptor:td];
+    
+    _svgfEvent = [device newSharedEvent];
+    _svgfListener = [[MTLSharedEventListener alloc] initWithDispatchQueue:dispatch_queue_create("SVGF", DISPATCH_QUEUE_SERIAL)];
+    _svgfEventValue = 0;
+    
+    NSLog(@"Denoising on the CPU");
 }
 
 - (void)processAppleSVGF:(id<MTLCommandBuffer>)_commandBuffer
 {
+    if (_cpuSVGF) {
+        [self processCPUSVGF:_commandBuffer];
+        return;
+    }
+    
     _resultSVGF = [denoiserSVGF encodeToCommandBuffer:_commandBuffer
                                             sourceTexture:_sourceSVGF
                                       motionVectorTexture:_motion2DSVGF
@@ -849,6 +1376,60 @@ NSLog(@"Done  %fs", _time_e - _time_s);
     //std::swap(_zNormalSVGF, depthNormalTexture_);
 }
 
+// The GPU copies the inputs out and signals, the listener filters them and signals back,
+// which lets the GPU copy the result in and draw it
+- (void)processCPUSVGF:(id<MTLCommandBuffer>)commandBuffer
+{
+    let size = MTLSizeMake(_width, _height, 1);
+    
+    let readback = [commandBuffer blitCommandEncoder];
+    [readback copyFromTexture:_sourceSVGF sourceSlice:0 sourceLevel:0 sourceOrigin:MTLOriginMake(0, 0, 0) sourceSize:size
+                     toBuffer:_svgfSourceBuffer destinationOffset:0
+       destinationBytesPerRow:_width * 4 * sizeof(uint16_t) destinationBytesPerImage:_svgfSourceBuffer.length];
+    [readback copyFromTexture:_zNormalSVGF sourceSlice:0 sourceLevel:0 sourceOrigin:MTLOriginMake(0, 0, 0) sourceSize:size
+                     toBuffer:_svgfZNormalBuffer destinationOffset:0
+       destinationBytesPerRow:_width * 4 * sizeof(uint16_t) destinationBytesPerImage:_svgfZNormalBuffer.length];
+    [readback copyFromTexture:_motion2DSVGF sourceSlice:0 sourceLevel:0 sourceOrigin:MTLOriginMake(0, 0, 0) sourceSize:size
+                     toBuffer:_svgfMotionBuffer destinationOffset:0
+       destinationBytesPerRow:_width * 2 * sizeof(uint16_t) destinationBytesPerImage:_svgfMotionBuffer.length];
+    [readback endEncoding];
+    
+    let ready = ++_svgfEventValue;
+    let done = ++_svgfEventValue;
+    
+    [commandBuffer encodeSignalEvent:_svgfEvent value:ready];
+    
+    [_svgfEvent notifyListener:_svgfListener atValue:ready block:^(id<MTLSharedEvent> event, uint64_t value) {
+        
+        let start = [[NSDate date] timeIntervalSince1970];
+        
+        self->_svgf.denoise((const uint16_t*)self->_svgfSourceBuffer.contents,
+                            (const uint16_t*)self->_svgfZNormalBuffer.contents,
+                            (const uint16_t*)self->_svgfMotionBuffer.contents,
+                            (uint16_t*)self->_svgfResultBuffer.contents);
+        
+        self->_svgfTime += [[NSDate date] timeIntervalSince1970] - start;
+        self->_svgfFrames += 1;
+        
+        if (self->_svgfTime > 1.0) {
+            NSLog(@"CPU SVGF %.1f ms per frame on %u threads", self->_svgfTime / self->_svgfFrames * 1000, self->_svgf.workers.count());
+            self->_svgfTime = 0; self->_svgfFrames = 0;
+        }
+        
+        event.signaledValue = done;
+    }];
+    
+    [commandBuffer encodeWaitForEvent:_svgfEvent value:done];
+    
+    let upload = [commandBuffer blitCommandEncoder];
+    [upload copyFromBuffer:_svgfResultBuffer sourceOffset:0
+         sourceBytesPerRow:_width * 4 * sizeof(uint16_t) sourceBytesPerImage:_svgfResultBuffer.length sourceSize:size
+                 toTexture:_svgfResultTexture destinationSlice:0 destinationLevel:0 destinationOrigin:MTLOriginMake(0, 0, 0)];
+    [upload endEncoding];
+    
+    _resultSVGF = _svgfResultTexture;
+}
+
 static std::vector<std::vector<int>> predefined_index { { 0, 1, 2, 3 }, {1, 0, 3, 2} };
 
 #pragma mark - MetalKit View Delegate
@@ -881,12 +1462,15 @@ static std::vector<std::vector<int>> predefined_index { { 0, 1, 2, 3 }, {1, 0, 3
     [computeEncoder setBuffer:_camera_buffer      offset:0 atIndex:0];
     [computeEncoder setBuffer:_complex_buffer     offset:0 atIndex:1];
     [computeEncoder setBuffer:_cameraBoundsBuffer offset:0 atIndex:2];
-    [computeEncoder setBuffer:_cameraRecordBuffer offset:0 atIndex:3];
+    [computeEncoder setBuffer:_cameraGatherBuffer offset:0 atIndex:3];
+    [computeEncoder setBuffer:_cameraShadeBuffer  offset:0 atIndex:4];
+    [computeEncoder setBuffer:_cameraPreviousBuffer offset:0 atIndex:5];
     
     [computeEncoder useHeap:_heap];
     [computeEncoder setBuffer:_argumentBufferPri  offset:0 atIndex:7];
     [computeEncoder setBuffer:_argumentBufferEnv  offset:0 atIndex:8];
     [computeEncoder setBuffer:_argumentBufferPBR  offset:0 atIndex:9];
+    [computeEncoder setBuffer:_primaryCacheBuffer offset:0 atIndex:10];
     
     let _threadGroupSize = MTLSize {8, 8, 1};
     let _threadBatchSize = MTLSize {_width, _height, 1};
@@ -939,23 +1523,64 @@ static std::vector<std::vector<int>> predefined_index { { 0, 1, 2, 3 }, {1, 0, 3
     
     [computeEncoder setComputePipelineState:_pipelineStatePhotonRadius];
     [computeEncoder setBuffer:_complex_buffer     offset:0 atIndex:0];
-    [computeEncoder setBuffer:_cameraRecordBuffer offset:0 atIndex:1];
+    [computeEncoder setBuffer:_cameraGatherBuffer offset:0 atIndex:1];
     [computeEncoder dispatchThreads:{_width, _height, 1} threadsPerThreadgroup:{8, 8 ,1}];
     
     [computeEncoder endEncoding];
     [commandBuffer commit];
 }
 
+- (void)growPhotonRecords
+{
+    // The last frame overflowed, the records dropped then are only a small bias
+    if (_photonDeposits > _photonCapacity) {
+        
+        _photonCapacity = _photonDeposits + _photonDeposits / 4;
+        NSLog(@"Photon records grow to %u", _photonCapacity);
+        
+        _photonRecordBuffer = [_device newBufferWithLength:sizeof(PhotonPacked) * _photonCapacity
+                                                   options:_photonRecordBuffer.resourceOptions];
+        _photonEntryBuffer = [_device newBufferWithLength:sizeof(PhotonCellEntry) * _photonCapacity
+                                                  options:_photonEntryBuffer.resourceOptions];
+        _photonTreeBuffer = [_device newBufferWithLength:sizeof(PhotonKDNode) * _photonCapacity
+                                                 options:_photonTreeBuffer.resourceOptions];
+        _vcmVertexBuffer = [_device newBufferWithLength:sizeof(VCMVertex) * _photonCapacity
+                                                options:_vcmVertexBuffer.resourceOptions];
+    }
+}
+
 - (void)photonWork:(MTKView *)view
 {
+    [self growPhotonRecords];
+    
     auto commandBuffer = [_commandQueue commandBuffer]; //commandBuffer.label = @"name";
     
-    if(self->_complex->frame_count % 2) {
+    // New camera paths every pass, the first frame traced them in photonPrepare already
+    if(self->_complex->frame_count > 0) {
         [self photonPrepare:nil commandBuffer:commandBuffer];
     }
     
+    {
+        let blit = [commandBuffer blitCommandEncoder];
+        [blit fillBuffer:_photonCounterBuffer range:NSMakeRange(0, sizeof(uint32_t) * PHOTON_COUNTERS) value:0];
+        [blit fillBuffer:_photonVisibilityBuffer range:NSMakeRange(0, _photonVisibilityBuffer.length) value:0];
+        [blit endEncoding];
+    }
+    
     auto computeEncoder = [commandBuffer computeCommandEncoder];
     
+    // The cells around the new camera records are the targets of the photon chains
+    [computeEncoder setComputePipelineState:_pipelineStatePhotonVisibility];
+    [computeEncoder setBuffer:_complex_buffer         offset:0 atIndex:0];
+    [computeEncoder setBuffer:_cameraGatherBuffer     offset:0 atIndex:1];
+    [computeEncoder setBuffer:_cameraShadeBuffer      offset:0 atIndex:2];
+    [computeEncoder setBuffer:_photonVisibilityBuffer offset:0 atIndex:3];
+    [computeEncoder dispatchThreads:{_width, _height, 1} threadsPerThreadgroup:{8, 8, 1}];
+    
+    if (self->_complex->frame_count == 0) {
+        _photonUniformTotal = 0; _photonUniformVisible = 0;
+    }
+    
     [computeEncoder setComputePipelineState:_pipelineStatePhotonRecording];
     [computeEncoder setTexture:_texturePhotonRNG atIndex: 0];
     [computeEncoder setTexture:_texturePhotonRNG atIndex: 1];
@@ -963,73 +1588,173 @@ static std::vector<std::vector<int>> predefined_index { { 0, 1, 2, 3 }, {1, 0, 3
     [computeEncoder setBuffer:_camera_buffer  offset:0 atIndex:0];
     [computeEncoder setBuffer:_complex_buffer offset:0 atIndex:1];
     
-    [computeEncoder setBuffer:_photonRecordBuffer offset:0 atIndex:2];
+    [computeEncoder setBuffer:_photonRecordBuffer  offset:0 atIndex:2];
+    [computeEncoder setBuffer:_photonCounterBuffer offset:0 atIndex:3];
+    [computeEncoder setBytes:&_photonCapacity length:sizeof(uint32_t) atIndex:4];
+    
+    [computeEncoder setBuffer:_photonChainBuffer      offset:0 atIndex:5];
+    [computeEncoder setBuffer:_photonChainStateBuffer offset:0 atIndex:6];
+    [computeEncoder setBuffer:_photonVisibilityBuffer offset:0 atIndex:10];
     
     [computeEncoder useHeap:_heap];
     [computeEncoder setBuffer:_argumentBufferPri offset:0 atIndex:7];
     [computeEncoder setBuffer:_argumentBufferEnv offset:0 atIndex:8];
     [computeEncoder setBuffer:_argumentBufferPBR offset:0 atIndex:9];
     
-    [computeEncoder dispatchThreads:{photonHashN, photonHashN, 1} threadsPerThreadgroup:{8, 8, 1}];
-    
-    [computeEncoder setComputePipelineState:_pipelineStatePhotonHashing];
-    [computeEncoder setBuffer:_complex_buffer     offset:0 atIndex:1];
-    [computeEncoder setBuffer:_photonRecordBuffer offset:0 atIndex:2];
-    [computeEncoder setBuffer:_photonHashedBuffer offset:0 atIndex:3];
+    // Every pass appends to the same records, they are gathered together
+    for (uint32_t pass = 0; pass < _photonPasses; ++pass) {
+        [computeEncoder dispatchThreads:{photonPassWidth, _photonBudget / photonPassWidth, 1} threadsPerThreadgroup:{8, 8, 1}];
+    }
     
-    [computeEncoder dispatchThreads:{photonHashN, photonHashN, 1} threadsPerThreadgroup:{8, 8, 1}];
     [computeEncoder endEncoding];
     
-    //[commandBuffer commit];
-    //[commandBuffer waitUntilCompleted];
-    //commandBuffer = [_commandQueue commandBuffer];
+    if (_photonRecordBuffer.storageMode == MTLStorageModeManaged) {
+        let blit = [commandBuffer blitCommandEncoder];
+        [blit synchronizeResource:_photonRecordBuffer];
+        [blit synchronizeResource:_photonCounterBuffer];
+        [blit synchronizeResource:_photonVisibilityBuffer];
+        [blit synchronizeResource:_complex_buffer];
+        [blit endEncoding];
+    }
+    
+    // The photons have to be on the host before the grid is built
+    [commandBuffer commit];
+    [commandBuffer waitUntilCompleted];
     
-    auto _photonCountRenderEncoder = [commandBuffer renderCommandEncoderWithDescriptor:_renderPhotonCountPassDescriptor];
-    _photonCountRenderEncoder.label = @"PhotonCount Render Pass";
-    [_photonCountRenderEncoder setRenderPipelineState:_renderPhotonCountPipelineState];
-    [_photonCountRenderEncoder setVertexBuffer:_photonHashedBuffer offset:0 atIndex:0];
-    [_photonCountRenderEncoder setVertexBuffer:_photonRecordBuffer offset:0 atIndex:1];
-      
-    [_photonCountRenderEncoder drawPrimitives:MTLPrimitiveTypePoint
-                                  vertexStart:0 vertexCount:photonHashN*photonHashN];
-    [_photonCountRenderEncoder endEncoding];
+    let photonCounters = (const uint32_t*)_photonCounterBuffer.contents;
+    let photonDeposits = photonCounters[PHOTON_COUNT_DEPOSITS];
+    let photonCount = std::min(photonDeposits, _photonCapacity);
     
-    computeEncoder = [commandBuffer computeCommandEncoder];
+    let buildStart = [[NSDate date] timeIntervalSince1970];
     
-    [computeEncoder setComputePipelineState:_pipelineStatePhotonSumming];
-    [computeEncoder setBuffer:_complex_buffer offset:0 atIndex:0];
-    [computeEncoder setTexture:_texturePhotonCount atIndex:0];
-    [computeEncoder dispatchThreads:{photonHashN, photonHashN, 1} threadsPerThreadgroup:{8, 8, 1}];
-    //newTextureViewWithPixelFormat // write into mipmap
+    let photons = (const PhotonPacked*)_photonRecordBuffer.contents;
+    let useTree = _complex->photonGather == PhotonGather::KDTree;
+    
+    uint32_t hashedCount = 0;
+    
+    if (useTree) {
+        _photonMap.build(photons, photonCount, (PhotonKDNode*)_photonTreeBuffer.contents);
+        _complex->photonTreeCount = photonCount;
+    } else {
+        hashedCount = _photonGrid.build(photons, photonCount, *_complex,
+                                        (uint32_t*)_photonCellStartBuffer.contents,
+                                        (PhotonCellEntry*)_photonEntryBuffer.contents);
+    }
+    
+    _photonGridTime += [[NSDate date] timeIntervalSince1970] - buildStart;
+    _photonGridCount += photonCount;
+    
+    if (_photonCellStartBuffer.storageMode == MTLStorageModeManaged) {
+        if (useTree) {
+            [_photonTreeBuffer didModifyRange:NSMakeRange(0, sizeof(PhotonKDNode) * photonCount)];
+        } else {
+            [_photonCellStartBuffer didModifyRange:NSMakeRange(0, _photonCellStartBuffer.length)];
+            [_photonEntryBuffer didModifyRange:NSMakeRange(0, sizeof(PhotonCellEntry) * hashedCount)];
+        }
+    }
+    
+    if (_photonGridCount >= 64ull * _photonBudget * _photonPasses) {
+        NSLog(@"Photon %s build %.2f Mphotons/s", useTree ? "kd-tree" : "grid", _photonGridCount / _photonGridTime / 1e6);
+        
+        // A table close to full marks hidden points visible too, and the chains fall back to uniform
+        let visibility = (const uint32_t*)_photonVisibilityBuffer.contents;
+        uint64_t visibleBits = 0;
+        for (uint32_t i = 0; i < PHOTON_VISIBLE_BITS / 32; ++i) { visibleBits += __builtin_popcount(visibility[i]); }
+        NSLog(@"Photon visibility %.2f%% of the bits set, %.2f%% of the uniform paths visible",
+              100.0 * visibleBits / PHOTON_VISIBLE_BITS, 100.0 * _complex->photonVisibleFraction);
+        _photonGridTime = 0; _photonGridCount = 0;
+    }
+    
+    // Normalised by the chain samples, scaled by the visible share of all the uniform paths so far
+    _complex->framePhotonSum = photonCounters[PHOTON_COUNT_CHAIN];
+    
+    _photonUniformTotal += photonCounters[PHOTON_COUNT_UNIFORM];
+    _photonUniformVisible += photonCounters[PHOTON_COUNT_VISIBLE];
+    _complex->photonVisibleFraction = _photonUniformTotal > 0 ? double(_photonUniformVisible) / _photonUniformTotal : 0;
+    
+    _photonDeposits = photonDeposits;
+    
+    commandBuffer = [_commandQueue commandBuffer];
+    computeEncoder = [commandBuffer computeCommandEncoder];
     
     [computeEncoder setComputePipelineState:_pipelineStatePhotonRefine];
     [computeEncoder setBuffer:_complex_buffer     offset:0 atIndex:0];
     [computeEncoder setBuffer:_photonRecordBuffer offset:0 atIndex:1];
-    [computeEncoder setBuffer:_cameraRecordBuffer offset:0 atIndex:2];
+    [computeEncoder setBuffer:_cameraGatherBuffer offset:0 atIndex:2];
+    
+    [computeEncoder setBuffer:_photonCellStartBuffer offset:0 atIndex:3];
+    [computeEncoder setBuffer:_photonEntryBuffer     offset:0 atIndex:4];
     
-    [computeEncoder setTexture:_texturePhotonMark  atIndex:0];
-    [computeEncoder setTexture:_texturePhotonCount atIndex:1];
+    [computeEncoder setBuffer:_cameraShadeBuffer offset:0 atIndex:5];
+    [computeEncoder setBuffer:_photonTreeBuffer  offset:0 atIndex:6];
+    [computeEncoder setBuffer:_cameraDirectBuffer offset:0 atIndex:7];
     
     std::swap(_textureA, _textureB);
-    [computeEncoder setTexture:_textureA atIndex:2];
-    [computeEncoder setTexture:_textureB atIndex:3];
-    [computeEncoder setTexture:_sourceSVGF atIndex:4];
+    [computeEncoder setTexture:_textureA atIndex:0];
+    [computeEncoder setTexture:_textureB atIndex:1];
+    [computeEncoder setTexture:_sourceSVGF atIndex:2];
     
     [computeEncoder dispatchThreads:{_width, _height, 1} threadsPerThreadgroup:{8, 8, 1}];
     [computeEncoder endEncoding];
     
-    {
+    // Refine alone in its command buffer to time it, the traffic counts every camera record
+    // read and written once, every stored photon and grid entry read once
+    let refineBytes = double(_width * _height) * (2 * sizeof(CameraGather) + sizeof(CameraShade) + 2 * sizeof(simd_float4))
+                    + double(photonCount) * (sizeof(PhotonPacked) + (useTree ? sizeof(PhotonKDNode) : sizeof(PhotonCellEntry)))
+                    + (useTree ? 0 : sizeof(uint32_t) * (PHOTON_HASH_CELLS + 1));
+    
+    [commandBuffer addCompletedHandler:^(id<MTLCommandBuffer> buffer) {
+        
+        self->_refineTime += buffer.GPUEndTime - buffer.GPUStartTime;
+        self->_refineBytes += refineBytes;
+        
+        if (self->_refineTime > 1.0) {
+            NSLog(@"Photon refine %.2f GB/s, %lu+%lu bytes per camera record, %lu per photon",
+                  self->_refineBytes / self->_refineTime / 1e9,
+                  sizeof(CameraGather), sizeof(CameraShade), sizeof(PhotonPacked));
+            self->_refineTime = 0; self->_refineBytes = 0;
+        }
+    }];
+    [commandBuffer commit];
+    
+    [self present:[_commandQueue commandBuffer]];
+}
+
+// Denoises the frame in textureB and draws it, a preview is upsampled instead
+- (void)present:(id<MTLCommandBuffer>)commandBuffer
+{
+    let preview = _previewScale > 1;
+    var shown = _textureB;
+    
+    if (preview) {
+        [self previewUpsample:commandBuffer];
+        shown = _previewTexture;
+    } else {
+        [self benchmark:commandBuffer texture:_textureB];
+        
         let blit = [commandBuffer blitCommandEncoder];
         [blit generateMipmapsForTexture:_textureB];
         [blit endEncoding];
+        
+        // The history of the denoiser is from before the camera moved
+        if (_previewShown) {
+            if (_cpuSVGF) { _svgf.clear(); } else { [denoiserSVGF clearTemporalHistory]; }
+        }
+        [self processAppleSVGF:commandBuffer];
     }
-    
-    [self processAppleSVGF:commandBuffer];
+    _previewShown = preview;
     
     auto dumm = (Complex*)(_complex_buffer.contents);
     
+    let moving = _dragging;
+    let start = _previewStart;
+    let pixels = double(_width) * _height;
+    let scale = _previewScale;
+    
     [commandBuffer addCompletedHandler:^(id<MTLCommandBuffer> buffer) {
         
+        let seconds = [[NSDate date] timeIntervalSince1970] - start;
+        
         dumm->totalPhotonSum += dumm->framePhotonSum;
         dumm->framePhotonSum = 0;
         dumm->frame_count += 1;
@@ -1041,6 +1766,9 @@ static std::vector<std::vector<int>> predefined_index { { 0, 1, 2, 3 }, {1, 0, 3
         
         //[self drag:simd_make_float2(1, 0) state:NO];
         [[NSOperationQueue mainQueue] addOperationWithBlock:^{
+            // The controller reads the times on the main thread
+            if (moving) { [self previewMeasure:seconds pixels:pixels scale:scale]; }
+            
             #if TARGET_OS_OSX
                 self->_view.needsDisplay = YES;
             #else
@@ -1063,8 +1791,8 @@ static std::vector<std::vector<int>> predefined_index { { 0, 1, 2, 3 }, {1, 0, 3
     
     [renderEncoder setFragmentBuffer:_complex_buffer offset:0 atIndex:0];
     [renderEncoder setFragmentTexture:_textureA atIndex:0];
-    [renderEncoder setFragmentTexture:_textureB atIndex:1];
-    [renderEncoder setFragmentTexture:_resultSVGF atIndex: 2];
+    [renderEncoder setFragmentTexture:shown atIndex:1];
+    [renderEncoder setFragmentTexture:preview ? shown : _resultSVGF atIndex: 2];
     
     [renderEncoder drawPrimitives:MTLPrimitiveTypeTriangle vertexStart:0 vertexCount:6];
     [renderEncoder endEncoding];
@@ -1101,17 +1829,487 @@ static std::vector<std::vector<int>> predefined_index { { 0, 1, 2, 3 }, {1, 0, 3
 //    }
 }
 
+// Vertex connection and merging: light paths first, their vertices hashed on the host, then
+// camera paths connecting to and merging with them. Without merging it is bidirectional path tracing.
+- (void)vcm:(MTKView *)view
+{
+    let time = [[NSDate date] timeIntervalSince1970];
+    _complex->running_time = time - launchTime;
+    
+    [self growPhotonRecords];
+    
+    auto commandBuffer = [_commandQueue commandBuffer];
+    
+    {
+        let blit = [commandBuffer blitCommandEncoder];
+        [blit fillBuffer:_photonCounterBuffer range:NSMakeRange(0, sizeof(uint32_t)) value:0];
+        [blit endEncoding];
+    }
+    
+    auto computeEncoder = [commandBuffer computeCommandEncoder];
+    
+    if (_complex->frame_count == 0) {
+        memcpy(_camera_buffer.contents, &_camera, sizeof(Camera));
+        
+        // Camera paths merge anywhere in the scene, the grid and first radius follow its bounds
+        [computeEncoder setComputePipelineState:_pipelineStatePhotonParams];
+        [computeEncoder setBuffer:_complex_buffer offset:0 atIndex:0];
+        [computeEncoder setBuffer:_sceneBoxBuffer offset:0 atIndex:1];
+        [computeEncoder dispatchThreads:{1, 1, 1} threadsPerThreadgroup:{1, 1, 1}];
+    }
+    
+    [computeEncoder setComputePipelineState:_pipelineStateVCMLight];
+    [computeEncoder setTexture:_textureCanvasRNG atIndex:0];
+    [computeEncoder setTexture:_textureCanvasRNG atIndex:1];
+    
+    [computeEncoder setBuffer:_complex_buffer      offset:0 atIndex:1];
+    [computeEncoder setBuffer:_photonRecordBuffer  offset:0 atIndex:2];
+    [computeEncoder setBuffer:_photonCounterBuffer offset:0 atIndex:3];
+    [computeEncoder setBytes:&_photonCapacity length:sizeof(uint32_t) atIndex:4];
+    [computeEncoder setBuffer:_vcmVertexBuffer    offset:0 atIndex:5];
+    [computeEncoder setBuffer:_vcmPathRangeBuffer offset:0 atIndex:6];
+    
+    [computeEncoder useHeap:_heap];
+    [computeEncoder setBuffer:_argumentBufferPri offset:0 atIndex:7];
+    [computeEncoder setBuffer:_argumentBufferEnv offset:0 atIndex:8];
+    
+    [computeEncoder dispatchThreads:{_width, _height, 1} threadsPerThreadgroup:{8, 8, 1}];
+    [computeEncoder endEncoding];
+    
+    if (_photonRecordBuffer.storageMode == MTLStorageModeManaged) {
+        let blit = [commandBuffer blitCommandEncoder];
+        [blit synchronizeResource:_photonRecordBuffer];
+        [blit synchronizeResource:_photonCounterBuffer];
+        [blit synchronizeResource:_complex_buffer];
+        [blit endEncoding];
+    }
+    
+    // The light vertices have to be on the host before the grid is built
+    [commandBuffer commit];
+    [commandBuffer waitUntilCompleted];
+    
+    let lightDeposits = *(const uint32_t*)_photonCounterBuffer.contents;
+    let lightCount = std::min(lightDeposits, _photonCapacity);
+    
+    // Bidirectional path tracing only connects, the grid is left as it was
+    if (_complex->integrator == Integrator::VCM) {
+        
+        let hashedCount = _photonGrid.build((const PhotonPacked*)_photonRecordBuffer.contents, lightCount, *_complex,
+                                            (uint32_t*)_photonCellStartBuffer.contents,
+                                            (PhotonCellEntry*)_photonEntryBuffer.contents);
+        
+        if (_photonCellStartBuffer.storageMode == MTLStorageModeManaged) {
+            [_photonCellStartBuffer didModifyRange:NSMakeRange(0, _photonCellStartBuffer.length)];
+            [_photonEntryBuffer didModifyRange:NSMakeRange(0, sizeof(PhotonCellEntry) * hashedCount)];
+        }
+    }
+    
+    _photonDeposits = lightDeposits;
+    
+    commandBuffer = [_commandQueue commandBuffer];
+    computeEncoder = [commandBuffer computeCommandEncoder];
+    
+    [computeEncoder setComputePipelineState:_pipelineStateVCMCamera];
+    
+    std::swap(_textureA, _textureB);
+    [computeEncoder setTexture:_textureA atIndex:0];
+    [computeEncoder setTexture:_textureB atIndex:1];
+    [computeEncoder setTexture:_sourceSVGF atIndex:2];
+    
+    [computeEncoder setTexture:_zNormalSVGF atIndex:3];
+    [computeEncoder setTexture:_motion2DSVGF atIndex:4];
+    
+    [computeEncoder setTexture:_textureCanvasRNG atIndex:5];
+    [computeEncoder setTexture:_textureCanvasRNG atIndex:6];
+    
+    [computeEncoder setBuffer:_camera_buffer         offset:0 atIndex:0];
+    [computeEncoder setBuffer:_complex_buffer        offset:0 atIndex:1];
+    [computeEncoder setBuffer:_photonRecordBuffer    offset:0 atIndex:2];
+    [computeEncoder setBuffer:_vcmVertexBuffer       offset:0 atIndex:3];
+    [computeEncoder setBuffer:_vcmPathRangeBuffer    offset:0 atIndex:4];
+    [computeEncoder setBuffer:_photonCellStartBuffer offset:0 atIndex:5];
+    [computeEncoder setBuffer:_photonEntryBuffer     offset:0 atIndex:6];
+    
+    [computeEncoder useHeap:_heap];
+    [computeEncoder setBuffer:_argumentBufferPri offset:0 atIndex:7];
+    [computeEncoder setBuffer:_argumentBufferEnv offset:0 atIndex:8];
+    [computeEncoder setBuffer:_cameraPreviousBuffer offset:0 atIndex:11];
+    
+    [computeEncoder dispatchThreads:{_width, _height, 1} threadsPerThreadgroup:{8, 8, 1}];
+    [computeEncoder endEncoding];
+    
+    [self present:commandBuffer];
+}
+
+// Uploads the flattened SD-tree, it only changes shape at the end of a training iteration
+- (void)guideUpload
+{
+    let& spatial = _guideTree.spatialNodes;
+    let& quads = _guideTree.quadNodes;
+    
+    _guideSpatialBuffer = [_device newBufferWithBytes:spatial.data()
+                                               length:sizeof(GuideSpatialNode) * spatial.size()
+                                              options:MTLResourceStorageModeShared];
+    [_guideSpatialBuffer setLabel:@"_guideSpatialBuffer"];
+    
+    _guideQuadBuffer = [_device newBufferWithBytes:quads.data()
+                                            length:sizeof(GuideQuadNode) * quads.size()
+                                           options:MTLResourceStorageModeShared];
+    [_guideQuadBuffer setLabel:@"_guideQuadBuffer"];
+}
+
+// Path tracing guided by an SD-tree. Training iterations of 1, 2, 4 ... frames record the radiance
+// the paths find, the host learns the next trees from it and the image restarts with each of them.
+- (void)guide:(MTKView *)view
+{
+    let time = [[NSDate date] timeIntervalSince1970];
+    _complex->running_time = time - launchTime;
+    
+    if (_guideSpatialBuffer == nil) {
+        _guideTree.reset(*(const AABB*)_sceneBoxBuffer.contents);
+        [self guideUpload];
+        
+        _guideIteration = 0; _guideFrames = 0;
+        _complex->guideTraining = 1;
+    }
+    
+    if (_complex->guideTraining && _guideFrames == (1u << _guideIteration)) {
+        
+        _guideTree.refine(_guideIteration);
+        [self guideUpload];
+        
+        NSLog(@"Guide iteration %u: %lu spatial nodes, %lu quadtree nodes, %fs", _guideIteration,
+              _guideTree.spatialNodes.size(), _guideTree.quadNodes.size(), [[NSDate date] timeIntervalSince1970] - time);
+        
+        _guideIteration += 1; _guideFrames = 0;
+        _complex->guideTraining = _guideIteration < GUIDE_TRAINING_ITERATIONS;
+        _complex->frame_count = 0;
+    }
+    
+    let training = _complex->guideTraining != 0;
+    
+    if (_complex->frame_count == 0) {
+        memcpy(_camera_buffer.contents, &_camera, sizeof(Camera));
+    }
+    
+    auto commandBuffer = [_commandQueue commandBuffer];
+    
+    if (training) {
+        let blit = [commandBuffer blitCommandEncoder];
+        [blit fillBuffer:_photonCounterBuffer range:NSMakeRange(0, sizeof(uint32_t)) value:0];
+        [blit endEncoding];
+    }
+    
+    let computeEncoder = [commandBuffer computeCommandEncoder];
+    [computeEncoder setComputePipelineState:_pipelineStatePathGuiding];
+    
+    std::swap(_textureA, _textureB);
+    [computeEncoder setTexture:_textureA atIndex:0];
+    [computeEncoder setTexture:_textureB atIndex:1];
+    [computeEncoder setTexture:_sourceSVGF atIndex:2];
+    
+    [computeEncoder setTexture:_zNormalSVGF atIndex:3];
+    [computeEncoder setTexture:_motion2DSVGF atIndex:4];
+    
+    [computeEncoder setTexture:_textureCanvasRNG atIndex:5];
+    [computeEncoder setTexture:_textureCanvasRNG atIndex:6];
+    
+    [computeEncoder setBuffer:_camera_buffer       offset:0 atIndex:0];
+    [computeEncoder setBuffer:_complex_buffer      offset:0 atIndex:1];
+    [computeEncoder setBuffer:_guideSpatialBuffer  offset:0 atIndex:2];
+    [computeEncoder setBuffer:_guideQuadBuffer     offset:0 atIndex:3];
+    [computeEncoder setBuffer:_guideRecordBuffer   offset:0 atIndex:4];
+    [computeEncoder setBuffer:_photonCounterBuffer offset:0 atIndex:5];
+    [computeEncoder setBytes:&_guideCapacity length:sizeof(uint32_t) atIndex:6];
+    
+    [computeEncoder useHeap:_heap];
+    [computeEncoder setBuffer:_argumentBufferPri offset:0 atIndex:7];
+    [computeEncoder setBuffer:_argumentBufferEnv offset:0 atIndex:8];
+    [computeEncoder setBuffer:_sceneBoxBuffer    offset:0 atIndex:10];
+    [computeEncoder setBuffer:_cameraPreviousBuffer offset:0 atIndex:11];
+    
+    [computeEncoder dispatchThreads:{_width, _height, 1} threadsPerThreadgroup:{8, 8, 1}];
+    [computeEncoder endEncoding];
+    
+    if (training) {
+        
+        if (_guideRecordBuffer.storageMode == MTLStorageModeManaged) {
+            let blit = [commandBuffer blitCommandEncoder];
+            [blit synchronizeResource:_guideRecordBuffer];
+            [blit synchronizeResource:_photonCounterBuffer];
+            [blit endEncoding];
+        }
+        
+        // The records are learned from before the next frame guides with the new fractions
+        [commandBuffer commit];
+        [commandBuffer waitUntilCompleted];
+        
+        let count = *(const uint32_t*)_photonCounterBuffer.contents;
+        
+        // The threads dispatched last lost their records, whole blocks of the screen the trees would
+        // miss, so an overflowing frame isn't learned from and the next one has room for all
+        if (count > _guideCapacity) {
+            
+            _guideCapacity = count + count / 4;
+            NSLog(@"Guide records grow to %u", _guideCapacity);
+            
+            _guideRecordBuffer = [_device newBufferWithLength:sizeof(GuideRecord) * _guideCapacity
+                                                      options:_guideRecordBuffer.resourceOptions];
+            [_guideRecordBuffer setLabel:@"_guideRecordBuffer"];
+        } else {
+            _guideTree.record((const GuideRecord*)_guideRecordBuffer.contents, count);
+            _guideTree.fractions((GuideSpatialNode*)_guideSpatialBuffer.contents);
+            _guideFrames += 1;
+        }
+        
+        commandBuffer = [_commandQueue commandBuffer];
+    }
+    
+    [self present:commandBuffer];
+}
+
+// Path tracing with the direct light of the camera hits resampled from reservoirs, reused across
+// neighbouring pixels and through the previous camera from the last frame
+- (void)restir:(MTKView *)view
+{
+    let time = [[NSDate date] timeIntervalSince1970];
+    _complex->running_time = time - launchTime;
+    
+    memcpy(_camera_buffer.contents, &_camera, sizeof(Camera));
+    
+    std::swap(_restirSurfaceBuffer, _restirPreviousSurfaceBuffer);
+    
+    let commandBuffer = [_commandQueue commandBuffer];
+    
+    // The surfaces of another resolution don't line up with the pixels, like the zeroed ones they match nothing
+    if (_restirScale != _previewScale) {
+        let blit = [commandBuffer blitCommandEncoder];
+        [blit fillBuffer:_restirPreviousSurfaceBuffer range:NSMakeRange(0, _restirPreviousSurfaceBuffer.length) value:0];
+        [blit endEncoding];
+        _restirScale = _previewScale;
+    }
+    let computeEncoder = [commandBuffer computeCommandEncoder];
+    
+    [computeEncoder useHeap:_heap];
+    [computeEncoder setBuffer:_argumentBufferPri offset:0 atIndex:7];
+    [computeEncoder setBuffer:_argumentBufferEnv offset:0 atIndex:8];
+    [computeEncoder setBuffer:_argumentBufferPBR offset:0 atIndex:9];
+    
+    [computeEncoder setTexture:_textureCanvasRNG atIndex:0];
+    [computeEncoder setTexture:_textureCanvasRNG atIndex:1];
+    
+    [computeEncoder setComputePipelineState:_pipelineStateReSTIRInitial];
+    [computeEncoder setBuffer:_camera_buffer               offset:0 atIndex:0];
+    [computeEncoder setBuffer:_complex_buffer              offset:0 atIndex:1];
+    [computeEncoder setBuffer:_cameraPreviousBuffer        offset:0 atIndex:2];
+    [computeEncoder setBuffer:_restirSurfaceBuffer         offset:0 atIndex:3];
+    [computeEncoder setBuffer:_restirPreviousSurfaceBuffer offset:0 atIndex:4];
+    [computeEncoder setBuffer:_restirHistoryBuffer         offset:0 atIndex:5];
+    [computeEncoder setBuffer:_restirReservoirBuffer       offset:0 atIndex:6];
+    [computeEncoder dispatchThreads:{_width, _height, 1} threadsPerThreadgroup:{8, 8, 1}];
+    
+    [computeEncoder setComputePipelineState:_pipelineStateReSTIRSpatial];
+    [computeEncoder setBuffer:_restirReservoirBuffer offset:0 atIndex:5];
+    [computeEncoder setBuffer:_restirHistoryBuffer   offset:0 atIndex:6];
+    [computeEncoder dispatchThreads:{_width, _height, 1} threadsPerThreadgroup:{8, 8, 1}];
+    
+    [computeEncoder setComputePipelineState:_pipelineStateReSTIRShade];
+    
+    std::swap(_textureA, _textureB);
+    [computeEncoder setTexture:_textureA atIndex:0];
+    [computeEncoder setTexture:_textureB atIndex:1];
+    [computeEncoder setTexture:_sourceSVGF atIndex:2];
+    
+    [computeEncoder setTexture:_zNormalSVGF atIndex:3];
+    [computeEncoder setTexture:_motion2DSVGF atIndex:4];
+    
+    [computeEncoder setTexture:_textureCanvasRNG atIndex:5];
+    [computeEncoder setTexture:_textureCanvasRNG atIndex:6];
+    
+    [computeEncoder dispatchThreads:{_width, _height, 1} threadsPerThreadgroup:{8, 8, 1}];
+    [computeEncoder endEncoding];
+    
+    [self present:commandBuffer];
+}
+
+// Once BenchmarkSeconds have passed since the last reset, writes the accumulated image as a PFM,
+// so the integrators can be compared at equal time
+- (void)benchmark:(id<MTLCommandBuffer>)commandBuffer texture:(id<MTLTexture>)texture
+{
+    if (_benchmarkSeconds <= 0) { return; }
+    
+    let now = [[NSDate date] timeIntervalSince1970];
+    
+    if (_complex->frame_count == 0) {
+        _benchmarkStart = now;
+        _benchmarkDone = NO;
+    }
+    if (_benchmarkDone || now - _benchmarkStart < _benchmarkSeconds) { return; }
+    _benchmarkDone = YES;
+    
+    let width = texture.width, height = texture.height;
+    
+    if (_benchmarkBuffer == nil) {
+        _benchmarkBuffer = [_device newBufferWithLength:sizeof(float4) * width * height
+                                                options:MTLResourceStorageModeShared];
+    }
+    
+    let blit = [commandBuffer blitCommandEncoder];
+    [blit copyFromTexture:texture sourceSlice:0 sourceLevel:0
+             sourceOrigin:{0, 0, 0} sourceSize:{width, height, 1}
+                 toBuffer:_benchmarkBuffer destinationOffset:0
+   destinationBytesPerRow:sizeof(float4) * width destinationBytesPerImage:sizeof(float4) * width * height];
+    [blit endEncoding];
+    
+    static const char* names[] = { "VCM", "BDPT", "SPPM", "PathTracing", "PathGuiding", "ReSTIR" };
+    let name = names[(int)_complex->integrator];
+    
+    let frames = _complex->frame_count + 1;
+    let elapsed = now - _benchmarkStart;
+    
+    let folder = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES).firstObject;
+    let path = [folder stringByAppendingPathComponent:[NSString stringWithFormat:@"%s-%.0fs.pfm", name, _benchmarkSeconds]];
+    
+    let pixels = (const float4*)_benchmarkBuffer.contents;
+    
+    [commandBuffer addCompletedHandler:^(id<MTLCommandBuffer> buffer) {
+        
+        FILE* file = fopen(path.UTF8String, "wb");
+        if (file == nullptr) { return; }
+        
+        // Bottom row first, little endian
+        fprintf(file, "PF\n%lu %lu\n-1.0\n", width, height);
+        std::vector<float> row(3 * width);
+        
+        for (NSUInteger y = height; y-- > 0;) {
+            for (NSUInteger x = 0; x < width; ++x) {
+                let& p = pixels[y * width + x];
+                row[3 * x] = p.x; row[3 * x + 1] = p.y; row[3 * x + 2] = p.z;
+            }
+            fwrite(row.data(), sizeof(float), row.size(), file);
+        }
+        fclose(file);
+        
+        NSLog(@"Benchmark %s: %u frames in %.2fs, %.2f ms per frame, %@", name, frames, elapsed, 1000 * elapsed / frames, path);
+    }];
+}
+
 - (void)drawInMTKView:(nonnull MTKView *)view
 {
     @autoreleasepool {
-        //[self render:view];
-        [self photon:view];
+        // The view of the last frame, what the motion vectors of this one are measured from
+        memcpy(_cameraPreviousBuffer.contents, _camera_buffer.contents, sizeof(Camera));
+        
+        [self previewChoose];
+        if (_previewScale > 1) { [self previewSwap]; }
+        
+        switch (_complex->integrator) {
+            case Integrator::PathTracing: [self render:view]; break;
+            case Integrator::SPPM: [self photon:view]; break;
+            case Integrator::PathGuiding: [self guide:view]; break;
+            case Integrator::ReSTIR: [self restir:view]; break;
+            // VCM and BDPT
+            default: [self vcm:view];
+        }
+        
+        if (_previewScale > 1) { [self previewSwap]; }
     }
 }
 
+// Scale of this frame, the finest that fits in the target time. A frame costs a fixed part, the photon
+// passes or light paths that don't shrink with the preview, and a part per pixel, fitted to the times
+// of the scales measured so far; one scale alone is taken as all per pixel. A finer scale than the last
+// has to fit with some room, so the scale doesn't flicker between two.
+- (void)previewChoose
+{
+    uint32_t scale = 1;
+    
+    double n = 0, sp = 0, st = 0, spp = 0, spt = 0;
+    for (int i = 0; i < 3; ++i) {
+        if (_previewTime[i] <= 0) { continue; }
+        let p = _previewPixels[i], t = _previewTime[i];
+        n += 1; sp += p; st += t; spp += p * p; spt += p * t;
+    }
+    
+    double fixed = 0, perPixel = 0;
+    
+    if (n > 1 && n * spp - sp * sp > 0) {
+        perPixel = MAX(0, (n * spt - sp * st) / (n * spp - sp * sp));
+        fixed = MAX(0, (st - perPixel * sp) / n);
+    } else if (n > 0) {
+        perPixel = st / sp;
+    }
+    
+    if (_dragging && n > 0) {
+        
+        let pixels = double(_width) * _height;
+        auto frame = [&](uint32_t s) { return fixed + perPixel * pixels / (s * s); };
+        
+        scale = 0;
+        for (uint32_t s = 1; s <= 4 && scale == 0; s *= 2) {
+            let room = s < _previewScale ? 0.8 : 1.0;
+            if (frame(s) <= room * _previewFrameTime) { scale = s; }
+        }
+        // The fixed part alone misses the target, fewer pixels are only worth what they save
+        for (uint32_t s = 1; s <= 4 && scale == 0; s *= 2) {
+            if (frame(s) <= 1.25 * frame(4)) { scale = s; }
+        }
+    }
+    
+    if (scale != _previewScale) {
+        NSLog(@"Preview at 1/%u of the resolution, %.2f ms fixed and %.2f ms per megapixel",
+              scale * scale, fixed * 1e3, perPixel * 1e9);
+    }
+    
+    _previewScale = scale;
+    _previewStart = [[NSDate date] timeIntervalSince1970];
+}
+
+// Exchanges the full resolution targets with the preview ones of the scale, before and after the frame
+- (void)previewSwap
+{
+    auto& preview = _preview[_previewScale == 2 ? 0 : 1];
+    
+    std::swap(_textureA, preview.a);
+    std::swap(_textureB, preview.b);
+    std::swap(_textureCanvasRNG, preview.rng);
+    
+    std::swap(_sourceSVGF, preview.source);
+    std::swap(_zNormalSVGF, preview.zNormal);
+    std::swap(_motion2DSVGF, preview.motion);
+    
+    std::swap(_width, preview.width);
+    std::swap(_height, preview.height);
+}
+
+// From the start of a moving frame to the end of its last command buffer, smoothed over a few frames
+- (void)previewMeasure:(double)seconds pixels:(double)pixels scale:(uint32_t)scale
+{
+    let i = scale == 1 ? 0 : scale == 2 ? 1 : 2;
+    _previewTime[i] = _previewTime[i] > 0 ? 0.75 * _previewTime[i] + 0.25 * seconds : seconds;
+    _previewPixels[i] = pixels;
+}
+
+- (void)previewUpsample:(id<MTLCommandBuffer>)commandBuffer
+{
+    let computeEncoder = [commandBuffer computeCommandEncoder];
+    [computeEncoder setComputePipelineState:_pipelineStatePreviewUpsample];
+    [computeEncoder setTexture:_textureB atIndex:0];
+    [computeEncoder setTexture:_zNormalSVGF atIndex:1];
+    [computeEncoder setTexture:_previewTexture atIndex:2];
+    [computeEncoder dispatchThreads:{_previewTexture.width, _previewTexture.height, 1} threadsPerThreadgroup:{8, 8, 1}];
+    [computeEncoder endEncoding];
+    
+    // The exposure reads the last level
+    let blit = [commandBuffer blitCommandEncoder];
+    [blit generateMipmapsForTexture:_previewTexture];
+    [blit endEncoding];
+}
+
 - (void)pin:(float2)delta state:(BOOL)ended
 {
     _dragging = !ended;
+    _complex->restirTemporalCap = ended ? RESTIR_TEMPORAL_CAP : RESTIR_MOVING_CAP;
     let ratio = delta / _complex->view_size;
     
     _camera_rotation += ratio;
@@ -1124,6 +2322,7 @@ static std::vector<std::vector<int>> predefined_index { { 0, 1, 2, 3 }, {1, 0, 3
 - (void)drag:(float3)delta state:(BOOL)ended
 {
     _dragging = !ended;
+    _complex->restirTemporalCap = ended ? RESTIR_TEMPORAL_CAP : RESTIR_MOVING_CAP;
     _camera_offset += delta;
     
     _complex->reset();
@@ -1144,8 +2343,16 @@ static std::vector<std::vector<int>> predefined_index { { 0, 1, 2, 3 }, {1, 0, 3
             [blit endEncoding];
         }
     
+    let moving = _dragging;
+    let start = _previewStart;
+    let pixels = double(_width) * _height;
+    let scale = _previewScale;
+    
     //__weak AAPLRenderer *weakSelf = self;
     [commandBuffer addCompletedHandler:^(id<MTLCommandBuffer> buffer) {
+        
+        let seconds = [[NSDate date] timeIntervalSince1970] - start;
+        
         // not on main thread
         if (self->_dragging) {
             self->_complex->frame_count = 0;
@@ -1156,6 +2363,9 @@ static std::vector<std::vector<int>> predefined_index { { 0, 1, 2, 3 }, {1, 0, 3
         
         //[self drag:simd_make_float2(1, 0) state:NO];
         [[NSOperationQueue mainQueue] addOperationWithBlock:^{
+            // The controller reads the times on the main thread
+            if (moving) { [self previewMeasure:seconds pixels:pixels scale:scale]; }
+            
             #if TARGET_OS_OSX
                 self->_view.needsDisplay = YES;
             #else
@@ -1188,6 +2398,7 @@ static std::vector<std::vector<int>> predefined_index { { 0, 1, 2, 3 }, {1, 0, 3
     [computeEncoder setBuffer:_argumentBufferPri offset:0 atIndex:7];
     [computeEncoder setBuffer:_argumentBufferEnv offset:0 atIndex:8];
     [computeEncoder setBuffer:_argumentBufferPBR offset:0 atIndex:9];
+    [computeEncoder setBuffer:_primaryCacheBuffer offset:0 atIndex:10];
     
     let _threadGroupSize = MTLSizeMake(8, 8, 1);
     let _threadGridSize = MTLSize {_textureA.width, _textureA.height, 1};
@@ -1195,6 +2406,8 @@ static std::vector<std::vector<int>> predefined_index { { 0, 1, 2, 3 }, {1, 0, 3
     [computeEncoder dispatchThreads:_threadGridSize threadsPerThreadgroup:_threadGroupSize];
     [computeEncoder endEncoding];
     
+    [self benchmark:commandBuffer texture:(_complex->frame_count % 2) ? _textureA : _textureB];
+    
 //    {
 //        let w = _computePipelineState.threadExecutionWidth
 //        let h = _computePipelineState.maxTotalThreadsPerThreadgroup / w
@@ -0,0 +1,238 @@
+#ifndef GuideTree_h
+#define GuideTree_h
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "Common.hh"
+#include "PathGuiding.hh"
+
+// Directional quadtree of a spatial leaf, node 0 is the root
+struct GuideDTree {
+
+    std::vector<GuideQuadNode> nodes { GuideQuadNode {} };
+
+    static GuideDTree uniform() {
+        GuideDTree tree;
+        for (int q = 0; q < 4; ++q) { tree.nodes[0].sum[q] = 1; }
+        return tree;
+    }
+
+    void deposit(float2 p, float value) {
+        for (uint32_t i = 0;;) {
+            uint32_t qx = p.x >= 0.5, qy = p.y >= 0.5;
+            uint32_t q = qx | (qy << 1);
+
+            auto& node = nodes[i];
+            if (node.child[q] == 0) { node.sum[q] += value; return; }
+
+            p = p * 2 - simd_make_float2(qx, qy);
+            i = node.child[q];
+        }
+    }
+
+    // Deposits only reach the leaf quadrants, the sums of the inner ones are filled bottom up
+    float build(uint32_t i = 0) {
+        float total = 0;
+        for (int q = 0; q < 4; ++q) {
+            if (nodes[i].child[q] != 0) { nodes[i].sum[q] = build(nodes[i].child[q]); }
+            total += nodes[i].sum[q];
+        }
+        return total;
+    }
+
+    // Structure of the next iteration, subdivided where this one found energy, nothing deposited
+    GuideDTree refined() const {
+        GuideDTree out;
+        let& root = nodes[0];
+        let total = root.sum[0] + root.sum[1] + root.sum[2] + root.sum[3];
+        refine(root, 0, 1, total, out);
+        return out;
+    }
+
+private:
+
+    void refine(GuideQuadNode source, uint32_t target, uint32_t depth, float total, GuideDTree& out) const {
+
+        for (int q = 0; q < 4; ++q) {
+
+            if (total <= 0 || source.sum[q] / total <= GUIDE_QUAD_FRACTION || depth >= GUIDE_QUAD_DEPTH) { continue; }
+
+            // A leaf quadrant hands its energy evenly to the children it gets
+            GuideQuadNode child {};
+            if (source.child[q] != 0) {
+                child = nodes[source.child[q]];
+            } else {
+                for (int c = 0; c < 4; ++c) { child.sum[c] = source.sum[q] / 4; }
+            }
+
+            let index = (uint32_t)out.nodes.size();
+            out.nodes.push_back({});
+            out.nodes[target].child[q] = index;
+
+            refine(child, index, depth + 1, total, out);
+        }
+    }
+};
+
+// Spatial binary tree of directional quadtrees, trained on the host from the records of the camera paths.
+// Every leaf guides with the quadtree learned in the last iteration while it fills the next one.
+struct GuideTree {
+
+    struct Node {
+        uint32_t child = 0;
+        uint32_t axis = 0;
+        uint32_t samples = 0;
+
+        GuideDTree sampling = GuideDTree::uniform();
+        GuideDTree building;
+
+        // Logit of the BXDF fraction with its Adam moments, Müller, Practical Path Guiding in Production
+        float theta = 0, m = 0, v = 0;
+        uint32_t steps = 0;
+
+        double gradient = 0;
+        uint32_t gradientCount = 0;
+    };
+
+    AABB box;
+    std::vector<Node> nodes;
+
+    std::vector<GuideSpatialNode> spatialNodes;
+    std::vector<GuideQuadNode> quadNodes;
+
+    void reset(const AABB& sceneBox) {
+        box = sceneBox;
+        nodes.assign(1, Node {});
+        flatten();
+    }
+
+    uint32_t leafOf(float3 p) const {
+        var mini = box.mini, maxi = box.maxi;
+        uint32_t i = 0;
+        while (nodes[i].child != 0) {
+            let axis = nodes[i].axis;
+            let mid = (mini[axis] + maxi[axis]) / 2;
+            if (p[axis] < mid) {
+                maxi[axis] = mid; i = nodes[i].child;
+            } else {
+                mini[axis] = mid; i = nodes[i].child + 1;
+            }
+        }
+        return i;
+    }
+
+    static float fraction(float theta) {
+        return std::clamp(1.0f / (1.0f + std::exp(-theta)), 0.05f, 0.95f);
+    }
+
+    // Deposits the records of a frame and takes an Adam step on the BXDF fraction of every leaf they reached,
+    // descending the KL divergence between the mixture and f cos Li
+    void record(const GuideRecord* records, uint32_t count) {
+
+        for (uint32_t i = 0; i < count; ++i) {
+
+            let& r = records[i];
+            auto& node = nodes[leafOf(simd_make_float3(r.position.x, r.position.y, r.position.z))];
+
+            if (!std::isfinite(r.radiance) || !std::isfinite(r.product)) { continue; }
+
+            node.building.deposit(r.direction, r.radiance);
+            node.samples += 1;
+
+            let alpha = fraction(node.theta);
+            let mix = alpha * r.bsdfPDF + (1 - alpha) * r.guidePDF;
+            if (mix <= 0) { continue; }
+
+            node.gradient += -r.product * (r.bsdfPDF - r.guidePDF) / mix * alpha * (1 - alpha);
+            node.gradientCount += 1;
+        }
+
+        const float rate = 0.01, beta1 = 0.9, beta2 = 0.999, epsilon = 1e-8, regularization = 0.01;
+
+        for (auto& node : nodes) {
+            if (node.gradientCount == 0) { continue; }
+
+            let g = float(node.gradient / node.gradientCount) + regularization * node.theta;
+            node.gradient = 0; node.gradientCount = 0;
+
+            node.steps += 1;
+            node.m = beta1 * node.m + (1 - beta1) * g;
+            node.v = beta2 * node.v + (1 - beta2) * g * g;
+
+            let mHat = node.m / (1 - std::pow(beta1, (float)node.steps));
+            let vHat = node.v / (1 - std::pow(beta2, (float)node.steps));
+            node.theta -= rate * mHat / (std::sqrt(vHat) + epsilon);
+        }
+    }
+
+    // End of a training iteration: leaves that saw enough samples split, the quadtrees filled
+    // become the sampling ones and the next are refined from them
+    void refine(uint32_t iteration) {
+
+        for (auto& node : nodes) {
+            if (node.child == 0) { node.building.build(); }
+        }
+
+        let threshold = GUIDE_SPATIAL_THRESHOLD * std::sqrt(std::pow(2.0f, (float)iteration));
+
+        // Children are visited too, they keep splitting while half the samples is above the threshold
+        for (size_t i = 0; i < nodes.size(); ++i) {
+
+            if (nodes[i].child != 0 || nodes[i].samples <= threshold) { continue; }
+
+            var child = nodes[i];
+            child.axis = (nodes[i].axis + 1) % 3;
+            child.samples = nodes[i].samples / 2;
+
+            nodes[i].child = (uint32_t)nodes.size();
+            nodes[i].building = {}; nodes[i].sampling = {};
+
+            nodes.push_back(child);
+            nodes.push_back(child);
+        }
+
+        for (auto& node : nodes) {
+            if (node.child != 0) { continue; }
+            node.sampling = std::move(node.building);
+            node.building = node.sampling.refined();
+            node.samples = 0;
+        }
+
+        flatten();
+    }
+
+    // The GPU layout, every sampling quadtree is appended with its child indices offset
+    void flatten() {
+
+        spatialNodes.resize(nodes.size());
+        quadNodes.clear();
+
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            let& node = nodes[i];
+            spatialNodes[i] = { node.child, node.axis, 0, fraction(node.theta) };
+
+            if (node.child != 0) { continue; }
+
+            let base = (uint32_t)quadNodes.size();
+            spatialNodes[i].quadRoot = base;
+
+            for (auto q : node.sampling.nodes) {
+                for (int c = 0; c < 4; ++c) {
+                    if (q.child[c] != 0) { q.child[c] += base; }
+                }
+                quadNodes.push_back(q);
+            }
+        }
+    }
+
+    // Only the fractions change between iterations
+    void fractions(GuideSpatialNode* gpu) const {
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            gpu[i].bsdfFraction = fraction(nodes[i].theta);
+        }
+    }
+};
+
+#endif /* GuideTree_h */
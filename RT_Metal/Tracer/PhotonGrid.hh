@@ -0,0 +1,107 @@
+#ifndef PhotonGrid_h
+#define PhotonGrid_h
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+#include <dispatch/dispatch.h>
+
+#include "Common.hh"
+#include "Camera.hh"
+#include "Photon.hh"
+
+// Counting sort of the photons into hash cells: count per cell, exclusive prefix sum, scatter.
+// cellStart[h] .. cellStart[h+1] are the entries of every photon hashed into h,
+// photons outside the photon box are left out.
+struct PhotonGrid {
+
+    uint32_t cellCount = PHOTON_HASH_CELLS;
+
+    std::unique_ptr<std::atomic<uint32_t>[]> counts { new std::atomic<uint32_t>[PHOTON_HASH_CELLS] };
+    std::vector<uint32_t> cellOf;
+    std::vector<uint64_t> keyOf;
+
+    // Returns the number of photons placed in the grid
+    uint32_t build(const PhotonPacked* photons, uint32_t photonCount, const Complex& complex,
+                   uint32_t* cellStart, PhotonCellEntry* entries)
+    {
+        cellOf.resize(photonCount);
+        keyOf.resize(photonCount);
+
+        let queue = dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0);
+        const uint32_t chunks = 64;
+
+        let photonQuota = (photonCount + chunks - 1) / chunks;
+        let cellQuota = (cellCount + chunks - 1) / chunks;
+
+        auto counts = this->counts.get();
+        auto cellOf = this->cellOf.data();
+        auto keyOf = this->keyOf.data();
+        
+        let box = complex.photonBox;
+        let hashScale = complex.photonHashScale;
+
+        dispatch_apply(chunks, queue, ^(size_t c) {
+            for (uint32_t i = c * cellQuota; i < std::min(cellCount, uint32_t(c + 1) * cellQuota); ++i) {
+                counts[i].store(0, std::memory_order_relaxed);
+            }
+        });
+
+        dispatch_apply(chunks, queue, ^(size_t c) {
+            for (uint32_t i = c * photonQuota; i < std::min(photonCount, uint32_t(c + 1) * photonQuota); ++i) {
+
+                cellOf[i] = UINT32_MAX;
+
+                // Outside the padded bounds of the camera records no query can reach the photon
+                let p = simd_make_float3(photons[i].position.x, photons[i].position.y, photons[i].position.z);
+                if (simd_any(p < box.mini) || simd_any(p > box.maxi)) { continue; }
+
+                let cell = (p - box.mini) * hashScale;
+                let key = PhotonCellKey(uint32_t(cell.x), uint32_t(cell.y), uint32_t(cell.z));
+                let h = PhotonCellHash(key);
+
+                cellOf[i] = h; keyOf[i] = key;
+                counts[h].fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+
+        // Scan inside each chunk, then offset every chunk by the total of the chunks before it
+        uint32_t chunkSum[chunks + 1] = {};
+        uint32_t* chunkSumPtr = chunkSum;
+
+        dispatch_apply(chunks, queue, ^(size_t c) {
+            uint32_t sum = 0;
+            for (uint32_t i = c * cellQuota; i < std::min(cellCount, uint32_t(c + 1) * cellQuota); ++i) {
+                cellStart[i] = sum;
+                sum += counts[i].load(std::memory_order_relaxed);
+            }
+            chunkSumPtr[c + 1] = sum;
+        });
+
+        for (uint32_t c = 0; c < chunks; ++c) {
+            chunkSum[c + 1] += chunkSum[c];
+        }
+        cellStart[cellCount] = chunkSum[chunks];
+
+        dispatch_apply(chunks, queue, ^(size_t c) {
+            for (uint32_t i = c * cellQuota; i < std::min(cellCount, uint32_t(c + 1) * cellQuota); ++i) {
+                cellStart[i] += chunkSumPtr[c];
+                counts[i].store(cellStart[i], std::memory_order_relaxed);
+            }
+        });
+
+        // Counters now hold the write cursor of each cell
+        dispatch_apply(chunks, queue, ^(size_t c) {
+            for (uint32_t i = c * photonQuota; i < std::min(photonCount, uint32_t(c + 1) * photonQuota); ++i) {
+                if (cellOf[i] == UINT32_MAX) { continue; }
+                entries[counts[cellOf[i]].fetch_add(1, std::memory_order_relaxed)] = { keyOf[i], i };
+            }
+        });
+
+        return cellStart[cellCount];
+    }
+};
+
+#endif /* PhotonGrid_h */
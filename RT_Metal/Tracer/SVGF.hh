@@ -0,0 +1,560 @@
+#ifndef SVGF_h
+#define SVGF_h
+
+#include <cmath>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+// Spatiotemporal variance-guided filter on the CPU, Schied et al., Spatiotemporal Variance-Guided
+// Filtering: Real-Time Reconstruction for Path-Traced Global Illumination. Standard C++ only, so it
+// runs where MPSSVGFDenoiser does not exist. Every channel is a plane of its own and the row loops
+// read neighbours at a fixed offset, so the compiler vectorises them; rows are split over the cores.
+
+#define SVGF_LEVELS 5        // à-trous iterations, steps 1, 2, 4, 8, 16
+#define SVGF_HISTORY_CAP 32  // frames a reprojected history may count
+#define SVGF_ALPHA 0.2f      // least weight of the new frame once the history is long enough
+#define SVGF_PHI_COLOR 4.0f  // edge-stopping on luminance, in standard deviations
+#define SVGF_WEIGHT_MIN 1e-6f // lighter taps are dropped, their squares would reach denormals
+#define SVGF_BLOCK 256        // pixels of a row filtered together, their sums stay in the L1 cache
+
+// Half and single precision, without branches so the conversion of whole planes vectorises
+inline float SVGFHalfToFloat(uint16_t h) {
+    uint32_t sign = uint32_t(h & 0x8000u) << 16;
+    uint32_t exponent = (h >> 10) & 0x1Fu;
+    uint32_t mantissa = h & 0x3FFu;
+
+    uint32_t normal = (exponent == 0x1F ? 0x7F800000u : (exponent + 112) << 23) | (mantissa << 13);
+    float subnormal = float(mantissa) * 5.9604645e-8f;
+
+    uint32_t bits; std::memcpy(&bits, &subnormal, sizeof(bits));
+    bits = sign | (exponent == 0 ? bits : normal);
+
+    float f; std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Rounds to nearest, what is too small for a normal half becomes zero
+inline uint16_t SVGFFloatToHalf(float f) {
+    uint32_t bits; std::memcpy(&bits, &f, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000u;
+
+    bits &= 0x7FFFFFFFu;
+    uint32_t h = (bits + 0xFFFu + ((bits >> 13) & 1) - 0x38000000u) >> 13;
+    h = bits < 0x38800000u ? 0 : h;
+    h = bits >= 0x477FF000u ? 0x7C00u : h;
+    h = bits > 0x7F800000u ? 0x7E00u : h;
+    return uint16_t(sign | h);
+}
+
+// 2^x, a cubic on the fraction scaled by the exponent bits, within 1e-4. Zero below 2^-40, as the
+// edge-stopping weights must stay clear of denormals, which are slow on x86. Free of branches and of
+// float to int conversions, which keep compilers from vectorising while they may trap.
+inline float SVGFExp2(float x) {
+    float keep = x < -40 ? 0.0f : 1.0f;
+    x = std::max(x, -40.0f);
+
+    // Adding 1.5 * 2^23 rounds away the fraction
+    float i = (x + 12582912.0f) - 12582912.0f;
+    i -= i > x ? 1.0f : 0.0f;
+
+    float f = x - i;
+    float p = 1 + f * (0.6960656f + f * (0.2244943f + f * 0.0794402f));
+
+    // Above 2^23 the mantissa holds the integer part, which becomes the biased exponent
+    float biased = i + (127.0f + 8388608.0f);
+    uint32_t bits; std::memcpy(&bits, &biased, sizeof(bits));
+    bits = (bits & 0x7FFFFFu) << 23;
+
+    float scale; std::memcpy(&scale, &bits, sizeof(scale));
+    return keep * scale * p;
+}
+
+inline float SVGFExp(float x) {
+    return SVGFExp2(x * 1.4426950f);
+}
+
+// Edge-stopping on normals, the cosine to the 128th, nothing under 0.7 so no power becomes a denormal
+inline float SVGFNormalWeight(float cosine) {
+    float c = cosine > 0.7f ? cosine : 0.0f;
+    c *= c; c *= c; c *= c; c *= c; c *= c; c *= c; c *= c;
+    return c;
+}
+
+// Threads kept for the life of the filter, the twenty or so passes of a frame wake them instead of
+// starting new ones on the path of the frame
+struct SVGFWorkers {
+
+    ~SVGFWorkers() { stop(); }
+
+    // With the calling thread
+    uint32_t count() const { return uint32_t(threads.size()) + 1; }
+
+    void start(uint32_t n) {
+        stop();
+        quit = false;
+        for (uint32_t i = 0; i < n; ++i) {
+            threads.emplace_back([this, seen = generation] { loop(seen); });
+        }
+    }
+
+    // Every worker and the calling thread run work, returns once all of them are done
+    void run(const std::function<void()>& work) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &work; busy = uint32_t(threads.size()); ++generation;
+        }
+        wake.notify_all();
+        work();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return busy == 0; });
+    }
+
+private:
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+
+    const std::function<void()>* job = nullptr;
+    uint64_t generation = 0;
+    uint32_t busy = 0;
+    bool quit = false;
+
+    void loop(uint64_t seen) {
+        for (;;) {
+            const std::function<void()>* work;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return quit || generation != seen; });
+                if (quit) { return; }
+                seen = generation; work = job;
+            }
+            (*work)();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy == 0) { done.notify_one(); }
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (auto& thread : threads) { thread.join(); }
+        threads.clear();
+    }
+};
+
+struct SVGF {
+
+    uint32_t width = 0, height = 0;
+
+    typedef std::vector<float> Plane;
+
+    struct Geometry {
+        Plane depth, nx, ny, nz;
+        Plane inverseGradient; // of the largest depth difference to the next pixel, the scale of the depth test
+
+        void resize(size_t n) {
+            for (auto plane : { &depth, &nx, &ny, &nz, &inverseGradient }) { plane->assign(n, 0); }
+        }
+    };
+
+    struct Color {
+        Plane r, g, b, variance;
+
+        void resize(size_t n) {
+            for (auto plane : { &r, &g, &b, &variance }) { plane->assign(n, 0); }
+        }
+    };
+
+    Geometry geometry, previous;
+    Plane motionX, motionY;
+
+    // Integrated through the history, what the next frame reprojects
+    Color history;
+    Plane moment1, moment2, length;
+    Plane nextMoment1, nextMoment2, nextLength;
+
+    Color input;          // this frame
+    Color level[2];       // ping-pong of the à-trous iterations
+    Plane luma, inverseSigma; // luminance of the current iteration and its edge-stopping scale
+
+    mutable SVGFWorkers workers;
+
+    void resize(uint32_t w, uint32_t h) {
+        width = w; height = h;
+        size_t n = size_t(w) * h;
+
+        geometry.resize(n); previous.resize(n);
+        history.resize(n); input.resize(n);
+        level[0].resize(n); level[1].resize(n);
+
+        for (auto plane : { &motionX, &motionY, &moment1, &moment2, &length, &luma, &inverseSigma,
+                            &nextMoment1, &nextMoment2, &nextLength }) { plane->assign(n, 0); }
+
+        workers.start(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    }
+
+    // Drops the history, every pixel of the next frame starts over
+    void clear() {
+        std::fill(previous.depth.begin(), previous.depth.end(), 0.0f);
+    }
+
+    // color and zNormal are RGBA half as the kernels write them, zNormal holds t / 1024 then the shading
+    // normal, zero where the camera ray escaped. motion is RG half, the offset in pixels of every pixel
+    // from where it was in the previous frame. output is RGBA half.
+    void denoise(const uint16_t* color, const uint16_t* zNormal, const uint16_t* motion, uint16_t* output) {
+
+        load(color, zNormal, motion);
+        reproject();
+        estimateVariance();
+
+        // The history keeps the first iteration, filtered enough to stop noise from piling up
+        atrous(level[0], history, 1);
+
+        const Color* source = &history;
+        for (uint32_t i = 1; i < SVGF_LEVELS; ++i) {
+            atrous(*source, level[i & 1], 1 << i);
+            source = &level[i & 1];
+        }
+
+        const auto& result = *source;
+
+        parallel([&](uint32_t y0, uint32_t y1) {
+            for (size_t i = size_t(y0) * width; i < size_t(y1) * width; ++i) {
+                // Escaped rays have nothing to guide the filter, the environment stays as it is
+                const auto hit = geometry.depth[i] > 0;
+                output[i * 4 + 0] = SVGFFloatToHalf(hit ? result.r[i] : input.r[i]);
+                output[i * 4 + 1] = SVGFFloatToHalf(hit ? result.g[i] : input.g[i]);
+                output[i * 4 + 2] = SVGFFloatToHalf(hit ? result.b[i] : input.b[i]);
+                output[i * 4 + 3] = SVGFFloatToHalf(1.0f);
+            }
+        });
+
+        std::swap(geometry, previous);
+    }
+
+private:
+
+    static float luminance(float r, float g, float b) {
+        return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+    }
+
+    // Bands of rows handed out to a worker per core as they finish the last, so slower cores take fewer
+    template <typename Rows>
+    void parallel(const Rows& rows) const {
+        const uint32_t band = 16;
+        std::atomic<uint32_t> next { 0 };
+
+        workers.run([&] {
+            for (uint32_t y0; (y0 = next.fetch_add(band)) < height;) {
+                rows(y0, std::min(height, y0 + band));
+            }
+        });
+    }
+
+    void load(const uint16_t* color, const uint16_t* zNormal, const uint16_t* motion) {
+
+        parallel([&](uint32_t y0, uint32_t y1) {
+            for (size_t i = size_t(y0) * width; i < size_t(y1) * width; ++i) {
+                input.r[i] = SVGFHalfToFloat(color[i * 4 + 0]);
+                input.g[i] = SVGFHalfToFloat(color[i * 4 + 1]);
+                input.b[i] = SVGFHalfToFloat(color[i * 4 + 2]);
+
+                geometry.depth[i] = SVGFHalfToFloat(zNormal[i * 4 + 0]);
+                geometry.nx[i] = SVGFHalfToFloat(zNormal[i * 4 + 1]);
+                geometry.ny[i] = SVGFHalfToFloat(zNormal[i * 4 + 2]);
+                geometry.nz[i] = SVGFHalfToFloat(zNormal[i * 4 + 3]);
+
+                motionX[i] = SVGFHalfToFloat(motion[i * 2 + 0]);
+                motionY[i] = SVGFHalfToFloat(motion[i * 2 + 1]);
+            }
+        });
+
+        parallel([&](uint32_t y0, uint32_t y1) {
+            for (uint32_t y = y0; y < y1; ++y) {
+                for (uint32_t x = 0; x < width; ++x) {
+                    const auto i = size_t(y) * width + x;
+                    const auto right = x + 1 < width ? i + 1 : i - 1;
+                    const auto below = y + 1 < height ? i + width : i - width;
+                    const auto& d = geometry.depth;
+                    geometry.inverseGradient[i] = 1 / (std::max(std::abs(d[right] - d[i]), std::abs(d[below] - d[i])) + 1e-4f);
+                }
+            }
+        });
+    }
+
+    // Same surface in both frames, close in depth and orientation
+    bool consistent(size_t i, size_t j) const {
+        const auto d = geometry.depth[i], dp = previous.depth[j];
+        if (d <= 0 || dp <= 0 || std::abs(d - dp) > 0.1f * d) { return false; }
+
+        const auto cosine = geometry.nx[i] * previous.nx[j] + geometry.ny[i] * previous.ny[j] + geometry.nz[i] * previous.nz[j];
+        return cosine > 0.9f;
+    }
+
+    // Bilinear fetch of the history under the previous position of every pixel, taps on other surfaces
+    // dropped, then the exponential moving average of the color and its first two luminance moments
+    void reproject() {
+
+        parallel([&](uint32_t y0, uint32_t y1) {
+            for (uint32_t y = y0; y < y1; ++y) {
+                for (uint32_t x = 0; x < width; ++x) {
+
+                    const auto i = size_t(y) * width + x;
+                    const auto r = input.r[i], g = input.g[i], b = input.b[i];
+                    const auto l = luminance(r, g, b);
+
+                    const auto px = x - motionX[i], py = y - motionY[i];
+                    const auto fx = std::floor(px), fy = std::floor(py);
+
+                    float weight = 0, hr = 0, hg = 0, hb = 0, h1 = 0, h2 = 0, hl = 0;
+
+                    for (int tap = 0; tap < 4 && std::isfinite(px) && std::isfinite(py); ++tap) {
+                        const auto tx = long(fx) + (tap & 1), ty = long(fy) + (tap >> 1);
+                        if (tx < 0 || ty < 0 || tx >= long(width) || ty >= long(height)) { continue; }
+
+                        const auto j = size_t(ty) * width + tx;
+                        if (!consistent(i, j)) { continue; }
+
+                        const auto w = ((tap & 1) ? px - fx : 1 - (px - fx)) * ((tap >> 1) ? py - fy : 1 - (py - fy));
+                        weight += w;
+                        hr += w * history.r[j]; hg += w * history.g[j]; hb += w * history.b[j];
+                        h1 += w * moment1[j]; h2 += w * moment2[j]; hl += w * length[j];
+                    }
+
+                    // Too little of the footprint survived, the pixel starts over
+                    const auto n = weight > 0.01f ? std::min(hl / weight + 1, float(SVGF_HISTORY_CAP)) : 1.0f;
+                    const auto alpha = std::max(1 / n, SVGF_ALPHA);
+                    const auto keep = weight > 0.01f ? (1 - alpha) / weight : 0.0f;
+                    const auto fresh = weight > 0.01f ? alpha : 1.0f;
+
+                    level[0].r[i] = keep * hr + fresh * r;
+                    level[0].g[i] = keep * hg + fresh * g;
+                    level[0].b[i] = keep * hb + fresh * b;
+
+                    nextMoment1[i] = keep * h1 + fresh * l;
+                    nextMoment2[i] = keep * h2 + fresh * l * l;
+                    nextLength[i] = n;
+                }
+            }
+        });
+
+        std::swap(moment1, nextMoment1);
+        std::swap(moment2, nextMoment2);
+        std::swap(length, nextLength);
+    }
+
+    // Variance from the temporal moments, or from the 7x7 neighbourhood on the same surface while
+    // the history is shorter than 4 frames, scaled up for how little it has seen
+    void estimateVariance() {
+
+        parallel([&](uint32_t y0, uint32_t y1) {
+
+            Plane sw(width), s1(width), s2(width), unused(width);
+
+            for (uint32_t y = y0; y < y1; ++y) {
+
+                const auto row = size_t(y) * width;
+
+                for (uint32_t x = 0; x < width; ++x) {
+                    level[0].variance[row + x] = std::max(0.0f, moment2[row + x] - moment1[row + x] * moment1[row + x]);
+                }
+
+                // Most rows have a long enough history everywhere once the first frames are through
+                bool spatial = false;
+                for (uint32_t x = 0; x < width; ++x) {
+                    spatial |= length[row + x] < 4 && geometry.depth[row + x] > 0;
+                }
+                if (!spatial) { continue; }
+
+                std::fill(sw.begin(), sw.end(), 0.0f);
+                std::fill(s1.begin(), s1.end(), 0.0f);
+                std::fill(s2.begin(), s2.end(), 0.0f);
+
+                for (int dy = -3; dy <= 3; ++dy) {
+                    for (int dx = -3; dx <= 3; ++dx) {
+                        const auto neighbours = size_t(std::clamp(long(y) + dy, 0l, long(height) - 1)) * width;
+                        const auto inverseDistance = 1.0f / std::max(1, std::abs(dx) + std::abs(dy));
+
+                        const auto run = [&](uint32_t x, size_t qx, uint32_t count) {
+                            accumulateMoments(span(level[0], row + x), span(level[0], neighbours + qx),
+                                              &moment1[neighbours + qx], &moment2[neighbours + qx], inverseDistance, count,
+                                              { &sw[x], &s1[x], &s2[x], &unused[x], &unused[x] });
+                        };
+                        edges(dx, 0, width, run);
+                    }
+                }
+
+                for (uint32_t x = 0; x < width; ++x) {
+                    const auto i = row + x;
+                    if (length[i] >= 4 || geometry.depth[i] <= 0 || sw[x] <= 0) { continue; }
+
+                    const auto m1 = s1[x] / sw[x], m2 = s2[x] / sw[x];
+                    level[0].variance[i] = std::max(0.0f, m2 - m1 * m1) * 4 / length[i];
+                }
+            }
+        });
+    }
+
+    // Runs a tap at a horizontal offset over pixels x0 to x1 of a row, those whose neighbour falls outside
+    // repeat the edge, the rest read at a constant offset
+    template <typename Run>
+    void edges(long offset, uint32_t x0, uint32_t x1, const Run& run) const {
+        const auto lo = uint32_t(std::clamp(-offset, long(x0), long(x1)));
+        const auto hi = uint32_t(std::clamp(long(width) - offset, long(lo), long(x1)));
+
+        for (uint32_t x = x0; x < lo; ++x) { run(x, 0, 1); }
+        if (hi > lo) { run(lo, size_t(long(lo) + offset), hi - lo); }
+        for (uint32_t x = hi; x < x1; ++x) { run(x, width - 1, 1); }
+    }
+
+    // Planes of a row from one pixel on, none overlapping another, which the compilers need to hear
+    // before they vectorise a loop over this many streams
+    struct Span {
+        const float* __restrict r; const float* __restrict g; const float* __restrict b;
+        const float* __restrict variance; const float* __restrict luma; const float* __restrict inverseSigma;
+        const float* __restrict depth; const float* __restrict inverseGradient;
+        const float* __restrict nx; const float* __restrict ny; const float* __restrict nz;
+    };
+
+    Span span(const Color& c, size_t i) const {
+        return { &c.r[i], &c.g[i], &c.b[i], &c.variance[i], &luma[i], &inverseSigma[i],
+                 &geometry.depth[i], &geometry.inverseGradient[i], &geometry.nx[i], &geometry.ny[i], &geometry.nz[i] };
+    }
+
+    struct Sums {
+        float* __restrict w; float* __restrict r; float* __restrict g; float* __restrict b; float* __restrict variance;
+    };
+
+    // Adds the tap of weight h at the given distance, in pixels, to count pixels of a row, where the filter spends its time
+    static void accumulate(Span c, Span t, float h, float inverseDistance, uint32_t count, Sums s) {
+
+        for (uint32_t x = 0; x < count; ++x) {
+            const auto z = std::abs(c.depth[x] - t.depth[x]) * c.inverseGradient[x] * inverseDistance;
+            const auto l = std::abs(c.luma[x] - t.luma[x]) * c.inverseSigma[x];
+
+            const auto cosine = c.nx[x] * t.nx[x] + c.ny[x] * t.ny[x] + c.nz[x] * t.nz[x];
+
+            auto w = h * SVGFExp(-z - l) * SVGFNormalWeight(cosine);
+            w = w > SVGF_WEIGHT_MIN ? w : 0.0f;
+
+            s.w[x] += w;
+            s.r[x] += w * t.r[x]; s.g[x] += w * t.g[x]; s.b[x] += w * t.b[x];
+            s.variance[x] += w * w * t.variance[x];
+        }
+    }
+
+    // The luminance moments over a box, with the depth and normal terms only
+    static void accumulateMoments(Span c, Span t, const float* __restrict m1, const float* __restrict m2,
+                                  float inverseDistance, uint32_t count, Sums s) {
+
+        for (uint32_t x = 0; x < count; ++x) {
+            const auto z = std::abs(c.depth[x] - t.depth[x]) * c.inverseGradient[x] * inverseDistance;
+            const auto cosine = c.nx[x] * t.nx[x] + c.ny[x] * t.ny[x] + c.nz[x] * t.nz[x];
+
+            auto w = SVGFExp(-z) * SVGFNormalWeight(cosine);
+            w = w > SVGF_WEIGHT_MIN ? w : 0.0f;
+
+            s.w[x] += w;
+            s.r[x] += w * m1[x]; s.g[x] += w * m2[x];
+        }
+    }
+
+    // One iteration of the edge-aware wavelet, the 3x3 B-spline with holes of the given step, every tap
+    // over a block of a row at once. Five of them reach 31 pixels, with a third of the taps of the 5x5 spline.
+    void atrous(const Color& source, Color& target, int step) {
+
+        parallel([&](uint32_t y0, uint32_t y1) {
+            for (size_t i = size_t(y0) * width; i < size_t(y1) * width; ++i) {
+                luma[i] = luminance(source.r[i], source.g[i], source.b[i]);
+            }
+        });
+
+        // Luminance scale from the variance blurred over 3x3, less noisy than the variance of one pixel
+        parallel([&](uint32_t y0, uint32_t y1) {
+
+            Plane blurred(width);
+
+            for (uint32_t y = y0; y < y1; ++y) {
+
+                const auto row = size_t(y) * width;
+                const float* up = &source.variance[y > 0 ? row - width : row];
+                const float* middle = &source.variance[row];
+                const float* down = &source.variance[y + 1 < height ? row + width : row];
+
+                for (uint32_t x = 0; x < width; ++x) {
+                    blurred[x] = 0.25f * up[x] + 0.5f * middle[x] + 0.25f * down[x];
+                }
+                for (uint32_t x = 0; x < width; ++x) {
+                    const auto left = blurred[x > 0 ? x - 1 : x], right = blurred[x + 1 < width ? x + 1 : x];
+                    const auto v = 0.25f * left + 0.5f * blurred[x] + 0.25f * right;
+                    inverseSigma[row + x] = 1 / (SVGF_PHI_COLOR * std::sqrt(std::max(0.0f, v)) + 1e-6f);
+                }
+            }
+        });
+
+        const float kernel[2] = { 1.0f / 2, 1.0f / 4 };
+
+        parallel([&](uint32_t y0, uint32_t y1) {
+
+            float sw[SVGF_BLOCK], sr[SVGF_BLOCK], sg[SVGF_BLOCK], sb[SVGF_BLOCK], sv[SVGF_BLOCK];
+
+            for (uint32_t y = y0; y < y1; ++y) for (uint32_t x0 = 0; x0 < width; x0 += SVGF_BLOCK) {
+
+                const auto row = size_t(y) * width;
+                const auto x1 = std::min(width, x0 + SVGF_BLOCK);
+
+                // The centre has weight one, whatever the edge-stopping says
+                for (uint32_t x = x0; x < x1; ++x) {
+                    const auto h = kernel[0] * kernel[0];
+                    sw[x - x0] = h;
+                    sr[x - x0] = h * source.r[row + x]; sg[x - x0] = h * source.g[row + x]; sb[x - x0] = h * source.b[row + x];
+                    sv[x - x0] = h * h * source.variance[row + x];
+                }
+
+                for (int ty = -1; ty <= 1; ++ty) {
+                    for (int tx = -1; tx <= 1; ++tx) {
+
+                        if (tx == 0 && ty == 0) { continue; }
+
+                        const auto h = kernel[std::abs(tx)] * kernel[std::abs(ty)];
+                        const auto inverseDistance = 1.0f / float(step * (std::abs(tx) + std::abs(ty)));
+
+                        const auto qy = std::clamp(long(y) + ty * step, 0l, long(height) - 1);
+                        const auto offset = long(tx) * step;
+                        const auto neighbours = size_t(qy) * width;
+
+                        const auto run = [&](uint32_t x, size_t qx, uint32_t count) {
+                            accumulate(span(source, row + x), span(source, neighbours + qx), h, inverseDistance, count,
+                                       { &sw[x - x0], &sr[x - x0], &sg[x - x0], &sb[x - x0], &sv[x - x0] });
+                        };
+
+                        edges(offset, x0, x1, run);
+                    }
+                }
+
+                for (uint32_t x = x0; x < x1; ++x) {
+                    const auto w = sw[x - x0];
+                    target.r[row + x] = sr[x - x0] / w;
+                    target.g[row + x] = sg[x - x0] / w;
+                    target.b[row + x] = sb[x - x0] / w;
+                    target.variance[row + x] = sv[x - x0] / (w * w);
+                }
+            }
+        });
+    }
+};
+
+#endif /* SVGF_h */
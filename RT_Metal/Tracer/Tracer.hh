@@ -17,6 +17,10 @@
 #include "Square.hh"
 #include "Sphere.hh"
 
+#include "Light.hh"
+#include "LightBVH.hh"
+#include "Distribution.hh"
+
 inline float Radians(float degree) {
     return degree * M_PI / 180;
 }
@@ -44,6 +48,15 @@ void prepareCubeList(std::vector<Cube>& list, std::vector<Material>& materials);
 void prepareCornellBox(std::vector<Square>& list, std::vector<Material>& materials);
 void prepareSphereList(std::vector<Sphere>& list, std::vector<Material>& materials);
 
+void prepareLightList(std::vector<Square>& squares, const std::vector<Material>& materials,
+                      std::vector<Light>& lights, std::vector<AliasBin>& aliasTable);
+
+void prepareLightTree(const std::vector<Square>& squares, std::vector<Light>& lights,
+                      std::vector<LightBVHNode>& lightTree);
+
+Distribution2D prepareEnvironmentDistribution(std::vector<float>& luminance, uint32_t nu, uint32_t nv,
+                                              std::vector<float>& data);
+
 void prepareCamera(Camera* pointer, float2 viewSize, float2 rotate, float3 _offset);
 
 #endif /* Tracer_h */
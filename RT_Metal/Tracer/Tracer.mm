@@ -148,6 +148,7 @@ Square MakeSquare(uint8_t axis_i, float2 range_i, uint8_t axis_j, float2 range_j
     
     r.boundingBOX = AABB::make(a, b);
     r.model_matrix = matrix_identity_float4x4;
+    r.light = UINT_MAX;
     
     return r;
 }
@@ -303,6 +304,79 @@ void prepareCornellBox(std::vector<Square>& list, std::vector<Material>& materia
     list.emplace_back(little);
 }
 
+void prepareLightList(std::vector<Square>& squares, const std::vector<Material>& materials,
+                      std::vector<Light>& lights, std::vector<AliasBin>& aliasTable) {
+    
+    std::vector<float> power;
+    
+    for (uint32_t i=0; i<squares.size(); i++) {
+        
+        auto& square = squares[i];
+        auto& material = materials[square.material];
+        
+        if (material.type != MaterialType::Diffuse) { continue; }
+        
+        auto area = (square.range_i.y - square.range_i.x) * (square.range_j.y - square.range_j.x);
+        auto luminance = simd_dot(material.textureInfo.albedo, float3{0.2126, 0.7152, 0.0722});
+        
+        square.light = (uint32_t)lights.size();
+        
+        Light light { PrimitiveType::Square, i, (int)LightFlags::Area, 0 };
+        lights.emplace_back(light);
+        // Both faces emit
+        power.emplace_back(luminance * M_PI * 2 * area);
+    }
+    
+    std::vector<float> pmf;
+    aliasTable = BuildAliasTable(power, pmf);
+    
+    for (uint32_t i=0; i<lights.size(); i++) {
+        lights[i].pmf = pmf[i];
+    }
+}
+
+void prepareLightTree(const std::vector<Square>& squares, std::vector<Light>& lights,
+                      std::vector<LightBVHNode>& lightTree) {
+    
+    std::vector<std::pair<uint32_t, LightBounds>> items;
+    
+    for (uint32_t i=0; i<lights.size(); i++) {
+        
+        auto& square = squares[lights[i].pIndex];
+        
+        LightBounds lb;
+        lb.bounds = square.boundingBOX;
+        lb.w = float3{0, 0, 0}; lb.w[square.axis_k] = 1;
+        // Same weight as the alias table, so both pick by power when far away
+        lb.phi = lights[i].pmf;
+        lb.cosTheta_o = 1;
+        lb.cosTheta_e = 0;
+        lb.twoSided = true;
+        
+        items.emplace_back(i, lb);
+    }
+    
+    LightBVH tree;
+    tree.build(items, lights);
+    lightTree = tree.nodes;
+}
+
+Distribution2D prepareEnvironmentDistribution(std::vector<float>& luminance, uint32_t nu, uint32_t nv,
+                                              std::vector<float>& data) {
+    
+    // Rows near the poles cover less solid angle in the lat-long map
+    for (uint32_t v=0; v<nv; v++) {
+        auto latitude = ((v + 0.5f) / nv - 0.5f) * M_PI;
+        auto cosLatitude = cosf(latitude);
+        
+        for (uint32_t u=0; u<nu; u++) {
+            luminance[v * nu + u] *= cosLatitude;
+        }
+    }
+    
+    return Distribution2D::make(luminance, nu, nv, data);
+}
+
 void prepareSphereList(std::vector<Sphere>& list, std::vector<Material>& materials) {
     
     Material glass; glass.type = MaterialType::Dielectric;
@@ -0,0 +1,191 @@
+#ifndef VolumeCache_h
+#define VolumeCache_h
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Common.hh"
+#include "Medium.hh"
+
+// Binary cache of a parsed density grid, so the ASCII pbrt volume is only parsed once.
+// Layout: header page, then majorant grid, brick table and brick data, each starting on a page
+// and padded to whole pages, so every section can be wrapped in a Metal buffer over the mapping.
+// The wrapped sections are only the source of the upload, copyToHeap copies them into the heap.
+
+#define VOLUME_CACHE_PAGE 16384
+#define VOLUME_CACHE_VERSION 3
+
+struct VolumeCacheSection {
+    uint64_t offset;
+    uint64_t length; // bytes in use, the mapped range is rounded up to VOLUME_CACHE_PAGE
+
+    uint64_t mapped() const {
+        return (length + VOLUME_CACHE_PAGE - 1) / VOLUME_CACHE_PAGE * VOLUME_CACHE_PAGE;
+    }
+};
+
+struct VolumeCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sampler;
+
+    uint64_t sourceKey;
+
+    GridDensityInfo info;
+    float maxDensity;
+    float3 p0, p1;
+
+    VolumeCacheSection majorant, table, bricks;
+};
+
+static_assert(sizeof(VolumeCacheHeader) <= VOLUME_CACHE_PAGE, "Header must fit in its page");
+
+// Identifies the source files by size and modification time, and every parameter the
+// cached majorants and bricks are built with
+inline uint64_t VolumeCacheKey(const std::vector<std::string>& paths,
+                               float sigma_a, float sigma_s, float g, uint bits) {
+
+    uint64_t key = 0xcbf29ce484222325ull;
+
+    auto mix = [&](uint64_t v) {
+        for (int i = 0; i < 8; ++i) {
+            key ^= (v >> (i * 8)) & 0xff;
+            key *= 0x100000001b3ull;
+        }
+    };
+
+    for (auto& path : paths) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) { return 0; }
+        mix(st.st_size);
+        mix(st.st_mtime);
+    }
+
+    for (float v : { sigma_a, sigma_s, g }) {
+        uint32_t b; memcpy(&b, &v, sizeof(b)); mix(b);
+    }
+    mix(bits);
+    mix(MAJORANT_CELL);
+    mix(DENSITY_BRICK);
+    mix(VOLUME_CACHE_VERSION);
+    return key;
+}
+
+inline bool WriteVolumeCache(const char* path, VolumeCacheHeader header,
+                             const std::vector<float>& majorant,
+                             const std::vector<DensityBrick>& table,
+                             const std::vector<uint8_t>& bricks)
+{
+    memcpy(header.magic, "TRVOLUME", 8);
+    header.version = VOLUME_CACHE_VERSION;
+
+    uint64_t offset = VOLUME_CACHE_PAGE;
+
+    auto place = [&](VolumeCacheSection& section, uint64_t length) {
+        section = { offset, length };
+        offset += section.mapped();
+    };
+
+    place(header.majorant, sizeof(float) * majorant.size());
+    place(header.table, sizeof(DensityBrick) * table.size());
+    place(header.bricks, bricks.size());
+
+    // Write to a temporary name first, so a partial file never passes validation
+    auto temp = std::string(path) + ".tmp";
+
+    FILE* file = fopen(temp.c_str(), "wb");
+    if (file == nullptr) { return false; }
+
+    bool ok = true;
+
+    auto write = [&](const void* data, uint64_t length, uint64_t at) {
+        if (!ok) { return; }
+        ok = fseeko(file, at, SEEK_SET) == 0;
+        if (length > 0) {
+            ok = ok && fwrite(data, length, 1, file) == 1;
+        }
+    };
+
+    write(&header, sizeof(header), 0);
+    write(majorant.data(), header.majorant.length, header.majorant.offset);
+    write(table.data(), header.table.length, header.table.offset);
+    write(bricks.data(), header.bricks.length, header.bricks.offset);
+
+    // Extend to the padded size of the last section
+    ok = ok && ftruncate(fileno(file), offset) == 0;
+    ok = (fclose(file) == 0) && ok;
+
+    if (ok) { ok = rename(temp.c_str(), path) == 0; }
+    if (!ok) { unlink(temp.c_str()); }
+
+    return ok;
+}
+
+struct VolumeCache {
+
+    uint8_t* mapping = nullptr;
+    uint64_t size = 0;
+
+    VolumeCacheHeader header;
+
+    // Maps the cache, fails if it is missing, truncated or built from other sources
+    bool open(const char* path, uint64_t sourceKey) {
+
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) { return false; }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < VOLUME_CACHE_PAGE) { ::close(fd); return false; }
+
+        size = st.st_size;
+        // Copy-on-write, Metal wants writable pages behind newBufferWithBytesNoCopy
+        void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+
+        if (ptr == MAP_FAILED) { return false; }
+        mapping = (uint8_t*)ptr;
+
+        memcpy(&header, mapping, sizeof(header));
+
+        bool valid = memcmp(header.magic, "TRVOLUME", 8) == 0
+                  && header.version == VOLUME_CACHE_VERSION
+                  && header.sourceKey == sourceKey && sourceKey != 0;
+
+        for (auto section : { header.majorant, header.table, header.bricks }) {
+            valid = valid && section.offset % VOLUME_CACHE_PAGE == 0
+                          && section.offset + section.mapped() <= size;
+        }
+
+        if (!valid) { close(); return false; }
+
+        madvise(mapping + header.bricks.offset, header.bricks.mapped(), MADV_WILLNEED);
+        return true;
+    }
+
+    void* data(const VolumeCacheSection& section) const {
+        return mapping + section.offset;
+    }
+
+    // Unmaps only the header page, the sections stay mapped until their owners release them
+    void releaseHeader() {
+        if (mapping == nullptr) { return; }
+        munmap(mapping, VOLUME_CACHE_PAGE);
+        mapping = nullptr;
+    }
+
+    void close() {
+        if (mapping == nullptr) { return; }
+        munmap(mapping, size);
+        mapping = nullptr;
+    }
+};
+
+#endif /* VolumeCache_h */